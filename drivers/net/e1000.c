@@ -4,9 +4,11 @@
 
 #include <drivers/e1000.h>
 #include <drivers/pci.h>
+#include <kernel/kernel.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/heap.h>
+#include <mm/vmalloc.h>
 #include <drivers/serial.h>
 #include <string.h>
 
@@ -21,6 +23,8 @@ static uint32_t tx_descs_phys;
 
 static uint8_t *rx_buffers[E1000_NUM_RX_DESC];
 static uint32_t rx_buffers_phys[E1000_NUM_RX_DESC];
+static uint8_t *tx_buffers[E1000_NUM_TX_DESC];
+static uint32_t tx_buffers_phys[E1000_NUM_TX_DESC];
 
 static uint16_t rx_cur = 0;
 static uint16_t tx_cur = 0;
@@ -71,19 +75,56 @@ static void e1000_read_mac(void)
     serial_puts("\n");
 }
 
-static void e1000_init_rx(void)
+/* Allocate a physically contiguous DMA region and map it in the vmalloc
+ * region. The device walks rings and buffers by physical address, so a
+ * single contiguous block replaces the old one-frame-per-buffer
+ * allocations.
+ */
+static void *e1000_alloc_dma(uint32_t size, uint32_t *phys_out)
+{
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t phys = pmm_alloc_contiguous(pages, PAGE_SIZE, PMM_ZONE_DMA32);
+    if (phys == 0) {
+        return NULL;
+    }
+    
+    void *virt = vmap_phys(phys, pages * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE);
+    if (!virt) {
+        pmm_free_contiguous(phys, pages);
+        return NULL;
+    }
+    
+    *phys_out = phys;
+    return virt;
+}
+
+static void e1000_free_dma(void *virt, uint32_t phys, uint32_t size)
+{
+    vfree(virt);
+    pmm_free_contiguous(phys, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+static int e1000_init_rx(void)
 {
     uint32_t rx_ring_size = sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC;
-    rx_descs_phys = pmm_alloc_frame();
-    rx_descs = (e1000_rx_desc_t *)(rx_descs_phys + 0xC0000000);  
-    vmm_map_page((uint32_t)rx_descs & ~0xFFF, rx_descs_phys, PAGE_PRESENT | PAGE_WRITE);
+    rx_descs = (e1000_rx_desc_t *)e1000_alloc_dma(rx_ring_size, &rx_descs_phys);
+    if (!rx_descs) {
+        return -1;
+    }
     
     memset(rx_descs, 0, rx_ring_size);
     
+    uint32_t pool_phys;
+    uint8_t *pool = (uint8_t *)e1000_alloc_dma(E1000_NUM_RX_DESC * E1000_RX_BUFFER_SIZE, &pool_phys);
+    if (!pool) {
+        e1000_free_dma(rx_descs, rx_descs_phys, rx_ring_size);
+        rx_descs = NULL;
+        return -1;
+    }
+    
     for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
-        rx_buffers_phys[i] = pmm_alloc_frame();
-        rx_buffers[i] = (uint8_t *)(rx_buffers_phys[i] + 0xC0000000);
-        vmm_map_page((uint32_t)rx_buffers[i] & ~0xFFF, rx_buffers_phys[i], PAGE_PRESENT | PAGE_WRITE);
+        rx_buffers_phys[i] = pool_phys + i * E1000_RX_BUFFER_SIZE;
+        rx_buffers[i] = pool + i * E1000_RX_BUFFER_SIZE;
         
         rx_descs[i].addr = rx_buffers_phys[i];
         rx_descs[i].status = 0;
@@ -99,18 +140,30 @@ static void e1000_init_rx(void)
                             E1000_RCTL_BSIZE_2048 | E1000_RCTL_SECRC);
     
     serial_puts("[E1000] Receive initialized\n");
+    return 0;
 }
 
-static void e1000_init_tx(void)
+static int e1000_init_tx(void)
 {
     uint32_t tx_ring_size = sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC;
-    tx_descs_phys = pmm_alloc_frame();
-    tx_descs = (e1000_tx_desc_t *)(tx_descs_phys + 0xC0000000);
-    vmm_map_page((uint32_t)tx_descs & ~0xFFF, tx_descs_phys, PAGE_PRESENT | PAGE_WRITE);
+    tx_descs = (e1000_tx_desc_t *)e1000_alloc_dma(tx_ring_size, &tx_descs_phys);
+    if (!tx_descs) {
+        return -1;
+    }
     
     memset(tx_descs, 0, tx_ring_size);
     
+    uint32_t pool_phys;
+    uint8_t *pool = (uint8_t *)e1000_alloc_dma(E1000_NUM_TX_DESC * E1000_TX_BUFFER_SIZE, &pool_phys);
+    if (!pool) {
+        e1000_free_dma(tx_descs, tx_descs_phys, tx_ring_size);
+        tx_descs = NULL;
+        return -1;
+    }
+    
     for (int i = 0; i < E1000_NUM_TX_DESC; i++) {
+        tx_buffers_phys[i] = pool_phys + i * E1000_TX_BUFFER_SIZE;
+        tx_buffers[i] = pool + i * E1000_TX_BUFFER_SIZE;
         tx_descs[i].status = E1000_TXD_STAT_DD;  
     }
     
@@ -125,6 +178,7 @@ static void e1000_init_tx(void)
                             (64 << E1000_TCTL_COLD_SHIFT));
     
     serial_puts("[E1000] Transmit initialized\n");
+    return 0;
 }
 
 int e1000_init(void)
@@ -141,10 +195,8 @@ int e1000_init(void)
     
     e1000_mmio_base = dev->bar[0] & ~0xF;
     
-    for (uint32_t i = 0; i < 0x20000; i += 0x1000) {
-        vmm_map_page(e1000_mmio_base + i, e1000_mmio_base + i, 
-                     PAGE_PRESENT | PAGE_WRITE | PAGE_PCD);
-    }
+    vmm_map_range(e1000_mmio_base, e1000_mmio_base, 0x20000,
+                  PAGE_PRESENT | PAGE_WRITE | PAGE_PCD);
     
     serial_puts("[E1000] MMIO base: 0x");
     char hex[9];
@@ -170,9 +222,10 @@ int e1000_init(void)
         e1000_write(E1000_MTA + i * 4, 0);
     }
     
-    e1000_init_rx();
-    
-    e1000_init_tx();
+    if (e1000_init_rx() != 0 || e1000_init_tx() != 0) {
+        serial_puts("[E1000] Failed to allocate DMA rings\n");
+        return -1;
+    }
     
     e1000_write(E1000_IMS, E1000_ICR_RXT0 | E1000_ICR_LSC);
     
@@ -185,17 +238,13 @@ int e1000_init(void)
 int e1000_send(const void *data, uint16_t length)
 {
     if (!e1000_initialized) return -1;
-    if (length > E1000_RX_BUFFER_SIZE) return -2;
+    if (length > E1000_TX_BUFFER_SIZE) return -2;
     
     while (!(tx_descs[tx_cur].status & E1000_TXD_STAT_DD));
     
-    uint32_t buf_phys = pmm_alloc_frame();
-    uint8_t *buf = (uint8_t *)(buf_phys + 0xC0000000);
-    vmm_map_page((uint32_t)buf & ~0xFFF, buf_phys, PAGE_PRESENT | PAGE_WRITE);
-    
-    memcpy(buf, data, length);
+    memcpy(tx_buffers[tx_cur], data, length);
     
-    tx_descs[tx_cur].addr = buf_phys;
+    tx_descs[tx_cur].addr = tx_buffers_phys[tx_cur];
     tx_descs[tx_cur].length = length;
     tx_descs[tx_cur].cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
     tx_descs[tx_cur].status = 0;
@@ -207,9 +256,6 @@ int e1000_send(const void *data, uint16_t length)
     
     while (!(tx_descs[old_cur].status & E1000_TXD_STAT_DD));
     
-    vmm_unmap_page((uint32_t)buf & ~0xFFF);
-    pmm_free_frame(buf_phys);
-    
     return length;
 }
 
@@ -75,10 +75,14 @@ typedef struct acpi_madt_iso {
     uint16_t flags;
 } __attribute__((packed)) acpi_madt_iso_t;
 
+#define ACPI_MAX_CPUS           16
+
 int acpi_init(void);
 uint32_t acpi_get_lapic_addr(void);
 uint32_t acpi_get_ioapic_addr(void);
 uint8_t acpi_get_ioapic_id(void);
+uint32_t acpi_get_cpu_count(void);
+uint8_t acpi_get_cpu_apic_id(uint32_t index);
 int acpi_is_available(void);
 
 #endif 
@@ -11,6 +11,8 @@
 #define LAPIC_BASE_VIRT     0xE0000000
 
 #define LAPIC_TIMER_VECTOR  32
+#define LAPIC_WAKE_VECTOR   0xF0    /* IPI to a halted CPU, see smp_wake_cpu */
+#define LAPIC_TLB_VECTOR    0xF1    /* remote TLB flush, see smp_tlb_shootdown */
 #define LAPIC_REG_ID            0x020   
 #define LAPIC_REG_VERSION       0x030   
 #define LAPIC_REG_TPR           0x080   
@@ -38,12 +40,29 @@
 #define LAPIC_REG_TIMER_CURR    0x390   
 #define LAPIC_REG_TIMER_DIV     0x3E0   
 
+/* ICR low word */
+#define LAPIC_ICR_INIT          0x00000500
+#define LAPIC_ICR_STARTUP       0x00000600
+#define LAPIC_ICR_PENDING       0x00001000
+#define LAPIC_ICR_LEVEL_ASSERT  0x00004000
+
+/* LVT timer modes */
+#define LAPIC_TIMER_ONESHOT     0x00000
+#define LAPIC_TIMER_MASKED      0x10000
+#define LAPIC_TIMER_PERIODIC    0x20000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
+
 void lapic_init(uint32_t base_addr);
 void lapic_eoi(void);
 uint32_t lapic_get_id(void);
+void lapic_init_ap(void);
 void lapic_send_ipi(uint32_t apic_id, uint32_t vector);
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint8_t page);
 void lapic_timer_init(uint32_t frequency);
 void lapic_timer_stop(void);
+void lapic_timer_arm(uint64_t ns);
+int lapic_timer_is_oneshot(void);
 void lapic_timer_handler(void);
 uint32_t lapic_get_ticks(void);
 uint64_t lapic_get_uptime_ms(void);
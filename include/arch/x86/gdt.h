@@ -14,8 +14,9 @@
 #define GDT_USER_CODE_SEGMENT   0x38    /* Ring 3 code (user) */
 #define GDT_USER_DATA_SEGMENT   0x40    /* Ring 3 data (user) */
 #define GDT_TSS_SEGMENT         0x48
+#define GDT_DF_TSS_SEGMENT      0x50    /* double fault task */
 
-#define GDT_ENTRIES 10
+#define GDT_ENTRIES 11
 
 /* Ring levels */
 #define RING_KERNEL     0
@@ -67,6 +68,9 @@ typedef struct tss_entry {
     uint16_t iomap_base;    
 } __attribute__((packed)) tss_entry_t;
 
+/* Per-CPU GDT and TSS of an application processor */
+typedef struct gdt_cpu gdt_cpu_t;
+
 void gdt_init(void);
 void gdt_set_kernel_stack(uint32_t stack);
 void tss_set_ring1_stack(uint32_t esp1, uint16_t ss1);
@@ -75,5 +79,9 @@ uint8_t *tss_get_iopb(void);
 void tss_set_iopb(const uint8_t *iopb, uint32_t size);
 void tss_clear_iopb(void);
 void tss_deny_all_iopb(void);
+void gdt_init_double_fault(uint32_t cr3, void (*handler)(void));
+gdt_cpu_t *gdt_create_cpu(uint32_t esp0);
+void gdt_load_cpu(gdt_cpu_t *cpu);
+tss_entry_t *gdt_cpu_get_tss(gdt_cpu_t *cpu);
 
 #endif
@@ -19,6 +19,7 @@
 #define IDT_KERNEL_INT      (IDT_FLAG_PRESENT | IDT_FLAG_RING0 | IDT_GATE_INT32)
 #define IDT_DRIVER_INT      (IDT_FLAG_PRESENT | IDT_FLAG_RING1 | IDT_GATE_INT32)
 #define IDT_USER_INT        (IDT_FLAG_PRESENT | IDT_FLAG_RING3 | IDT_GATE_INT32)
+#define IDT_TASK_GATE       (IDT_FLAG_PRESENT | IDT_FLAG_RING0 | IDT_GATE_TASK)
 
 #define IRQ0    32
 #define IRQ1    33
@@ -60,6 +61,7 @@ typedef struct registers {
 typedef void (*interrupt_handler_t)(registers_t *);
 
 void idt_init(void);
+void idt_load(void);
 void idt_set_handler(uint8_t num, uint32_t handler, uint16_t sel, uint8_t flags);
 void register_interrupt_handler(uint8_t n, interrupt_handler_t handler);
 
@@ -0,0 +1,37 @@
+/* SMP Header
+ * Application processor bring-up and per-CPU data
+ */
+
+#ifndef _ARCH_X86_SMP_H
+#define _ARCH_X86_SMP_H
+
+#include <stdint.h>
+#include <arch/x86/gdt.h>
+
+#define SMP_MAX_CPUS            8
+
+/* Real-mode entry point of the APs; must be page aligned, below 1MB
+ * and clear of the multiboot info QEMU puts at 0x9000.
+ */
+#define SMP_TRAMPOLINE_BASE     0x8000
+
+typedef struct cpu {
+    uint32_t id;                /* logical number, the BSP is 0 */
+    uint8_t apic_id;
+    volatile int online;
+    void *kernel_stack;
+    gdt_cpu_t *gdt;
+    volatile uint32_t ticks;    /* LAPIC timer ticks taken on this CPU */
+} cpu_t;
+
+void smp_init(void);
+uint32_t smp_cpu_count(void);
+uint32_t smp_cpu_id(void);
+cpu_t *smp_get_cpu(uint32_t id);
+int smp_is_bsp(void);
+void smp_timer_tick(uint32_t ticks);
+void smp_wake_cpu(uint32_t id);
+void smp_tlb_shootdown(uint32_t start, uint32_t end);
+void smp_tlb_poll(void);
+
+#endif
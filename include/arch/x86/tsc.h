@@ -0,0 +1,32 @@
+/* TSC Header
+ * Time stamp counter as the kernel's clock source
+ */
+
+#ifndef _ARCH_X86_TSC_H
+#define _ARCH_X86_TSC_H
+
+#include <stdint.h>
+
+#define MSR_IA32_TSC_DEADLINE   0x6E0
+
+static inline uint64_t tsc_read(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+void tsc_init(void);
+int tsc_is_calibrated(void);
+int tsc_has_deadline(void);
+uint64_t tsc_get_hz(void);
+uint64_t tsc_ns(void);
+uint64_t tsc_cycles_to_ns(uint64_t cycles);
+uint64_t tsc_ns_to_cycles(uint64_t ns);
+
+#endif
@@ -62,6 +62,7 @@
 #define E1000_NUM_RX_DESC   32
 #define E1000_NUM_TX_DESC   32
 #define E1000_RX_BUFFER_SIZE 2048
+#define E1000_TX_BUFFER_SIZE 2048
 
 typedef struct e1000_rx_desc {
     uint64_t addr;          
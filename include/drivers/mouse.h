@@ -43,6 +43,7 @@ void mouse_show_cursor(void);
 void mouse_hide_cursor(void);
 void mouse_update_cursor(void);
 int mouse_is_visible(void);
+int mouse_has_event(void);
 int mouse_get_event(mouse_event_t *event);
 void mouse_process_events(void);
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <fs/vfs.h>
+#include <mm/slab.h>
 
 typedef struct __attribute__((packed)) {
     uint8_t  jmp[3];            
@@ -88,11 +89,14 @@ typedef struct {
     uint32_t root_cluster;      
     uint32_t total_clusters;    
     char volume_label[12];
+    kmem_cache_t *cluster_cache;
 } fat32_fs_t;
 
 fat32_fs_t *fat32_mount(int drive, uint32_t partition_lba);
 void fat32_unmount(fat32_fs_t *fs);
 int fat32_read_cluster(fat32_fs_t *fs, uint32_t cluster, void *buffer);
+uint8_t *fat32_alloc_cluster_buf(fat32_fs_t *fs);
+void fat32_free_cluster_buf(fat32_fs_t *fs, void *buf);
 uint32_t fat32_next_cluster(fat32_fs_t *fs, uint32_t cluster);
 
 int fat32_list_dir(fat32_fs_t *fs, uint32_t cluster, 
@@ -93,6 +93,7 @@ typedef struct {
     uint32_t pid;
     uint32_t entry;
     uint32_t stack_top;
+    uint32_t brk;               /* page-aligned end of the highest segment */
     uint32_t page_dir;
     uint32_t init_array;
     uint32_t init_array_size;
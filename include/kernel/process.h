@@ -17,6 +17,7 @@
 #define NSIG                32
 
 struct vfs_node;
+struct vma;
 
 typedef struct {
     struct vfs_node *node;
@@ -49,6 +50,15 @@ typedef struct process {
     uint32_t saved_cs, saved_ds, saved_es, saved_fs, saved_gs, saved_ss;
     uint32_t page_directory;
     uint32_t waiting_for_pid;
+    uint32_t rss_pages;         /* pages faulted in for mmap/stack regions */
+    
+    struct vma *vmas;           /* sorted by start address, see mm/mmap.c */
+    uint32_t vma_count;
+    uint32_t vma_capacity;
+    uint32_t mmap_hint;         /* where the next mmap search starts */
+    uint32_t mmap_hole;         /* largest hole skipped below mmap_hint */
+    uint32_t brk_start;         /* end of the loaded image; 0 if none */
+    uint32_t brk;               /* current program break */
     
     fd_entry_t fd_table[MAX_FDS_PER_PROC];
 } process_t;
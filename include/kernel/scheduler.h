@@ -2,6 +2,7 @@
 #define _KERNEL_SCHEDULER_H
 
 #include <stdint.h>
+#include <kernel/timer.h>
 
 typedef struct cpu_context {
     uint32_t edi;
@@ -30,14 +31,30 @@ typedef struct task {
     uint32_t kernel_stack_size;
     uint32_t esp;
     
-    uint32_t *page_directory;
+    uint32_t page_directory;    /* physical PD address, 0 = any (kernel-only) */
     
     uint64_t cpu_time;
-    uint64_t wake_time;
+    ktimer_t sleep_timer;
+    
+    void (*entry)(void);
+    uint32_t cpu;               /* run queue the task belongs to */
+    volatile uint8_t on_cpu;    /* running, or still being switched out */
+    uint32_t migrate_disabled;  /* task_migrate_disable() nesting */
     
     struct task *next;
 } task_t;
 
+/* Per-CPU run queue counters for /proc/schedstat */
+typedef struct sched_cpu_stats {
+    uint32_t queued;
+    uint32_t current_tid;
+    int idle;
+    uint32_t switches;
+    uint32_t steals;            /* tasks this CPU took from others */
+    uint32_t stolen;            /* tasks others took from this CPU */
+    uint32_t balance_runs;
+} sched_cpu_stats_t;
+
 #define BLOCK_REASON_NONE       0
 #define BLOCK_REASON_MUTEX      1
 #define BLOCK_REASON_SEMAPHORE  2
@@ -53,15 +70,20 @@ typedef struct task {
 #define TASK_STATE_ZOMBIE   5
 
 void scheduler_init(void);
+void scheduler_ap_start(void);
 void scheduler_enable(void);
 void scheduler_disable(void);
 
 task_t *task_create(const char *name, void (*entry)(void), uint32_t stack_size);
 task_t *task_current(void);
+void task_migrate_disable(void);
+void task_migrate_enable(void);
+void *task_stack_alloc(uint32_t size);
+void task_stack_free(void *stack, uint32_t size);
 
 void schedule(void);
 void schedule_force(void);
-void scheduler_tick(void);
+void scheduler_tick(uint32_t ticks);
 
 void task_block(uint8_t reason);
 void task_unblock(task_t *task);
@@ -72,6 +94,7 @@ uint8_t task_get_effective_priority(task_t *task);
 void task_boost_priority(task_t *task, uint8_t priority);
 void task_restore_priority(task_t *task);
 int scheduler_get_task_count(void);
+int scheduler_get_cpu_stats(uint32_t cpu, sched_cpu_stats_t *stats);
 extern void context_switch(uint32_t *old_esp, uint32_t new_esp);
 
 #endif
@@ -0,0 +1,42 @@
+/* Kernel Timer Header
+ * One-shot callbacks after a delay, ordered by expiry
+ */
+
+#ifndef _KERNEL_TIMER_H
+#define _KERNEL_TIMER_H
+
+#include <stdint.h>
+
+/* Pending timers at once: the pool plus timers embedded elsewhere,
+ * such as one per sleeping task.
+ */
+#define TIMER_HEAP_SIZE     256
+
+/* Timers handed out by timer_add */
+#define TIMER_POOL_SIZE     128
+
+typedef void (*timer_callback_t)(void *arg);
+
+/* A timer owned by its user. Zeroed memory is a stopped timer. */
+typedef struct ktimer {
+    uint64_t expires;           /* ktime_ns */
+    timer_callback_t callback;
+    void *arg;
+    uint32_t heap_slot;         /* position in the heap + 1, 0 = not pending */
+} ktimer_t;
+
+uint64_t ktime_ns(void);
+
+int timer_start(ktimer_t *timer, uint32_t ms, timer_callback_t callback, void *arg);
+int timer_stop(ktimer_t *timer);
+
+int timer_add(uint32_t ms, timer_callback_t callback, void *arg);
+int timer_cancel(int id);
+
+void timer_tick(void);
+void timer_rearm(void);
+uint32_t timer_ticks_elapsed(void);
+void timer_idle_halt(void);
+uint32_t timer_pending_count(void);
+
+#endif
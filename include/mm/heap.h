@@ -4,14 +4,33 @@
 #include <stdint.h>
 #include <stddef.h>
 
+/* Allocations are accounted to the source file that made them. Tag 0
+ * collects untagged callers and anything beyond the table.
+ */
+#define HEAP_MAX_TAGS   64
+
+typedef struct {
+    const char *name;
+    uint32_t live;              /* allocations currently outstanding */
+    uint32_t bytes;             /* bytes currently outstanding */
+    uint32_t peak_bytes;
+    uint32_t allocs;            /* allocations ever made */
+} heap_tag_stats_t;
+
 void heap_init(uint32_t start, uint32_t size);
 void *kmalloc(uint32_t size);
 void *kmalloc_aligned(uint32_t size, uint32_t alignment);
+void *kmalloc_tagged(uint32_t size, const char *tag);
+void *kmalloc_aligned_tagged(uint32_t size, uint32_t alignment, const char *tag);
 void kfree(void *ptr);
 void kfree_aligned(void *ptr);
 int heap_check_overflow(void *ptr);
 void heap_get_stats(uint32_t *allocs, uint32_t *frees, uint32_t *current, 
                     uint32_t *bytes, uint32_t *peak_allocs, uint32_t *peak_b);
 int heap_check_leaks(void);
+int heap_get_tag_stats(heap_tag_stats_t *out, int max);
+
+#define kmalloc(size)                   kmalloc_tagged((size), __FILE__)
+#define kmalloc_aligned(size, align)    kmalloc_aligned_tagged((size), (align), __FILE__)
 
 #endif
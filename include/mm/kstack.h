@@ -0,0 +1,30 @@
+/* Kernel Stack Header
+ * Guard-page protected kernel stacks
+ */
+
+#ifndef _MM_KSTACK_H
+#define _MM_KSTACK_H
+
+#include <stdint.h>
+
+/* Top end of the vmalloc window; see mm/vmalloc.h */
+#define KSTACK_START        0xDF800000
+#define KSTACK_END          0xE0000000
+
+/* Each stack owns a fixed slot and sits at its top; everything below the
+ * stack, at least one page, is never mapped.
+ */
+#define KSTACK_SLOT_SIZE    0x8000
+#define KSTACK_MAX_SIZE     (KSTACK_SLOT_SIZE - 0x1000)
+#define KSTACK_DEFAULT_SIZE 8192
+
+/* Freed stacks kept mapped for reuse */
+#define KSTACK_CACHE_SIZE   16
+
+void kstack_init(void);
+void *kstack_alloc(uint32_t size);
+void kstack_free(void *stack);
+int kstack_is_guard(uint32_t addr);
+void kstack_get_stats(uint32_t *in_use, uint32_t *cached);
+
+#endif
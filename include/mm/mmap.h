@@ -17,10 +17,19 @@
 #define MAP_FIXED       0x10
 #define MAP_ANONYMOUS   0x20
 #define MAP_ANON        MAP_ANONYMOUS
+#define MAP_POPULATE    0x8000
 
 #define MAP_FAILED      ((void *)-1)
 
-#define MAX_VMAS_PER_PROC   32
+/* Page fault error code bits */
+#define PF_PRESENT      0x1
+#define PF_WRITE        0x2
+#define PF_USER         0x4
+
+#define MAX_VMAS_PER_PROC   256
+
+#define FAULT_AROUND_DEFAULT    8
+#define FAULT_AROUND_MAX        64
 
 typedef struct vma {
     uint32_t start;
@@ -29,7 +38,6 @@ typedef struct vma {
     uint32_t flags;         
     uint32_t file_offset;   
     void *file;             
-    uint8_t in_use;         
     uint8_t cow;            
     uint8_t lazy;           
 } vma_t;
@@ -37,8 +45,11 @@ typedef struct vma {
 void *sys_mmap(void *addr, uint32_t length, int prot, int flags, int fd, uint32_t offset);
 int sys_munmap(void *addr, uint32_t length);
 int sys_mprotect(void *addr, uint32_t length, int prot);
+uint32_t sys_brk(uint32_t addr);
 
 void vma_init_process(void *proc);
+int vma_fork_process(void *parent, void *child);
+void vma_release_process(void *proc);
 vma_t *vma_find(uint32_t addr);
 vma_t *vma_create(uint32_t start, uint32_t end, uint32_t prot, uint32_t flags);
 int vma_destroy(vma_t *vma);
@@ -49,7 +60,12 @@ int cow_handle_fault(uint32_t fault_addr);
 int cow_mark_page(uint32_t virt);
 
 int demand_page_alloc(uint32_t virt, vma_t *vma);
+int mmap_populate(vma_t *vma);
+void mmap_set_fault_around(uint32_t pages);
+uint32_t mmap_get_fault_around(void);
 
 int stack_grow(uint32_t fault_addr);
 
+void mmap_init(void);
+
 #endif
@@ -0,0 +1,30 @@
+/* Page Cache Header
+ * File pages cached by (vfs_node, offset)
+ */
+
+#ifndef _MM_PAGECACHE_H
+#define _MM_PAGECACHE_H
+
+#include <stdint.h>
+#include <fs/vfs.h>
+
+#define PAGECACHE_BUCKETS   256
+
+typedef struct page_cache_entry {
+    vfs_node_t *node;
+    uint32_t offset;
+    uint32_t phys;
+    uint32_t mapcount;
+    struct page_cache_entry *next;
+} page_cache_entry_t;
+
+uint32_t pagecache_get(vfs_node_t *node, uint32_t offset);
+void pagecache_put(vfs_node_t *node, uint32_t offset);
+uint32_t pagecache_lookup(vfs_node_t *node, uint32_t offset);
+int pagecache_writeback(vfs_node_t *node, uint32_t offset);
+void pagecache_update(vfs_node_t *node, uint32_t offset, uint32_t size, const uint8_t *buffer);
+uint32_t pagecache_invalidate(vfs_node_t *node);
+uint32_t pagecache_shrink(uint32_t target);
+void pagecache_get_stats(uint32_t *pages, uint32_t *hits, uint32_t *misses);
+
+#endif
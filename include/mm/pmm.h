@@ -4,12 +4,51 @@
 #include <stdint.h>
 #include <kernel/multiboot.h>
 
+/* Largest buddy block is 2^PMM_MAX_ORDER frames (4 MB) */
+#define PMM_MAX_ORDER   10
+
+/* Placement hints for pmm_alloc_contiguous() */
+#define PMM_ZONE_ANY        0
+#define PMM_ZONE_DMA        1       /* below 16 MB, for ISA-style DMA */
+#define PMM_ZONE_DMA32      2       /* below 4 GB, for 32-bit PCI bus masters */
+
+#define PMM_ZONE_DMA_LIMIT  0x01000000
+
+#define PMM_MAX_REGIONS     32
+
+/* One entry of the firmware memory map; type is MULTIBOOT_MEMORY_* */
+typedef struct pmm_region {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+} pmm_region_t;
+
+/* Pre-zeroed frames kept for pmm_alloc_zeroed_frame() */
+#define PMM_ZERO_POOL_SIZE      64
+#define PMM_ZERO_POOL_BATCH     8       /* frames zeroed per idle pass */
+#define PMM_ZERO_POOL_RESERVE   256     /* free frames never pulled into the pool */
+
 void pmm_init(multiboot_info_t *mboot);
 uint32_t pmm_alloc_frame(void);
+uint32_t pmm_noreclaim_save(void);
+void pmm_noreclaim_restore(uint32_t flags);
+uint32_t pmm_alloc_frames(uint32_t order);
+uint32_t pmm_alloc_zeroed_frame(void);
+uint32_t pmm_zero_pool_refill(uint32_t max);
+void pmm_get_zero_pool_stats(uint32_t *pooled, uint32_t *hits, uint32_t *misses);
 void pmm_free_frame(uint32_t addr);
+void pmm_free_frames(uint32_t addr, uint32_t order);
+uint32_t pmm_alloc_contiguous(uint32_t count, uint32_t align, uint32_t zone);
+void pmm_free_contiguous(uint32_t addr, uint32_t count);
 void pmm_mark_used(uint32_t addr);
+void pmm_frame_ref(uint32_t addr);
+uint32_t pmm_frame_refcount(uint32_t addr);
 uint32_t pmm_get_total_memory(void);
 uint32_t pmm_get_used_memory(void);
 uint32_t pmm_get_free_memory(void);
+uint32_t pmm_get_free_blocks(uint32_t order);
+uint32_t pmm_get_regions(const pmm_region_t **regions);
+uint32_t pmm_get_kernel_end(void);
+uint32_t pmm_get_frame_count(void);
 
 #endif
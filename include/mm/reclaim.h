@@ -0,0 +1,18 @@
+/* Reclaim Header
+ * Freeing frames under memory pressure
+ */
+
+#ifndef _MM_RECLAIM_H
+#define _MM_RECLAIM_H
+
+#include <stdint.h>
+
+/* Frames reclaim tries to free each time an allocation fails */
+#define RECLAIM_BATCH   32
+
+void reclaim_init(void);
+uint32_t reclaim_pages(uint32_t target);
+void reclaim_track_anon(uint32_t phys, uint32_t virt);
+void reclaim_get_stats(uint32_t *runs, uint32_t *cache_freed, uint32_t *swapped);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _MM_SLAB_H
+#define _MM_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sync/spinlock.h>
+
+#define KMEM_MAX_CACHES     32
+#define KMEM_NAME_LEN       24
+#define KMEM_SLAB_SIZE      4096
+#define KMEM_MIN_OBJS       4
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct kmem_slab;
+
+typedef struct kmem_cache {
+    char name[KMEM_NAME_LEN];
+    uint32_t obj_size;
+    uint32_t align;
+    uint32_t stride;
+    uint32_t objs_per_slab;
+    uint32_t slab_bytes;
+    kmem_ctor_t ctor;
+    
+    struct kmem_slab *partial;
+    struct kmem_slab *full;
+    struct kmem_slab *empty;
+    
+    uint32_t num_slabs;
+    uint32_t num_empty;
+    uint32_t active_objs;
+    uint32_t total_allocs;
+    uint32_t total_frees;
+    
+    spinlock_t lock;
+    int in_use;
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor);
+int kmem_cache_destroy(kmem_cache_t *cache);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+kmem_cache_t *kmem_cache_get(int index);
+
+#endif
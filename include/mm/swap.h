@@ -0,0 +1,28 @@
+/* Swap Header
+ * Anonymous pages paged out to a sector range of an ATA disk
+ */
+
+#ifndef _MM_SWAP_H
+#define _MM_SWAP_H
+
+#include <stdint.h>
+
+#define SWAP_SECTORS_PER_SLOT   8           /* one 4K page */
+#define SWAP_MAX_SLOTS          65536       /* 256 MB of swap */
+
+/* A swapped-out PTE is not present, has PAGE_SWAPPED set and keeps the
+ * slot number where the frame address used to be.
+ */
+#define SWAP_PTE_SLOT(pte)      ((pte) >> 12)
+
+int swap_enable(int drive, uint32_t start_lba, uint32_t sectors);
+int swap_is_enabled(void);
+int swap_out(uint32_t phys);
+int swap_writeback(void);
+int swap_in(uint32_t virt);
+void swap_entry_dup(uint32_t pte);
+void swap_entry_free(uint32_t pte);
+void swap_get_stats(uint32_t *total, uint32_t *free, uint32_t *ins, uint32_t *outs);
+int swap_get_device(int *drive, uint32_t *start_lba);
+
+#endif
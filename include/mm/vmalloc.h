@@ -0,0 +1,29 @@
+/* Vmalloc Header
+ * Large kernel allocations in their own virtual region
+ */
+
+#ifndef _MM_VMALLOC_H
+#define _MM_VMALLOC_H
+
+#include <stdint.h>
+
+/* Between the kernel heap window and the kernel stack region */
+#define VMALLOC_START       0xD1000000
+#define VMALLOC_END         0xDF800000
+
+/* kmalloc hands requests of at least this many bytes to vmalloc */
+#define VMALLOC_THRESHOLD   (32 * 1024)
+
+void *vmalloc(uint32_t size);
+void *vmalloc_tagged(uint32_t size, uint16_t tag);
+void *vmap_phys(uint32_t phys, uint32_t size, uint32_t page_flags);
+void vfree(void *ptr);
+uint32_t vmalloc_size(void *ptr, uint16_t *tag);
+void vmalloc_get_stats(uint32_t *areas, uint32_t *bytes);
+
+static inline int is_vmalloc_addr(const void *ptr)
+{
+    return (uint32_t)ptr >= VMALLOC_START && (uint32_t)ptr < VMALLOC_END;
+}
+
+#endif
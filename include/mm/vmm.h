@@ -13,17 +13,59 @@
 #define PAGE_SIZE_4M    0x080
 #define PAGE_GLOBAL     0x100
 
+/* Software bits, ignored by the MMU */
+#define PAGE_COW        0x200   /* read-only until written, then copied */
+#define PAGE_SHARED     0x400   /* frame owned elsewhere (shm, page cache); not refcounted */
+#define PAGE_SWAPPED    0x800   /* not present; bits 12-31 hold the swap slot */
+#define PAGE_SHARED_ANON 0x800  /* present; MAP_SHARED anonymous frame, refcounted, never COW */
+
 #define PAGE_KERNEL     (PAGE_PRESENT | PAGE_WRITE)
 #define PAGE_USERSPACE  (PAGE_PRESENT | PAGE_WRITE | PAGE_USER)
 
+#define LARGE_PAGE_SIZE         0x400000
+
+/* Ranges longer than this are flushed wholesale by vmm_flush_range */
+#define VMM_FLUSH_RANGE_MAX     32
+
+/* Temporary kernel mapping window (see vmm_temp_map), slots per CPU */
+#define VMM_TEMP_BASE   0xEFC00000
+#define VMM_TEMP_SLOTS  16
+
 void vmm_init(void);
 void vmm_map_page(uint32_t virt, uint32_t phys, uint32_t flags);
+void vmm_map_page_noflush(uint32_t virt, uint32_t phys, uint32_t flags);
 void vmm_unmap_page(uint32_t virt);
+int vmm_map_range(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags);
+int vmm_alloc_range(uint32_t virt, uint32_t size, uint32_t flags);
+int vmm_alloc_tables(uint32_t virt, uint32_t size);
+void vmm_unmap_range(uint32_t virt, uint32_t size);
+int vmm_map_large(uint32_t virt, uint32_t phys, uint32_t flags);
+int vmm_large_pages_enabled(void);
 uint32_t vmm_get_physical(uint32_t virt);
 int vmm_is_mapped(uint32_t virt);
+uint32_t vmm_get_flags(uint32_t virt);
 void vmm_flush_tlb(void);
 void vmm_invlpg(uint32_t virt);
+void vmm_flush_tlb_all(void);
+void vmm_flush_range(uint32_t start, uint32_t end);
+void vmm_flush_range_local(uint32_t start, uint32_t end);
+void vmm_enable_global_pages(void);
 
 uint32_t *vmm_get_current_pagedir(void);
 
+void *vmm_temp_map(uint32_t phys);
+void vmm_temp_unmap(void *virt);
+
+uint32_t vmm_create_directory(void);
+uint32_t vmm_clone_directory(void);
+void vmm_switch_directory(uint32_t pd_phys);
+uint32_t vmm_get_directory(void);
+uint32_t vmm_get_kernel_directory(void);
+uint32_t vmm_get_cr3_switches(void);
+int vmm_sync_kernel_pde(uint32_t virt);
+void vmm_destroy_directory(uint32_t pd_phys);
+uint32_t vmm_lookup_pte(uint32_t pd_phys, uint32_t virt);
+int vmm_set_pte(uint32_t pd_phys, uint32_t virt, uint32_t pte);
+uint32_t vmm_get_pte(uint32_t virt);
+
 #endif
\ No newline at end of file
@@ -11,6 +11,7 @@
 #define CPU_FEATURE_NX      (1 << 1)
 #define CPU_FEATURE_SMEP    (1 << 2)
 #define CPU_FEATURE_SMAP    (1 << 3)
+#define CPU_FEATURE_PGE     (1 << 4)
 
 #define STACK_CHK_GUARD     0xDEADBEEF
 
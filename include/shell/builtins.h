@@ -71,6 +71,10 @@ void cmd_drivers(int argc, char **argv);
 
 void cmd_memtest(int argc, char **argv);
 void cmd_heapstats(int argc, char **argv);
+void cmd_heapbench(int argc, char **argv);
+void cmd_ctxbench(int argc, char **argv);
+void cmd_faultaround(int argc, char **argv);
+void cmd_swapon(int argc, char **argv);
 void cmd_leaktest(int argc, char **argv);
 
 void cmd_tasks(int argc, char **argv);
@@ -24,5 +24,7 @@ void waitqueue_wait(wait_queue_t *wq);
 void waitqueue_wake_one(wait_queue_t *wq);
 void waitqueue_wake_all(wait_queue_t *wq);
 int waitqueue_empty(wait_queue_t *wq);
+wait_queue_entry_t *waitqueue_entry_alloc(void);
+void waitqueue_entry_free(wait_queue_entry_t *entry);
 
 #endif
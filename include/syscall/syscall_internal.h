@@ -16,6 +16,7 @@ int alloc_fd(void);
 void free_fd(int fd);
 int validate_user_ptr(uint32_t ptr, uint32_t size);
 int validate_user_string(uint32_t ptr, uint32_t max_len);
+uint32_t syscall_arg5(void);
 
 int32_t sys_exit(uint32_t status, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4);
 int32_t sys_read(uint32_t fd, uint32_t buf, uint32_t count, uint32_t arg3, uint32_t arg4);
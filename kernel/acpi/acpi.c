@@ -12,6 +12,8 @@ static acpi_madt_t *madt = NULL;
 static uint32_t lapic_addr = 0;
 static uint32_t ioapic_addr = 0;
 static uint8_t ioapic_id = 0;
+static uint8_t cpu_apic_ids[ACPI_MAX_CPUS];
+static uint32_t cpu_count = 0;
 
 static int acpi_checksum(void *table, size_t length)
 {
@@ -34,7 +36,7 @@ static acpi_rsdp_t *acpi_find_rsdp_in_region(uint32_t start, uint32_t end)
             ptr[4] == 'P' && ptr[5] == 'T' && ptr[6] == 'R' && ptr[7] == ' ') {
             
             acpi_rsdp_t *rsdp_candidate = (acpi_rsdp_t *)ptr;
-
+            
             if (acpi_checksum(rsdp_candidate, 20)) {
                 return rsdp_candidate;
             }
@@ -66,10 +68,8 @@ static void acpi_ensure_mapped(uint32_t phys_addr, uint32_t size)
     uint32_t start_page = phys_addr & 0xFFFFF000;
     uint32_t end_page = (phys_addr + size + 0xFFF) & 0xFFFFF000;
     
-    for (uint32_t page = start_page; page < end_page; page += 0x1000) {
-        uint32_t virt = page + KERNEL_VMA;
-        vmm_map_page(virt, page, PAGE_PRESENT | PAGE_WRITE);
-    }
+    vmm_map_range(start_page + KERNEL_VMA, start_page, end_page - start_page,
+                  PAGE_PRESENT | PAGE_WRITE);
 }
 
 static void *acpi_find_table(const char *signature)
@@ -121,7 +121,10 @@ static void acpi_parse_madt(acpi_madt_t *madt_table)
         switch (entry->type) {
             case MADT_ENTRY_LAPIC: {
                 acpi_madt_lapic_t *lapic = (acpi_madt_lapic_t *)entry;
-                (void)lapic; 
+                /* Bit 0: enabled, bit 1: can be brought online */
+                if ((lapic->flags & 0x3) && cpu_count < ACPI_MAX_CPUS) {
+                    cpu_apic_ids[cpu_count++] = lapic->apic_id;
+                }
                 break;
             }
             
@@ -198,6 +201,17 @@ uint8_t acpi_get_ioapic_id(void)
     return ioapic_id;
 }
 
+/* Processors listed in the MADT, the BSP among them */
+uint32_t acpi_get_cpu_count(void)
+{
+    return cpu_count;
+}
+
+uint8_t acpi_get_cpu_apic_id(uint32_t index)
+{
+    return index < cpu_count ? cpu_apic_ids[index] : 0;
+}
+
 int acpi_is_available(void)
 {
     return rsdp != NULL;
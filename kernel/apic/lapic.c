@@ -5,6 +5,8 @@
 #include <kernel/kernel.h>
 #include <apic/lapic.h>
 #include <mm/vmm.h>
+#include <arch/x86/tsc.h>
+#include <drivers/serial.h>
 
 static volatile uint32_t *lapic_base = NULL;
 
@@ -18,10 +20,8 @@ static inline void lapic_write(uint32_t reg, uint32_t value)
     lapic_base[reg / 4] = value;
 }
 
-void lapic_init(uint32_t base_addr)
+static void lapic_enable(void)
 {
-    lapic_base = (volatile uint32_t *)(LAPIC_BASE_VIRT);
-    vmm_map_page(LAPIC_BASE_VIRT, base_addr, PAGE_PRESENT | PAGE_WRITE | PAGE_PCD);
     lapic_write(LAPIC_REG_SPURIOUS, 0x1FF);
     lapic_write(LAPIC_REG_TPR, 0);
     lapic_write(LAPIC_REG_ESR, 0);
@@ -29,6 +29,23 @@ void lapic_init(uint32_t base_addr)
     lapic_eoi();
 }
 
+void lapic_init(uint32_t base_addr)
+{
+    lapic_base = (volatile uint32_t *)(LAPIC_BASE_VIRT);
+    vmm_map_page(LAPIC_BASE_VIRT, base_addr, PAGE_PRESENT | PAGE_WRITE | PAGE_PCD);
+    lapic_enable();
+}
+
+/* Every CPU sees its own LAPIC at the same address, so an application
+ * processor only has to switch on the one already mapped.
+ */
+void lapic_init_ap(void)
+{
+    if (lapic_base) {
+        lapic_enable();
+    }
+}
+
 void lapic_eoi(void)
 {
     if (lapic_base) {
@@ -44,22 +61,61 @@ uint32_t lapic_get_id(void)
     return (lapic_read(LAPIC_REG_ID) >> 24) & 0xFF;
 }
 
-void lapic_send_ipi(uint32_t apic_id, uint32_t vector)
+static void lapic_wait_icr(void)
 {
-    while (lapic_read(LAPIC_REG_ICR_LOW) & (1 << 12)) {
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
         __asm__ volatile("pause");
     }
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t vector)
+{
+    lapic_wait_icr();
     
     lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
     lapic_write(LAPIC_REG_ICR_LOW, vector);
 }
 
+void lapic_send_init(uint32_t apic_id)
+{
+    lapic_wait_icr();
+    lapic_write(LAPIC_REG_ESR, 0);
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL_ASSERT);
+    lapic_wait_icr();
+}
+
+/* The AP starts in real mode at page * 4K */
+void lapic_send_startup(uint32_t apic_id, uint8_t page)
+{
+    lapic_wait_icr();
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, LAPIC_ICR_STARTUP | page);
+    lapic_wait_icr();
+}
+
 static volatile uint64_t lapic_ticks = 0;
 static uint32_t lapic_ticks_per_second = 0;
 static uint32_t lapic_timer_freq = 0;
+static uint64_t lapic_tick_ns = 0;
+
+/* With a TSC to keep time the timers run one-shot and are re-armed for
+ * the next event; interrupts no longer arrive once per tick.
+ */
+static int lapic_oneshot = 0;
 
+/* In one-shot mode ticks are not counted but derived from the clock,
+ * so ticks skipped while idle still show up in the uptime.
+ */
 void lapic_timer_handler(void)
 {
+    if (lapic_oneshot) {
+        uint64_t ticks = tsc_ns() / lapic_tick_ns;
+        if (ticks > lapic_ticks) {
+            lapic_ticks = ticks;
+        }
+        return;
+    }
     lapic_ticks++;
 }
 
@@ -85,14 +141,12 @@ uint32_t lapic_get_ticks(void)
     return lapic_ticks;
 }
 
-void lapic_timer_init(uint32_t frequency)
+/* Count LAPIC timer ticks over 10ms of PIT channel 0 */
+static void lapic_timer_calibrate(void)
 {
-    if (!lapic_base) return;
-    
-    lapic_write(LAPIC_REG_TIMER_DIV, 0x03);
     lapic_write(LAPIC_REG_LVT_TIMER, 0x10000);  /* Masked */
     lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
-
+    
     /* PIT channel 0 at 1193182 Hz, 10ms = 11932 ticks */
     outb(0x43, 0x30);  /* Channel 0, lobyte/hibyte, mode 0 */
     outb(0x40, 0x9C);  /* Low byte of 11932 */
@@ -108,21 +162,76 @@ void lapic_timer_init(uint32_t frequency)
     lapic_write(LAPIC_REG_TIMER_INIT, 0);
     
     lapic_ticks_per_second = elapsed * 100;
+}
+
+/* Start this CPU's timer. All LAPIC timers run off the same bus clock,
+ * so only the first call calibrates and resets the uptime count; the
+ * application processors reuse the result.
+ */
+void lapic_timer_init(uint32_t frequency)
+{
+    if (!lapic_base) return;
+    
+    lapic_write(LAPIC_REG_TIMER_DIV, 0x03);
+    
+    if (lapic_ticks_per_second == 0) {
+        lapic_timer_calibrate();
+        lapic_timer_freq = frequency;
+        lapic_tick_ns = 1000000000ULL / frequency;
+        lapic_oneshot = tsc_is_calibrated();
+        lapic_ticks = lapic_oneshot ? tsc_ns() / lapic_tick_ns : 0;
+        
+        if (!lapic_oneshot) {
+            serial_puts("[LAPIC] Periodic timer\n");
+        } else if (tsc_has_deadline()) {
+            serial_puts("[LAPIC] One-shot timer, TSC deadline mode\n");
+        } else {
+            serial_puts("[LAPIC] One-shot timer\n");
+        }
+    }
+    
+    if (lapic_oneshot) {
+        uint32_t mode = tsc_has_deadline() ? LAPIC_TIMER_TSC_DEADLINE : LAPIC_TIMER_ONESHOT;
+        lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | mode);
+        lapic_timer_arm(lapic_tick_ns);
+        return;
+    }
     
     uint32_t count = lapic_ticks_per_second / frequency;
     if (count == 0) count = 1;
     
-    lapic_timer_freq = frequency;
-    lapic_ticks = 0;
-    
-    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | 0x20000);  /* Periodic */
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
     lapic_write(LAPIC_REG_TIMER_INIT, count);
 }
 
+/* Fire this CPU's timer once, ns from now. Longer than the 32-bit count
+ * reaches is cut short; the caller just re-arms when it fires.
+ */
+void lapic_timer_arm(uint64_t ns)
+{
+    if (!lapic_base || !lapic_oneshot) return;
+    
+    if (tsc_has_deadline()) {
+        wrmsr(MSR_IA32_TSC_DEADLINE, tsc_read() + tsc_ns_to_cycles(ns));
+        return;
+    }
+    
+    uint64_t count = (ns / 1000000000ULL) * lapic_ticks_per_second +
+                     (ns % 1000000000ULL) * lapic_ticks_per_second / 1000000000ULL;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+    lapic_write(LAPIC_REG_TIMER_INIT, (uint32_t)count);
+}
+
+int lapic_timer_is_oneshot(void)
+{
+    return lapic_oneshot;
+}
+
 void lapic_timer_stop(void)
 {
     lapic_write(LAPIC_REG_TIMER_INIT, 0);
-    lapic_write(LAPIC_REG_LVT_TIMER, 0x10000);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_MASKED);
 }
 
 int lapic_is_enabled(void)
@@ -4,6 +4,7 @@
 
 #include <kernel/kernel.h>
 #include <arch/x86/gdt.h>
+#include <mm/heap.h>
 #include <string.h>
 
 /* IOPB size: 8192 bytes = 65536 ports, 1 bit per port */
@@ -11,11 +12,36 @@
 
 /* Combined TSS + IOPB structure - must be contiguous in memory.
  * The CPU locates the IOPB at tss_base + iomap_base. */
-static struct {
+typedef struct {
     tss_entry_t tss;
     uint8_t     iopb[TSS_IOPB_SIZE];
     uint8_t     iopb_end;   /* Must be 0xFF - marks end of IOPB */
-} __attribute__((packed, aligned(16))) tss_block;
+} __attribute__((packed, aligned(16))) tss_block_t;
+
+static tss_block_t tss_block;
+
+/* Task entered on a double fault. A fault that cannot be delivered on
+ * the current stack (a kernel stack overflow) only recovers through a
+ * task switch, which brings its own stack.
+ */
+#define DF_STACK_SIZE 4096
+static tss_entry_t df_tss;
+static uint8_t df_stack[DF_STACK_SIZE] __attribute__((aligned(16)));
+static uint32_t df_cr3;
+static void (*df_handler)(void);
+
+/* Application processors get their own copy of the GDT. A TSS
+ * descriptor is marked busy once loaded, so each CPU needs one that
+ * points at a TSS of its own, and the same goes for the double fault
+ * task: two CPUs faulting at once must not share its stack.
+ */
+struct gdt_cpu {
+    gdt_entry_t entries[GDT_ENTRIES];
+    gdt_ptr_t ptr;
+    tss_block_t tss;
+    tss_entry_t df_tss;
+    uint8_t df_stack[DF_STACK_SIZE] __attribute__((aligned(16)));
+} __attribute__((aligned(16)));
 
 static gdt_entry_t gdt_entries[GDT_ENTRIES];
 static gdt_ptr_t gdt_ptr;
@@ -23,34 +49,40 @@ static gdt_ptr_t gdt_ptr;
 extern void gdt_flush(uint32_t gdt_ptr);
 extern void tss_flush(void);
 
-static void gdt_set_gate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
+static void gdt_encode(gdt_entry_t *entry, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
 {
-    gdt_entries[num].base_low = (base & 0xFFFF);
-    gdt_entries[num].base_middle = (base >> 16) & 0xFF;
-    gdt_entries[num].base_high = (base >> 24) & 0xFF;
+    entry->base_low = (base & 0xFFFF);
+    entry->base_middle = (base >> 16) & 0xFF;
+    entry->base_high = (base >> 24) & 0xFF;
 
-    gdt_entries[num].limit_low = (limit & 0xFFFF);
-    gdt_entries[num].granularity = (limit >> 16) & 0x0F;
+    entry->limit_low = (limit & 0xFFFF);
+    entry->granularity = (limit >> 16) & 0x0F;
 
-    gdt_entries[num].granularity |= gran & 0xF0;
-    gdt_entries[num].access = access;
+    entry->granularity |= gran & 0xF0;
+    entry->access = access;
 }
 
-static void write_tss(int32_t num, uint16_t ss0, uint32_t esp0)
+static void gdt_set_gate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
 {
-    uint32_t base = (uint32_t)&tss_block;
-    uint32_t limit = sizeof(tss_block) - 1;
+    gdt_encode(&gdt_entries[num], base, limit, access, gran);
+}
 
-    gdt_set_gate(num, base, limit, 0xE9, 0x00);
+static void tss_block_init(tss_block_t *block, uint16_t ss0, uint32_t esp0)
+{
+    memset(block, 0, sizeof(tss_block_t));
 
-    memset(&tss_block, 0, sizeof(tss_block));
+    block->tss.ss0 = ss0;
+    block->tss.esp0 = esp0;
+    block->tss.iomap_base = (uint16_t)((uint32_t)&block->iopb - (uint32_t)block);
 
-    tss_block.tss.ss0 = ss0;
-    tss_block.tss.esp0 = esp0;
-    tss_block.tss.iomap_base = (uint16_t)((uint32_t)&tss_block.iopb - (uint32_t)&tss_block);
+    memset(block->iopb, 0xFF, TSS_IOPB_SIZE);
+    block->iopb_end = 0xFF;
+}
 
-    memset(tss_block.iopb, 0xFF, TSS_IOPB_SIZE);
-    tss_block.iopb_end = 0xFF;
+static void write_tss(int32_t num, uint16_t ss0, uint32_t esp0)
+{
+    gdt_set_gate(num, (uint32_t)&tss_block, sizeof(tss_block) - 1, 0xE9, 0x00);
+    tss_block_init(&tss_block, ss0, esp0);
 }
 
 void gdt_init(void)
@@ -129,3 +161,69 @@ void tss_deny_all_iopb(void)
 {
     memset(tss_block.iopb, 0xFF, TSS_IOPB_SIZE);
 }
+
+static void df_tss_init(gdt_entry_t *entry, tss_entry_t *tss, uint8_t *stack)
+{
+    memset(tss, 0, sizeof(tss_entry_t));
+    tss->cr3 = df_cr3;
+    tss->eip = (uint32_t)df_handler;
+    tss->eflags = 0x2;      /* interrupts off */
+    tss->esp = (uint32_t)stack + DF_STACK_SIZE;
+    tss->ss0 = GDT_KERNEL_DATA_SEGMENT;
+    tss->esp0 = tss->esp;
+    tss->cs = GDT_KERNEL_CODE_SEGMENT;
+    tss->ss = GDT_KERNEL_DATA_SEGMENT;
+    tss->ds = GDT_KERNEL_DATA_SEGMENT;
+    tss->es = GDT_KERNEL_DATA_SEGMENT;
+    tss->fs = GDT_KERNEL_DATA_SEGMENT;
+    tss->gs = GDT_KERNEL_DATA_SEGMENT;
+    tss->iomap_base = sizeof(tss_entry_t);
+
+    /* Present, DPL 0, available 32-bit TSS */
+    gdt_encode(entry, (uint32_t)tss, sizeof(tss_entry_t) - 1, 0x89, 0x00);
+}
+
+/* Sets up the BSP's double fault task; CPUs created afterwards get
+ * their own from gdt_create_cpu.
+ */
+void gdt_init_double_fault(uint32_t cr3, void (*handler)(void))
+{
+    df_cr3 = cr3;
+    df_handler = handler;
+    df_tss_init(&gdt_entries[GDT_DF_TSS_SEGMENT / 8], &df_tss, df_stack);
+}
+
+/* Built by the BSP before it starts an application processor, which
+ * then loads it with gdt_load_cpu. esp0 is the AP's kernel stack top.
+ */
+gdt_cpu_t *gdt_create_cpu(uint32_t esp0)
+{
+    gdt_cpu_t *cpu = (gdt_cpu_t *)kmalloc_aligned(sizeof(gdt_cpu_t), 16);
+    if (!cpu) return NULL;
+
+    memcpy(cpu->entries, gdt_entries, sizeof(gdt_entries));
+    cpu->ptr.limit = sizeof(cpu->entries) - 1;
+    cpu->ptr.base = (uint32_t)&cpu->entries;
+
+    gdt_encode(&cpu->entries[GDT_TSS_SEGMENT / 8], (uint32_t)&cpu->tss,
+               sizeof(cpu->tss) - 1, 0xE9, 0x00);
+    tss_block_init(&cpu->tss, GDT_KERNEL_DATA_SEGMENT, esp0);
+
+    if (df_handler) {
+        df_tss_init(&cpu->entries[GDT_DF_TSS_SEGMENT / 8], &cpu->df_tss, cpu->df_stack);
+    }
+
+    return cpu;
+}
+
+/* The TSS the CPU's interrupted context is saved in on a task switch */
+tss_entry_t *gdt_cpu_get_tss(gdt_cpu_t *cpu)
+{
+    return &cpu->tss.tss;
+}
+
+void gdt_load_cpu(gdt_cpu_t *cpu)
+{
+    gdt_flush((uint32_t)&cpu->ptr);
+    tss_flush();
+}
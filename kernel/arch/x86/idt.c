@@ -113,6 +113,8 @@ extern void irq12(void);
 extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
+extern void irq16(void);
+extern void irq17(void);
 
 static void pic_remap(void)
 {
@@ -222,6 +224,10 @@ void idt_init(void)
     idt_set_gate(46, (uint32_t)irq14, 0x08, IDT_KERNEL_INT);
     idt_set_gate(47, (uint32_t)irq15, 0x08, IDT_KERNEL_INT);
 
+    /* Wakeup IPI between CPUs, only ever sent with the APIC enabled */
+    idt_set_gate(LAPIC_WAKE_VECTOR, (uint32_t)irq16, 0x08, IDT_KERNEL_INT);
+    idt_set_gate(LAPIC_TLB_VECTOR, (uint32_t)irq17, 0x08, IDT_KERNEL_INT);
+
     /* syscall interrupt (INT 0x80) - DPL=3 for user access */
     idt_set_gate(128, (uint32_t)isr128, 0x08, IDT_USER_INT);
 
@@ -234,6 +240,12 @@ void idt_init(void)
     idt_flush((uint32_t)&idt_ptr);
 }
 
+/* Application processors share the BSP's table */
+void idt_load(void)
+{
+    idt_flush((uint32_t)&idt_ptr);
+}
+
 void idt_set_handler(uint8_t num, uint32_t handler, uint16_t sel, uint8_t flags)
 {
     idt_set_gate(num, handler, sel, flags);
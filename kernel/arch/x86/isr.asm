@@ -140,6 +140,8 @@ IRQ 12, 44  ; PS/2 Mouse
 IRQ 13, 45  ; FPU
 IRQ 14, 46  ; Primary ATA
 IRQ 15, 47  ; Secondary ATA
+IRQ 16, 240 ; Wakeup IPI (LAPIC_WAKE_VECTOR)
+IRQ 17, 241 ; TLB shootdown IPI (LAPIC_TLB_VECTOR)
 
 global gdt_flush
 gdt_flush:
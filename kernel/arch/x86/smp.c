@@ -0,0 +1,268 @@
+/* SMP
+ * Brings up the application processors listed in the MADT
+ *
+ * APs are started one at a time with INIT, then STARTUP IPIs pointing
+ * at the real-mode trampoline. Each one gets a kernel stack and its own
+ * GDT/TSS, loads the shared IDT, switches on its LAPIC and timer and
+ * marks itself online, then becomes the idle task of its run queue.
+ */
+
+#include <kernel/kernel.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/gdt.h>
+#include <arch/x86/idt.h>
+#include <apic/lapic.h>
+#include <acpi/acpi.h>
+#include <mm/vmm.h>
+#include <mm/kstack.h>
+#include <kernel/scheduler.h>
+#include <drivers/serial.h>
+#include <sync/spinlock.h>
+#include <string.h>
+
+#define SMP_TIMER_HZ        100
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint8_t smp_trampoline_cr3[];
+extern uint8_t smp_trampoline_cr4[];
+extern uint8_t smp_trampoline_stack[];
+extern uint8_t smp_trampoline_entry[];
+
+/* A parameter in the copy of the trampoline, through the kernel's
+ * mapping of low memory
+ */
+#define TRAMPOLINE_PARAM(sym) \
+    ((volatile uint32_t *)(KERNEL_VMA + SMP_TRAMPOLINE_BASE + ((uint32_t)(sym) - (uint32_t)smp_trampoline_start)))
+
+/* The BSP counts as online from the start, APIC or not */
+static cpu_t cpus[SMP_MAX_CPUS] = { [0] = { .online = 1 } };
+static uint8_t apic_to_cpu[256];
+static uint32_t cpu_count = 1;
+static volatile uint32_t cpus_online = 1;
+
+/* Remote TLB flush: the range being flushed, one request flag per CPU
+ * and the number of CPUs that have not flushed it yet
+ */
+static spinlock_t tlb_lock = SPINLOCK_INIT;
+static volatile uint32_t tlb_start;
+static volatile uint32_t tlb_end;
+static volatile uint8_t tlb_request[SMP_MAX_CPUS];
+static volatile uint32_t tlb_acks_pending;
+
+/* Roughly one microsecond per port 0x80 write; good enough for the
+ * INIT/STARTUP sequence, which only needs lower bounds.
+ */
+static void smp_udelay(uint32_t us)
+{
+    while (us--) {
+        io_wait();
+    }
+}
+
+static void smp_ap_entry(void)
+{
+    cpu_t *cpu = &cpus[smp_cpu_id()];
+    
+    gdt_load_cpu(cpu->gdt);
+    idt_load();
+    lapic_init_ap();
+    lapic_timer_init(SMP_TIMER_HZ);
+    
+    cpu->online = 1;
+    __sync_fetch_and_add(&cpus_online, 1);
+    
+    scheduler_ap_start();
+}
+
+static int smp_boot_ap(uint32_t index, uint8_t apic_id)
+{
+    cpu_t *cpu = &cpus[index];
+    cpu->id = index;
+    cpu->apic_id = apic_id;
+    cpu->online = 0;
+    
+    cpu->kernel_stack = kstack_alloc(KSTACK_DEFAULT_SIZE);
+    if (!cpu->kernel_stack) return -12;
+    
+    uint32_t stack_top = (uint32_t)cpu->kernel_stack + KSTACK_DEFAULT_SIZE;
+    cpu->gdt = gdt_create_cpu(stack_top);
+    if (!cpu->gdt) {
+        kstack_free(cpu->kernel_stack);
+        cpu->kernel_stack = NULL;
+        return -12;
+    }
+    
+    apic_to_cpu[apic_id] = (uint8_t)index;
+    *TRAMPOLINE_PARAM(smp_trampoline_stack) = stack_top;
+    
+    lapic_send_init(apic_id);
+    smp_udelay(10000);
+    
+    /* The second STARTUP is only for CPUs that missed the first */
+    for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_startup(apic_id, SMP_TRAMPOLINE_BASE >> 12);
+        for (int wait = 0; wait < 1000 && !cpu->online; wait++) {
+            smp_udelay(100);
+        }
+    }
+    
+    return cpu->online ? 0 : -5;
+}
+
+static void smp_tlb_ipi(registers_t *regs)
+{
+    (void)regs;
+    smp_tlb_poll();
+}
+
+void smp_init(void)
+{
+    cpus[0].apic_id = (uint8_t)lapic_get_id();
+    
+    uint32_t listed = acpi_get_cpu_count();
+    if (!lapic_is_enabled() || listed <= 1) {
+        serial_puts("[SMP] Single processor\n");
+        return;
+    }
+    
+    register_interrupt_handler(LAPIC_TLB_VECTOR, smp_tlb_ipi);
+    
+    uint32_t size = (uint32_t)smp_trampoline_end - (uint32_t)smp_trampoline_start;
+    memcpy((void *)(KERNEL_VMA + SMP_TRAMPOLINE_BASE), smp_trampoline_start, size);
+    
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    *TRAMPOLINE_PARAM(smp_trampoline_cr3) = vmm_get_kernel_directory();
+    *TRAMPOLINE_PARAM(smp_trampoline_cr4) = cr4;
+    *TRAMPOLINE_PARAM(smp_trampoline_entry) = (uint32_t)smp_ap_entry;
+    
+    /* The trampoline turns on paging while running at its physical
+     * address, so that page has to be identity mapped meanwhile.
+     */
+    vmm_map_page(SMP_TRAMPOLINE_BASE, SMP_TRAMPOLINE_BASE, PAGE_PRESENT | PAGE_WRITE);
+    
+    for (uint32_t i = 0; i < listed && cpu_count < SMP_MAX_CPUS; i++) {
+        uint8_t apic_id = acpi_get_cpu_apic_id(i);
+        if (apic_id == cpus[0].apic_id) continue;
+        
+        int result = smp_boot_ap(cpu_count, apic_id);
+        if (result == -12) break;
+        
+        /* One that timed out keeps its slot, stack and GDT: it may
+         * still come up late and must find its own.
+         */
+        cpu_count++;
+        if (result != 0) {
+            serial_puts("[SMP] Application processor did not start\n");
+        }
+    }
+    
+    vmm_unmap_page(SMP_TRAMPOLINE_BASE);
+    
+    char count[2] = { (char)('0' + cpus_online), '\0' };   /* SMP_MAX_CPUS < 10 */
+    serial_puts("[SMP] ");
+    serial_puts(count);
+    serial_puts(" CPU(s) online\n");
+}
+
+uint32_t smp_cpu_count(void)
+{
+    return cpus_online;
+}
+
+/* Logical number of the calling CPU. APs are entered in the table
+ * before they start, so until then everything reads as the BSP.
+ */
+uint32_t smp_cpu_id(void)
+{
+    if (!lapic_is_enabled()) return 0;
+    return apic_to_cpu[lapic_get_id() & 0xFF];
+}
+
+cpu_t *smp_get_cpu(uint32_t id)
+{
+    if (id >= cpu_count || !cpus[id].online) return NULL;
+    return &cpus[id];
+}
+
+int smp_is_bsp(void)
+{
+    return smp_cpu_id() == 0;
+}
+
+void smp_timer_tick(uint32_t ticks)
+{
+    cpus[smp_cpu_id()].ticks += ticks;
+}
+
+/* Interrupt a halted CPU so it looks at its run queue. The vector has
+ * no handler: taking the interrupt is all it is for.
+ */
+void smp_wake_cpu(uint32_t id)
+{
+    if (id >= cpu_count || !cpus[id].online || id == smp_cpu_id()) return;
+    
+    lapic_send_ipi(cpus[id].apic_id, LAPIC_WAKE_VECTOR);
+}
+
+/* Flush this CPU's TLB for a range another CPU posted, if there is one.
+ * Called from the shootdown IPI, and by anything spinning with
+ * interrupts off, so a CPU waiting for a lock held by the initiator
+ * still answers.
+ */
+void smp_tlb_poll(void)
+{
+    uint32_t cpu = smp_cpu_id();
+    if (!tlb_request[cpu]) return;
+    
+    vmm_flush_range_local(tlb_start, tlb_end);
+    tlb_request[cpu] = 0;
+    __sync_fetch_and_sub(&tlb_acks_pending, 1);
+}
+
+/* Invalidate [start, end) on every other online CPU and wait until all
+ * of them have, so frames behind the range can be freed afterwards.
+ * Kernel mappings are global and shared by all CPUs; a user address
+ * space is only loaded on the CPU of the task that owns it, which never
+ * migrates, and needs no shootdown.
+ */
+void smp_tlb_shootdown(uint32_t start, uint32_t end)
+{
+    if (cpus_online <= 1) return;
+    
+    uint32_t flags;
+    __asm__ volatile("pushfl\n popl %0\n cli" : "=r"(flags) : : "memory");
+    
+    /* Another CPU may be shooting down too and waiting for us */
+    while (!spinlock_try_acquire(&tlb_lock)) {
+        smp_tlb_poll();
+        __asm__ volatile("pause");
+    }
+    
+    uint32_t self = smp_cpu_id();
+    tlb_start = start;
+    tlb_end = end;
+    
+    uint32_t targets = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i != self && cpus[i].online) {
+            targets++;
+        }
+    }
+    tlb_acks_pending = targets;
+    
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i != self && cpus[i].online) {
+            tlb_request[i] = 1;
+            lapic_send_ipi(cpus[i].apic_id, LAPIC_TLB_VECTOR);
+        }
+    }
+    
+    while (tlb_acks_pending) {
+        __asm__ volatile("pause");
+    }
+    
+    spinlock_release(&tlb_lock);
+    __asm__ volatile("pushl %0\n popfl" : : "r"(flags) : "memory", "cc");
+}
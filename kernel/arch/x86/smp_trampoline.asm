@@ -0,0 +1,79 @@
+; SMP Trampoline
+; Real-mode entry point of the application processors
+;
+; smp_init copies this code to SMP_TRAMPOLINE_BASE and fills in the
+; parameter block at its end. Each AP switches to protected mode, turns
+; on paging with the kernel directory and calls into smp.c on the stack
+; it was handed. Addresses are computed against the copy, not the link
+; address.
+
+SMP_TRAMPOLINE_BASE equ 0x8000
+%define TRAMP(label) (SMP_TRAMPOLINE_BASE + ((label) - smp_trampoline_start))
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_cr3
+global smp_trampoline_cr4
+global smp_trampoline_stack
+global smp_trampoline_entry
+
+section .text
+
+[BITS 16]
+smp_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [TRAMP(tramp_gdt_ptr)]
+    mov eax, cr0
+    or eax, 1               ; PE
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(tramp_protected)
+
+[BITS 32]
+tramp_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; CR4 before paging: the kernel directory may use 4MB and global pages
+    mov eax, [TRAMP(smp_trampoline_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMP(smp_trampoline_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000      ; PG
+    mov cr0, eax
+
+    mov esp, [TRAMP(smp_trampoline_stack)]
+    mov eax, [TRAMP(smp_trampoline_entry)]
+    call eax
+
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+; Flat code and data, just enough to reach the kernel's own GDT
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF
+    dq 0x00CF92000000FFFF
+tramp_gdt_ptr:
+    dw tramp_gdt_ptr - tramp_gdt - 1
+    dd TRAMP(tramp_gdt)
+
+; Parameter block, written by smp_init for each AP
+smp_trampoline_cr3:
+    dd 0
+smp_trampoline_cr4:
+    dd 0
+smp_trampoline_stack:
+    dd 0
+smp_trampoline_entry:
+    dd 0
+smp_trampoline_end:
@@ -0,0 +1,96 @@
+/* TSC
+ * Time stamp counter calibration and conversion
+ *
+ * The TSC is measured once at boot against PIT channel 2, which is
+ * gated through port 0x61 and leaves channel 0, the system tick, alone.
+ * Afterwards it counts nanoseconds since calibration for ktime_ns.
+ * Only hlt is used to idle, which does not stop the counter even where
+ * it is not invariant.
+ */
+
+#include <arch/x86/tsc.h>
+#include <kernel/kernel.h>
+#include <drivers/serial.h>
+
+#define NS_PER_SEC          1000000000ULL
+
+/* 10ms of PIT input clock at 1193182 Hz */
+#define TSC_CALIBRATE_LATCH 11932
+#define TSC_CALIBRATE_HZ    100
+
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_base = 0;
+static int tsc_deadline = 0;
+
+static uint64_t tsc_calibrate(void)
+{
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x02) | 0x01);   /* Speaker off, channel 2 gate on */
+    
+    outb(0x43, 0xB0);                    /* Channel 2, lobyte/hibyte, mode 0 */
+    outb(0x42, TSC_CALIBRATE_LATCH & 0xFF);
+    outb(0x42, TSC_CALIBRATE_LATCH >> 8);
+    
+    uint64_t start = tsc_read();
+    while (!(inb(0x61) & 0x20));         /* OUT2 goes high at terminal count */
+    uint64_t end = tsc_read();
+    
+    outb(0x61, gate);
+    return (end - start) * TSC_CALIBRATE_HZ;
+}
+
+void tsc_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & (1 << 4))) {
+        serial_puts("[TSC] Not available, timekeeping stays tick based\n");
+        return;
+    }
+    tsc_deadline = (ecx >> 24) & 1;
+    
+    uint64_t hz = tsc_calibrate();
+    if (hz < 1000000) {
+        serial_puts("[TSC] Calibration failed\n");
+        return;
+    }
+    
+    tsc_base = tsc_read();
+    tsc_hz = hz;
+    
+    serial_printf("[TSC] %u MHz%s\n", (uint32_t)(hz / 1000000),
+                  tsc_deadline ? ", TSC deadline timer" : "");
+}
+
+int tsc_is_calibrated(void)
+{
+    return tsc_hz != 0;
+}
+
+int tsc_has_deadline(void)
+{
+    return tsc_deadline && tsc_hz != 0;
+}
+
+uint64_t tsc_get_hz(void)
+{
+    return tsc_hz;
+}
+
+/* Split at whole seconds so the products stay within 64 bits */
+uint64_t tsc_cycles_to_ns(uint64_t cycles)
+{
+    if (!tsc_hz) return 0;
+    return (cycles / tsc_hz) * NS_PER_SEC + (cycles % tsc_hz) * NS_PER_SEC / tsc_hz;
+}
+
+uint64_t tsc_ns_to_cycles(uint64_t ns)
+{
+    return (ns / NS_PER_SEC) * tsc_hz + (ns % NS_PER_SEC) * tsc_hz / NS_PER_SEC;
+}
+
+/* Nanoseconds since calibration */
+uint64_t tsc_ns(void)
+{
+    return tsc_cycles_to_ns(tsc_read() - tsc_base);
+}
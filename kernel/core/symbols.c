@@ -24,6 +24,7 @@ extern void task_unblock(void *task);
 extern void mutex_lock(void *mutex);
 extern void mutex_unlock(void *mutex);
 extern void kmalloc(uint32_t size);
+extern void kmalloc_tagged(uint32_t size, const char *tag);
 extern void kfree(void *ptr);
 extern void vga_puts(const char *str);
 extern void serial_puts(const char *str);
@@ -41,6 +42,7 @@ void symbols_init(void)
     symbols_add((uint32_t)mutex_lock, "mutex_lock");
     symbols_add((uint32_t)mutex_unlock, "mutex_unlock");
     symbols_add((uint32_t)kmalloc, "kmalloc");
+    symbols_add((uint32_t)kmalloc_tagged, "kmalloc_tagged");
     symbols_add((uint32_t)kfree, "kfree");
     symbols_add((uint32_t)vga_puts, "vga_puts");
     symbols_add((uint32_t)serial_puts, "serial_puts");
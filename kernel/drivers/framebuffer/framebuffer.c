@@ -71,7 +71,7 @@ static void fb_dirty_mark_full(void)
 }
 
 
-#define FB_VIRT_BASE    0xE0100000
+#define FB_VIRT_BASE    0xE0400000
 
 
 #define BGA_INDEX_PORT      0x01CE
@@ -130,14 +130,34 @@ int fb_init(uint32_t phys_addr, uint32_t width, uint32_t height,
     serial_printf(" %dx%d\n", width, height);
 
     
-    uint32_t pages = (fb.size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint32_t i = 0; i < pages; i++) {
-        uint32_t virt = FB_VIRT_BASE + (i * PAGE_SIZE);
-        uint32_t phys = phys_addr + (i * PAGE_SIZE);
-        vmm_map_page(virt, phys, PAGE_PRESENT | PAGE_WRITE | PAGE_PWT | PAGE_PCD);
+    /* Keep the virtual address congruent to the physical one modulo 4MB,
+     * so every 4MB-aligned stretch of the framebuffer can be a large page.
+     */
+    uint32_t fb_virt = FB_VIRT_BASE + (phys_addr & (LARGE_PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    uint32_t map_size = ALIGN_UP(fb.size + (phys_addr & (PAGE_SIZE - 1)), PAGE_SIZE);
+    uint32_t large_pages = 0;
+    uint32_t offset = 0;
+    while (offset < map_size) {
+        uint32_t virt = fb_virt + offset;
+        uint32_t phys = (phys_addr & ~(PAGE_SIZE - 1)) + offset;
+        if (map_size - offset >= LARGE_PAGE_SIZE &&
+            vmm_map_large(virt, phys, PAGE_PRESENT | PAGE_WRITE | PAGE_PWT | PAGE_PCD) == 0) {
+            offset += LARGE_PAGE_SIZE;
+            large_pages++;
+            continue;
+        }
+        uint32_t run = ALIGN_UP(virt + 1, LARGE_PAGE_SIZE) - virt;
+        if (run > map_size - offset) {
+            run = map_size - offset;
+        }
+        vmm_map_range(virt, phys, run, PAGE_PRESENT | PAGE_WRITE | PAGE_PWT | PAGE_PCD);
+        offset += run;
+    }
+    if (large_pages) {
+        serial_printf("[FB] Mapped with %d 4MB pages\n", large_pages);
     }
 
-    fb.addr = (uint32_t *)FB_VIRT_BASE;
+    fb.addr = (uint32_t *)(fb_virt + (phys_addr & (PAGE_SIZE - 1)));
 
     
     fb.back_buffer = (uint32_t *)kmalloc(fb.size);
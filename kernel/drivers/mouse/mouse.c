@@ -446,6 +446,11 @@ void mouse_set_bounds(int32_t mx, int32_t my)
     max_y = my;
 }
 
+int mouse_has_event(void)
+{
+    return eq_head != eq_tail;
+}
+
 int mouse_get_event(mouse_event_t *event)
 {
     if (eq_head == eq_tail) return 0;
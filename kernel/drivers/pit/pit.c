@@ -8,7 +8,9 @@
 #include <arch/x86/idt.h>
 #include <kernel/kernel.h>
 #include <kernel/scheduler.h>
+#include <kernel/timer.h>
 #include <apic/lapic.h>
+#include <arch/x86/smp.h>
 
 static volatile uint64_t pit_ticks = 0;
 static uint32_t pit_freq = 0;
@@ -18,21 +20,38 @@ static void pit_handler(registers_t *regs)
     (void)regs;
     pit_ticks++;
     mouse_tick();
-    scheduler_tick();
+    timer_tick();
+    scheduler_tick(1);
 }
 
 static void lapic_timer_irq_handler(registers_t *regs)
 {
     (void)regs;
+    /* A one-shot timer fires early for timers and idle polls and skips
+     * ticks while idle; count the tick periods that actually passed.
+     */
+    uint32_t ticks = timer_ticks_elapsed();
+    
+    /* Uptime is driven by the BSP's timer alone */
+    if (!smp_is_bsp()) {
+        smp_timer_tick(ticks);
+        timer_rearm();
+        scheduler_tick(ticks);
+        return;
+    }
     lapic_timer_handler();
-    mouse_tick();
-    scheduler_tick();
+    for (uint32_t i = 0; i < ticks; i++) {
+        mouse_tick();
+    }
+    timer_tick();
+    timer_rearm();
+    scheduler_tick(ticks);
 }
 
 void pit_init(uint32_t frequency)
 {
     uint32_t divisor = PIT_FREQUENCY / frequency;
-
+    
     if (divisor < 1) divisor = 1;
     if (divisor > 65535) divisor = 65535;
     
@@ -10,6 +10,7 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/heap.h>
+#include <mm/kstack.h>
 #include <drivers/serial.h>
 #include <drivers/vga.h>
 #include <string.h>
@@ -20,6 +21,15 @@
 #define USER_STACK_TOP   0xBFFFF000
 #define USER_STACK_SIZE  0x00010000
 
+/* Drop a half-built image and go back to the caller's address space */
+static user_process_t *elf_load_abort(user_process_t *proc, uint32_t prev_pd)
+{
+    vmm_switch_directory(prev_pd);
+    vmm_destroy_directory(proc->page_dir);
+    kfree(proc);
+    return NULL;
+}
+
 user_process_t *elf_load_from_memory(const uint8_t *data, uint32_t size)
 {
     if (size < sizeof(elf_header_t)) {
@@ -76,6 +86,18 @@ user_process_t *elf_load_from_memory(const uint8_t *data, uint32_t size)
     memset(proc, 0, sizeof(user_process_t));
     strcpy(proc->name, "user");
     
+    /* Each program gets its own address space; the loader fills it in
+     * place, so it stays loaded for elf_execute.
+     */
+    uint32_t prev_pd = vmm_get_directory();
+    proc->page_dir = vmm_create_directory();
+    if (!proc->page_dir) {
+        serial_puts("[ELF] Out of memory for page directory\n");
+        kfree(proc);
+        return NULL;
+    }
+    vmm_switch_directory(proc->page_dir);
+    
     elf_phdr_t *phdrs = (elf_phdr_t *)(data + hdr->e_phoff);
     
     for (int i = 0; i < hdr->e_phnum; i++) {
@@ -110,22 +132,24 @@ user_process_t *elf_load_from_memory(const uint8_t *data, uint32_t size)
             serial_puts(hex);
             serial_puts("\n");
             
-            for (uint32_t addr = page_start; addr < page_end; addr += 0x1000) {
-                uint32_t phys = pmm_alloc_frame();
-                if (!phys) {
-                    serial_puts("[ELF] Out of memory\n");
-                    kfree(proc);
-                    return NULL;
-                }
-                vmm_map_page(addr, phys, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+            /* Pages shared with the previous segment are already mapped
+             * and keep their contents.
+             */
+            if (vmm_alloc_range(page_start, page_end - page_start,
+                                PAGE_PRESENT | PAGE_WRITE | PAGE_USER) != 0) {
+                serial_puts("[ELF] Out of memory\n");
+                return elf_load_abort(proc, prev_pd);
             }
             
+            /* vmm_alloc_range hands out zeroed frames, so .bss past
+             * filesz needs no memset.
+             */
             if (filesz > 0) {
                 memcpy((void *)vaddr, data + offset, filesz);
             }
             
-            if (memsz > filesz) {
-                memset((void *)(vaddr + filesz), 0, memsz - filesz);
+            if (page_end > proc->brk) {
+                proc->brk = page_end;
             }
         }
     }
@@ -217,14 +241,10 @@ user_process_t *elf_load_from_memory(const uint8_t *data, uint32_t size)
     serial_puts(hex);
     serial_puts("\n");
     
-    for (uint32_t addr = stack_base; addr < USER_STACK_TOP; addr += 0x1000) {
-        uint32_t phys = pmm_alloc_frame();
-        if (!phys) {
-            serial_puts("[ELF] Out of memory for stack\n");
-            kfree(proc);
-            return NULL;
-        }
-        vmm_map_page(addr, phys, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+    if (vmm_alloc_range(stack_base, USER_STACK_TOP - stack_base,
+                        PAGE_PRESENT | PAGE_WRITE | PAGE_USER) != 0) {
+        serial_puts("[ELF] Out of memory for stack\n");
+        return elf_load_abort(proc, prev_pd);
     }
     proc->stack_top = USER_STACK_TOP - 16;
     
@@ -299,12 +319,21 @@ void elf_execute(user_process_t *proc)
      * When returning from UM, CPU will use this stack */
     extern void gdt_set_kernel_stack(uint32_t stack);
     
-    uint32_t *kstack_base = (uint32_t *)kmalloc(4096);
-    uint32_t kernel_stack = (uint32_t)kstack_base + 4096;
+    uint32_t *kstack_base = (uint32_t *)task_stack_alloc(KSTACK_DEFAULT_SIZE);
+    uint32_t kernel_stack = (uint32_t)kstack_base + KSTACK_DEFAULT_SIZE;
     
     if (kernel_proc) {
         kernel_proc->kernel_stack = (uint32_t)kstack_base;
         kernel_proc->elf_proc = proc;
+        kernel_proc->page_directory = proc->page_dir;
+        kernel_proc->brk_start = proc->brk;
+        kernel_proc->brk = proc->brk;
+    }
+    
+    /* The running task now lives in the program's address space */
+    task_t *task = task_current();
+    if (task) {
+        task->page_directory = proc->page_dir;
     }
     
     serial_puts("[ELF] Kernel stack for TSS: 0x");
@@ -392,25 +421,8 @@ void elf_free_process(user_process_t *proc)
 {
     if (!proc) return;
     
-    if (proc->page_dir) {
-        uint32_t *pd = (uint32_t *)proc->page_dir;
-        
-        for (int i = 0; i < 768; i++) {
-            if (pd[i] & PAGE_PRESENT) {
-                uint32_t *pt = (uint32_t *)((pd[i] & 0xFFFFF000) + KERNEL_VMA);
-                
-                for (int j = 0; j < 1024; j++) {
-                    if (pt[j] & PAGE_PRESENT) {
-                        pmm_free_frame(pt[j] & 0xFFFFF000);
-                    }
-                }
-                
-                pmm_free_frame(pd[i] & 0xFFFFF000);
-            }
-        }
-        
-        pmm_free_frame(proc->page_dir - KERNEL_VMA);
-    }
-    
+    /* The address space belongs to the process_t that elf_execute
+     * handed it to and is torn down with that process.
+     */
     kfree(proc);
 }
@@ -12,6 +12,11 @@ uint8_t fat32_sector_buf[512];
 
 fat32_fs_t *fat32_mounted_drives[4] = { NULL, NULL, NULL, NULL };
 
+/* One cluster buffer cache per cluster size (1..128 sectors), shared by
+ * every volume with that geometry.
+ */
+static kmem_cache_t *fat32_cluster_caches[8];
+
 int fat32_read_sector_internal(fat32_fs_t *fs, uint32_t sector, void *buffer)
 {
     return ata_read_sectors(fs->drive, fs->partition_lba + sector, 1, buffer);
@@ -77,6 +82,15 @@ fat32_fs_t *fat32_mount(int drive, uint32_t partition_lba)
         fs->volume_label[i] = '\0';
     }
     
+    int shift = 0;
+    while (shift < 7 && (1U << shift) < fs->sectors_per_cluster) {
+        shift++;
+    }
+    if (!fat32_cluster_caches[shift]) {
+        fat32_cluster_caches[shift] = kmem_cache_create("fat32_cluster", 512U << shift, 16, NULL);
+    }
+    fs->cluster_cache = fat32_cluster_caches[shift];
+    
     serial_puts("[FAT32] Mounted: ");
     serial_puts(fs->volume_label);
     serial_puts("\n");
@@ -91,6 +105,23 @@ void fat32_unmount(fat32_fs_t *fs)
     }
 }
 
+uint8_t *fat32_alloc_cluster_buf(fat32_fs_t *fs)
+{
+    if (!fs->cluster_cache) {
+        return kmalloc(fs->sectors_per_cluster * 512);
+    }
+    return kmem_cache_alloc(fs->cluster_cache);
+}
+
+void fat32_free_cluster_buf(fat32_fs_t *fs, void *buf)
+{
+    if (!fs->cluster_cache) {
+        kfree(buf);
+        return;
+    }
+    kmem_cache_free(fs->cluster_cache, buf);
+}
+
 int fat32_read_cluster(fat32_fs_t *fs, uint32_t cluster, void *buffer)
 {
     if (cluster < 2) {
@@ -152,7 +183,7 @@ int fat32_list_dir(fat32_fs_t *fs, uint32_t cluster,
                    void (*callback)(const char *name, uint32_t size, uint8_t attr, void *ctx),
                    void *ctx)
 {
-    uint8_t *cluster_buf = kmalloc(fs->sectors_per_cluster * 512);
+    uint8_t *cluster_buf = fat32_alloc_cluster_buf(fs);
     if (!cluster_buf) {
         return -1;
     }
@@ -162,7 +193,7 @@ int fat32_list_dir(fat32_fs_t *fs, uint32_t cluster,
     
     while (current_cluster != 0 && current_cluster < FAT32_CLUSTER_END) {
         if (fat32_read_cluster(fs, current_cluster, cluster_buf) < 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(fs, cluster_buf);
             return -1;
         }
         
@@ -173,7 +204,7 @@ int fat32_list_dir(fat32_fs_t *fs, uint32_t cluster,
             fat32_dirent_t *entry = &entries[i];
             
             if (entry->name[0] == 0x00) {
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return count;
             }
             
@@ -204,7 +235,7 @@ int fat32_list_dir(fat32_fs_t *fs, uint32_t cluster,
         current_cluster = fat32_next_cluster(fs, current_cluster);
     }
     
-    kfree(cluster_buf);
+    fat32_free_cluster_buf(fs, cluster_buf);
     return count;
 }
 
@@ -234,7 +265,7 @@ static int name_match(const char *pattern, const fat32_dirent_t *entry)
 int fat32_find_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
                      fat32_dirent_t *out_entry)
 {
-    uint8_t *cluster_buf = kmalloc(fs->sectors_per_cluster * 512);
+    uint8_t *cluster_buf = fat32_alloc_cluster_buf(fs);
     if (!cluster_buf) {
         return -1;
     }
@@ -243,7 +274,7 @@ int fat32_find_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
     
     while (current_cluster != 0 && current_cluster < FAT32_CLUSTER_END) {
         if (fat32_read_cluster(fs, current_cluster, cluster_buf) < 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(fs, cluster_buf);
             return -1;
         }
         
@@ -254,7 +285,7 @@ int fat32_find_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
             fat32_dirent_t *entry = &entries[i];
             
             if (entry->name[0] == 0x00) {
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return -1;
             }
             
@@ -266,7 +297,7 @@ int fat32_find_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
                 if (out_entry) {
                     memcpy(out_entry, entry, sizeof(fat32_dirent_t));
                 }
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return 0;
             }
         }
@@ -274,7 +305,7 @@ int fat32_find_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
         current_cluster = fat32_next_cluster(fs, current_cluster);
     }
     
-    kfree(cluster_buf);
+    fat32_free_cluster_buf(fs, cluster_buf);
     return -1;
 }
 
@@ -290,7 +321,7 @@ int fat32_read_file(fat32_fs_t *fs, uint32_t start_cluster, uint32_t file_size,
     }
     
     uint32_t cluster_size = fs->sectors_per_cluster * 512;
-    uint8_t *cluster_buf = kmalloc(cluster_size);
+    uint8_t *cluster_buf = fat32_alloc_cluster_buf(fs);
     if (!cluster_buf) {
         return -1;
     }
@@ -310,7 +341,7 @@ int fat32_read_file(fat32_fs_t *fs, uint32_t start_cluster, uint32_t file_size,
     
     while (bytes_read < size && current_cluster != 0 && current_cluster < FAT32_CLUSTER_END) {
         if (fat32_read_cluster(fs, current_cluster, cluster_buf) < 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(fs, cluster_buf);
             return -1;
         }
         
@@ -328,6 +359,6 @@ int fat32_read_file(fat32_fs_t *fs, uint32_t start_cluster, uint32_t file_size,
         cluster_index++;
     }
     
-    kfree(cluster_buf);
+    fat32_free_cluster_buf(fs, cluster_buf);
     return bytes_read;
 }
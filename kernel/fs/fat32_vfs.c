@@ -6,7 +6,7 @@
 #include <fs/vfs.h>
 #include <drivers/ata.h>
 #include <drivers/serial.h>
-#include <mm/heap.h>
+#include <mm/slab.h>
 #include <string.h>
 
 extern fat32_fs_t *fat32_mounted_drives[4];
@@ -40,6 +40,9 @@ static int dir_cache_count = 0;
 static uint32_t dir_cache_cluster = 0;
 static fat32_fs_t *dir_cache_fs = NULL;
 
+static kmem_cache_t *fat32_node_cache = NULL;
+static kmem_cache_t *fat32_data_cache = NULL;
+
 static void dir_cache_callback(const char *name, uint32_t size, uint8_t attr, void *ctx)
 {
     (void)ctx;
@@ -57,12 +60,18 @@ static vfs_node_t *fat32_create_vfs_node(fat32_fs_t *fs, const char *name,
                                           uint32_t cluster, uint32_t size, uint8_t attr,
                                           vfs_node_t *parent)
 {
-    vfs_node_t *node = kmalloc(sizeof(vfs_node_t));
+    if (!fat32_node_cache) {
+        fat32_node_cache = kmem_cache_create("fat32_vfs_node", sizeof(vfs_node_t), 0, NULL);
+        fat32_data_cache = kmem_cache_create("fat32_vfs_data", sizeof(fat32_vfs_data_t), 0, NULL);
+        if (!fat32_node_cache || !fat32_data_cache) return NULL;
+    }
+    
+    vfs_node_t *node = kmem_cache_alloc(fat32_node_cache);
     if (!node) return NULL;
     
-    fat32_vfs_data_t *data = kmalloc(sizeof(fat32_vfs_data_t));
+    fat32_vfs_data_t *data = kmem_cache_alloc(fat32_data_cache);
     if (!data) {
-        kfree(node);
+        kmem_cache_free(fat32_node_cache, node);
         return NULL;
     }
     
@@ -253,7 +262,7 @@ static int fat32_vfs_unlink(vfs_node_t *node, const char *name)
         fat32_free_cluster_chain(data->fs, cluster);
     }
     
-    uint8_t *cluster_buf = kmalloc(data->fs->sectors_per_cluster * 512);
+    uint8_t *cluster_buf = fat32_alloc_cluster_buf(data->fs);
     if (!cluster_buf) return -1;
     
     char name83[11];
@@ -263,7 +272,7 @@ static int fat32_vfs_unlink(vfs_node_t *node, const char *name)
     
     while (current_cluster != 0 && current_cluster < FAT32_CLUSTER_END) {
         if (fat32_read_cluster(data->fs, current_cluster, cluster_buf) < 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(data->fs, cluster_buf);
             return -1;
         }
         
@@ -279,7 +288,7 @@ static int fat32_vfs_unlink(vfs_node_t *node, const char *name)
                 /* Mark as deleted */
                 entries[i].name[0] = 0xE5;
                 fat32_write_cluster(data->fs, current_cluster, cluster_buf);
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(data->fs, cluster_buf);
                 
                 /* Invalidate cache */
                 dir_cache_fs = NULL;
@@ -290,7 +299,7 @@ static int fat32_vfs_unlink(vfs_node_t *node, const char *name)
         current_cluster = fat32_next_cluster(data->fs, current_cluster);
     }
     
-    kfree(cluster_buf);
+    fat32_free_cluster_buf(data->fs, cluster_buf);
     return -1;
 }
 
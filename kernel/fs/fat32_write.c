@@ -113,7 +113,7 @@ int fat32_write_cluster(fat32_fs_t *fs, uint32_t cluster, const void *buffer)
 int fat32_create_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name, 
                        uint8_t attr, uint32_t *out_cluster)
 {
-    uint8_t *cluster_buf = kmalloc(fs->sectors_per_cluster * 512);
+    uint8_t *cluster_buf = fat32_alloc_cluster_buf(fs);
     if (!cluster_buf) return -1;
     
     uint32_t current_cluster = dir_cluster;
@@ -123,7 +123,7 @@ int fat32_create_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
     
     while (current_cluster != 0 && current_cluster < FAT32_CLUSTER_END) {
         if (fat32_read_cluster(fs, current_cluster, cluster_buf) < 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(fs, cluster_buf);
             return -1;
         }
         
@@ -141,15 +141,15 @@ int fat32_create_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
                 if (attr & FAT32_ATTR_DIRECTORY) {
                     new_cluster = fat32_alloc_cluster(fs);
                     if (new_cluster == 0) {
-                        kfree(cluster_buf);
+                        fat32_free_cluster_buf(fs, cluster_buf);
                         return -2;
                     }
 
-                    uint8_t *zero_buf = kmalloc(fs->sectors_per_cluster * 512);
+                    uint8_t *zero_buf = fat32_alloc_cluster_buf(fs);
                     if (zero_buf) {
                         memset(zero_buf, 0, fs->sectors_per_cluster * 512);
                         fat32_write_cluster(fs, new_cluster, zero_buf);
-                        kfree(zero_buf);
+                        fat32_free_cluster_buf(fs, zero_buf);
                     }
                 }
                 
@@ -161,7 +161,7 @@ int fat32_create_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
                 
                 if (out_cluster) *out_cluster = new_cluster;
                 
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return 0;
             }
         }
@@ -170,7 +170,7 @@ int fat32_create_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
         if (next == 0) {
             next = fat32_alloc_cluster(fs);
             if (next == 0) {
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return -2;
             }
             fat32_set_cluster(fs, current_cluster, next);
@@ -181,14 +181,14 @@ int fat32_create_entry(fat32_fs_t *fs, uint32_t dir_cluster, const char *name,
         current_cluster = next;
     }
     
-    kfree(cluster_buf);
+    fat32_free_cluster_buf(fs, cluster_buf);
     return -1;
 }
 
 int fat32_update_entry_size(fat32_fs_t *fs, uint32_t dir_cluster, 
                             const char *name, uint32_t new_size, uint32_t new_cluster)
 {
-    uint8_t *cluster_buf = kmalloc(fs->sectors_per_cluster * 512);
+    uint8_t *cluster_buf = fat32_alloc_cluster_buf(fs);
     if (!cluster_buf) return -1;
     
     char name83[11];
@@ -198,7 +198,7 @@ int fat32_update_entry_size(fat32_fs_t *fs, uint32_t dir_cluster,
     
     while (current_cluster != 0 && current_cluster < FAT32_CLUSTER_END) {
         if (fat32_read_cluster(fs, current_cluster, cluster_buf) < 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(fs, cluster_buf);
             return -1;
         }
         
@@ -207,7 +207,7 @@ int fat32_update_entry_size(fat32_fs_t *fs, uint32_t dir_cluster,
         
         for (int i = 0; i < entries_per_cluster; i++) {
             if (entries[i].name[0] == 0x00) {
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return -1;
             }
             
@@ -223,7 +223,7 @@ int fat32_update_entry_size(fat32_fs_t *fs, uint32_t dir_cluster,
                 }
                 
                 fat32_write_cluster(fs, current_cluster, cluster_buf);
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return 0;
             }
         }
@@ -231,7 +231,7 @@ int fat32_update_entry_size(fat32_fs_t *fs, uint32_t dir_cluster,
         current_cluster = fat32_next_cluster(fs, current_cluster);
     }
     
-    kfree(cluster_buf);
+    fat32_free_cluster_buf(fs, cluster_buf);
     return -1;
 }
 
@@ -241,7 +241,7 @@ int fat32_write_file(fat32_fs_t *fs, uint32_t *start_cluster, uint32_t *file_siz
     if (size == 0) return 0;
     
     uint32_t cluster_size = fs->sectors_per_cluster * 512;
-    uint8_t *cluster_buf = kmalloc(cluster_size);
+    uint8_t *cluster_buf = fat32_alloc_cluster_buf(fs);
     if (!cluster_buf) return -1;
     
     const uint8_t *src = (const uint8_t *)buffer;
@@ -250,7 +250,7 @@ int fat32_write_file(fat32_fs_t *fs, uint32_t *start_cluster, uint32_t *file_siz
     if (*start_cluster == 0) {
         *start_cluster = fat32_alloc_cluster(fs);
         if (*start_cluster == 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(fs, cluster_buf);
             return -1;
         }
     }
@@ -264,7 +264,7 @@ int fat32_write_file(fat32_fs_t *fs, uint32_t *start_cluster, uint32_t *file_siz
         if (next == 0 || next >= FAT32_CLUSTER_END) {
             next = fat32_alloc_cluster(fs);
             if (next == 0) {
-                kfree(cluster_buf);
+                fat32_free_cluster_buf(fs, cluster_buf);
                 return bytes_written;
             }
             fat32_set_cluster(fs, current_cluster, next);
@@ -289,7 +289,7 @@ int fat32_write_file(fat32_fs_t *fs, uint32_t *start_cluster, uint32_t *file_siz
         memcpy(cluster_buf + write_start, src + bytes_written, write_size);
         
         if (fat32_write_cluster(fs, current_cluster, cluster_buf) < 0) {
-            kfree(cluster_buf);
+            fat32_free_cluster_buf(fs, cluster_buf);
             return bytes_written;
         }
         
@@ -300,7 +300,7 @@ int fat32_write_file(fat32_fs_t *fs, uint32_t *start_cluster, uint32_t *file_siz
             if (next == 0 || next >= FAT32_CLUSTER_END) {
                 next = fat32_alloc_cluster(fs);
                 if (next == 0) {
-                    kfree(cluster_buf);
+                    fat32_free_cluster_buf(fs, cluster_buf);
                     return bytes_written;
                 }
                 fat32_set_cluster(fs, current_cluster, next);
@@ -314,6 +314,6 @@ int fat32_write_file(fat32_fs_t *fs, uint32_t *start_cluster, uint32_t *file_siz
         *file_size = offset + bytes_written;
     }
     
-    kfree(cluster_buf);
+    fat32_free_cluster_buf(fs, cluster_buf);
     return bytes_written;
 }
@@ -7,9 +7,15 @@
 #include <fs/ramfs.h>
 #include <mm/heap.h>
 #include <mm/pmm.h>
+#include <mm/slab.h>
+#include <mm/pagecache.h>
+#include <mm/swap.h>
+#include <mm/vmalloc.h>
 #include <kernel/process.h>
 #include <kernel/scheduler.h>
+#include <kernel/timer.h>
 #include <drivers/pit.h>
+#include <arch/x86/smp.h>
 #include <drivers/serial.h>
 #include <net/net.h>
 #include <string.h>
@@ -35,6 +41,10 @@ static vfs_node_t *procfs_root = NULL;
 #define PROCFS_NET_ROUTE    17
 #define PROCFS_NET_TCP      18
 #define PROCFS_NET_UDP      19
+#define PROCFS_SLABINFO     20
+#define PROCFS_IOMEM        21
+#define PROCFS_KMALLOC      22
+#define PROCFS_SCHEDSTAT    23
 
 typedef struct {
     vfs_node_t vfs;
@@ -76,7 +86,12 @@ static int generate_meminfo(char *buf, uint32_t size)
     uint32_t total_kb = total / 1024;
     uint32_t free_kb = free / 1024;
     uint32_t buffers_kb = 0;
-    uint32_t cached_kb = total_kb / 10;
+    uint32_t cached_pages;
+    pagecache_get_stats(&cached_pages, NULL, NULL);
+    uint32_t cached_kb = cached_pages * 4;
+    uint32_t zeroed_pages;
+    pmm_get_zero_pool_stats(&zeroed_pages, NULL, NULL);
+    uint32_t zeroed_kb = zeroed_pages * 4;
     
     char *p = buf;
     p = str_append(p, "MemTotal:       ");
@@ -86,7 +101,7 @@ static int generate_meminfo(char *buf, uint32_t size)
     p += uint_to_str(p, free_kb);
     p = str_append(p, " kB\n");
     p = str_append(p, "MemAvailable:   ");
-    p += uint_to_str(p, free_kb + cached_kb);
+    p += uint_to_str(p, free_kb + cached_kb + zeroed_kb);
     p = str_append(p, " kB\n");
     p = str_append(p, "Buffers:        ");
     p += uint_to_str(p, buffers_kb);
@@ -94,8 +109,191 @@ static int generate_meminfo(char *buf, uint32_t size)
     p = str_append(p, "Cached:         ");
     p += uint_to_str(p, cached_kb);
     p = str_append(p, " kB\n");
-    p = str_append(p, "SwapTotal:      0 kB\n");
-    p = str_append(p, "SwapFree:       0 kB\n");
+    p = str_append(p, "ZeroPool:       ");
+    p += uint_to_str(p, zeroed_kb);
+    p = str_append(p, " kB\n");
+    uint32_t swap_total, swap_free;
+    swap_get_stats(&swap_total, &swap_free, NULL, NULL);
+    p = str_append(p, "SwapTotal:      ");
+    p += uint_to_str(p, swap_total * 4);
+    p = str_append(p, " kB\n");
+    p = str_append(p, "SwapFree:       ");
+    p += uint_to_str(p, swap_free * 4);
+    p = str_append(p, " kB\n");
+    uint32_t vmalloc_bytes;
+    vmalloc_get_stats(NULL, &vmalloc_bytes);
+    p = str_append(p, "VmallocTotal:   ");
+    p += uint_to_str(p, (VMALLOC_END - VMALLOC_START) / 1024);
+    p = str_append(p, " kB\n");
+    p = str_append(p, "VmallocUsed:    ");
+    p += uint_to_str(p, vmalloc_bytes / 1024);
+    p = str_append(p, " kB\n");
+    p = str_append(p, "BuddyFree:     ");
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        *p++ = ' ';
+        p += uint_to_str(p, pmm_get_free_blocks(order));
+    }
+    *p++ = '\n';
+    
+    (void)size;
+    return (int)(p - buf);
+}
+
+static char *pad_to(char *p, char *line, int col)
+{
+    while (p - line < col) *p++ = ' ';
+    return p;
+}
+
+static int generate_slabinfo(char *buf, uint32_t size)
+{
+    char *p = buf;
+    p = str_append(p, "# name              active  total  objsize  perslab  slabs\n");
+    
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        kmem_cache_t *cache = kmem_cache_get(i);
+        if (!cache) continue;
+        
+        if ((uint32_t)(p - buf) + 80 > size) break;
+        
+        char *line = p;
+        p = str_append(p, cache->name);
+        p = pad_to(p, line, 20);
+        *p++ = ' ';
+        p += uint_to_str(p, cache->active_objs);
+        p = pad_to(p, line, 29);
+        p += uint_to_str(p, cache->num_slabs * cache->objs_per_slab);
+        p = pad_to(p, line, 36);
+        p += uint_to_str(p, cache->obj_size);
+        p = pad_to(p, line, 45);
+        p += uint_to_str(p, cache->objs_per_slab);
+        p = pad_to(p, line, 54);
+        p += uint_to_str(p, cache->num_slabs);
+        *p++ = '\n';
+    }
+    
+    return (int)(p - buf);
+}
+
+static int generate_kmalloc(char *buf, uint32_t size)
+{
+    static heap_tag_stats_t tags[HEAP_MAX_TAGS];
+    int count = heap_get_tag_stats(tags, HEAP_MAX_TAGS);
+    
+    char *p = buf;
+    p = str_append(p, "# tag                        live      bytes       peak     allocs\n");
+    
+    for (int i = 0; i < count; i++) {
+        if ((uint32_t)(p - buf) + 80 > size) break;
+        
+        char *line = p;
+        p = str_append(p, tags[i].name);
+        p = pad_to(p, line, 28);
+        *p++ = ' ';
+        p += uint_to_str(p, tags[i].live);
+        p = pad_to(p, line, 38);
+        p += uint_to_str(p, tags[i].bytes);
+        p = pad_to(p, line, 49);
+        p += uint_to_str(p, tags[i].peak_bytes);
+        p = pad_to(p, line, 60);
+        p += uint_to_str(p, tags[i].allocs);
+        *p++ = '\n';
+    }
+    
+    return (int)(p - buf);
+}
+
+static int generate_schedstat(char *buf, uint32_t size)
+{
+    char *p = buf;
+    p = str_append(p, "# cpu   queued  current    switches    steals    stolen   balance\n");
+    
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        sched_cpu_stats_t stats;
+        if (scheduler_get_cpu_stats(cpu, &stats) != 0) continue;
+        if ((uint32_t)(p - buf) + 80 > size) break;
+        
+        char *line = p;
+        p = str_append(p, "cpu");
+        p += uint_to_str(p, cpu);
+        p = pad_to(p, line, 8);
+        p += uint_to_str(p, stats.queued);
+        p = pad_to(p, line, 16);
+        if (stats.idle) {
+            p = str_append(p, "idle");
+        } else {
+            p += uint_to_str(p, stats.current_tid);
+        }
+        p = pad_to(p, line, 27);
+        p += uint_to_str(p, stats.switches);
+        p = pad_to(p, line, 39);
+        p += uint_to_str(p, stats.steals);
+        p = pad_to(p, line, 49);
+        p += uint_to_str(p, stats.stolen);
+        p = pad_to(p, line, 58);
+        p += uint_to_str(p, stats.balance_runs);
+        *p++ = '\n';
+    }
+    
+    if ((uint32_t)(p - buf) + 32 <= size) {
+        p = str_append(p, "timers ");
+        p += uint_to_str(p, timer_pending_count());
+        *p++ = '\n';
+    }
+    
+    return (int)(p - buf);
+}
+
+/* At least 8 hex digits, 16 once the value needs them */
+static char *format_hex64(char *p, uint64_t value)
+{
+    const char *hexc = "0123456789abcdef";
+    int digits = (value >> 32) ? 16 : 8;
+    for (int i = digits - 1; i >= 0; i--) {
+        *p++ = hexc[(value >> (i * 4)) & 0xF];
+    }
+    return p;
+}
+
+static const char *iomem_type_name(uint32_t type)
+{
+    switch (type) {
+        case MULTIBOOT_MEMORY_AVAILABLE:        return "System RAM";
+        case MULTIBOOT_MEMORY_ACPI_RECLAIMABLE: return "ACPI Tables";
+        case MULTIBOOT_MEMORY_NVS:              return "ACPI Non-volatile Storage";
+        case MULTIBOOT_MEMORY_BADRAM:           return "Unusable memory";
+        default:                                return "Reserved";
+    }
+}
+
+static int generate_iomem(char *buf, uint32_t size)
+{
+    const pmm_region_t *regions;
+    uint32_t count = pmm_get_regions(&regions);
+    uint32_t kernel_end = pmm_get_kernel_end();
+    
+    char *p = buf;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t start = regions[i].base;
+        uint64_t end = regions[i].base + regions[i].length - 1;
+        
+        p = format_hex64(p, start);
+        *p++ = '-';
+        p = format_hex64(p, end);
+        p = str_append(p, " : ");
+        p = str_append(p, iomem_type_name(regions[i].type));
+        *p++ = '\n';
+        
+        /* Kernel image and allocator metadata, nested like Linux does */
+        if (regions[i].type == MULTIBOOT_MEMORY_AVAILABLE &&
+            start <= 0x100000 && end >= kernel_end - 1) {
+            p = str_append(p, "  ");
+            p = format_hex64(p, 0x100000);
+            *p++ = '-';
+            p = format_hex64(p, kernel_end - 1);
+            p = str_append(p, " : Kernel\n");
+        }
+    }
     
     (void)size;
     return (int)(p - buf);
@@ -138,46 +336,62 @@ static int generate_cpuinfo(char *buf, uint32_t size)
     uint32_t model = (eax >> 4) & 0xF;
     uint32_t stepping = eax & 0xF;
     
+    /* The APs are the same part as the BSP; only the numbering differs */
     char *p = buf;
-    p = str_append(p, "processor\t: 0\n");
-    p = str_append(p, "vendor_id\t: ");
-    p = str_append(p, vendor);
-    p = str_append(p, "\n");
-    p = str_append(p, "cpu family\t: ");
-    p += uint_to_str(p, family);
-    p = str_append(p, "\n");
-    p = str_append(p, "model\t\t: ");
-    p += uint_to_str(p, model);
-    p = str_append(p, "\n");
-    p = str_append(p, "stepping\t: ");
-    p += uint_to_str(p, stepping);
-    p = str_append(p, "\n");
-    p = str_append(p, "flags\t\t:");
-    if (edx & (1 << 0)) p = str_append(p, " fpu");
-    if (edx & (1 << 1)) p = str_append(p, " vme");
-    if (edx & (1 << 2)) p = str_append(p, " de");
-    if (edx & (1 << 3)) p = str_append(p, " pse");
-    if (edx & (1 << 4)) p = str_append(p, " tsc");
-    if (edx & (1 << 5)) p = str_append(p, " msr");
-    if (edx & (1 << 6)) p = str_append(p, " pae");
-    if (edx & (1 << 8)) p = str_append(p, " cx8");
-    if (edx & (1 << 9)) p = str_append(p, " apic");
-    if (edx & (1 << 15)) p = str_append(p, " cmov");
-    if (edx & (1 << 19)) p = str_append(p, " clflush");
-    if (edx & (1 << 23)) p = str_append(p, " mmx");
-    if (edx & (1 << 24)) p = str_append(p, " fxsr");
-    if (edx & (1 << 25)) p = str_append(p, " sse");
-    if (edx & (1 << 26)) p = str_append(p, " sse2");
-    if (ecx & (1 << 0)) p = str_append(p, " sse3");
-    if (ecx & (1 << 9)) p = str_append(p, " ssse3");
-    if (ecx & (1 << 19)) p = str_append(p, " sse4_1");
-    if (ecx & (1 << 20)) p = str_append(p, " sse4_2");
-    if (ecx & (1 << 28)) p = str_append(p, " avx");
-    p = str_append(p, "\n");
-    
-    p = str_append(p, "bogomips\t: ");
-    p += uint_to_str(p, 4000);  
-    p = str_append(p, ".00\n");
+    uint32_t online = smp_cpu_count();
+    for (uint32_t id = 0; id < SMP_MAX_CPUS; id++) {
+        cpu_t *cpu = smp_get_cpu(id);
+        if (!cpu) continue;
+        
+        if (p != buf) p = str_append(p, "\n");
+        p = str_append(p, "processor\t: ");
+        p += uint_to_str(p, cpu->id);
+        p = str_append(p, "\n");
+        p = str_append(p, "vendor_id\t: ");
+        p = str_append(p, vendor);
+        p = str_append(p, "\n");
+        p = str_append(p, "cpu family\t: ");
+        p += uint_to_str(p, family);
+        p = str_append(p, "\n");
+        p = str_append(p, "model\t\t: ");
+        p += uint_to_str(p, model);
+        p = str_append(p, "\n");
+        p = str_append(p, "stepping\t: ");
+        p += uint_to_str(p, stepping);
+        p = str_append(p, "\n");
+        p = str_append(p, "flags\t\t:");
+        if (edx & (1 << 0)) p = str_append(p, " fpu");
+        if (edx & (1 << 1)) p = str_append(p, " vme");
+        if (edx & (1 << 2)) p = str_append(p, " de");
+        if (edx & (1 << 3)) p = str_append(p, " pse");
+        if (edx & (1 << 4)) p = str_append(p, " tsc");
+        if (edx & (1 << 5)) p = str_append(p, " msr");
+        if (edx & (1 << 6)) p = str_append(p, " pae");
+        if (edx & (1 << 8)) p = str_append(p, " cx8");
+        if (edx & (1 << 9)) p = str_append(p, " apic");
+        if (edx & (1 << 15)) p = str_append(p, " cmov");
+        if (edx & (1 << 19)) p = str_append(p, " clflush");
+        if (edx & (1 << 23)) p = str_append(p, " mmx");
+        if (edx & (1 << 24)) p = str_append(p, " fxsr");
+        if (edx & (1 << 25)) p = str_append(p, " sse");
+        if (edx & (1 << 26)) p = str_append(p, " sse2");
+        if (ecx & (1 << 0)) p = str_append(p, " sse3");
+        if (ecx & (1 << 9)) p = str_append(p, " ssse3");
+        if (ecx & (1 << 19)) p = str_append(p, " sse4_1");
+        if (ecx & (1 << 20)) p = str_append(p, " sse4_2");
+        if (ecx & (1 << 28)) p = str_append(p, " avx");
+        p = str_append(p, "\n");
+        
+        p = str_append(p, "bogomips\t: ");
+        p += uint_to_str(p, 4000);  
+        p = str_append(p, ".00\n");
+        p = str_append(p, "apicid\t\t: ");
+        p += uint_to_str(p, cpu->apic_id);
+        p = str_append(p, "\n");
+        p = str_append(p, "cpu cores\t: ");
+        p += uint_to_str(p, online);
+        p = str_append(p, "\n");
+    }
     
     (void)size;
     return (int)(p - buf);
@@ -477,7 +691,7 @@ static int generate_net_udp(char *buf, uint32_t size)
     return (int)(p - buf);
 }
 
-static char procfs_buffer[2048];
+static char procfs_buffer[4096];
 
 static int procfs_dynamic_read(vfs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer)
 {
@@ -489,6 +703,18 @@ static int procfs_dynamic_read(vfs_node_t *node, uint32_t offset, uint32_t size,
         case PROCFS_MEMINFO:
             len = generate_meminfo(procfs_buffer, sizeof(procfs_buffer));
             break;
+        case PROCFS_SLABINFO:
+            len = generate_slabinfo(procfs_buffer, sizeof(procfs_buffer));
+            break;
+        case PROCFS_IOMEM:
+            len = generate_iomem(procfs_buffer, sizeof(procfs_buffer));
+            break;
+        case PROCFS_KMALLOC:
+            len = generate_kmalloc(procfs_buffer, sizeof(procfs_buffer));
+            break;
+        case PROCFS_SCHEDSTAT:
+            len = generate_schedstat(procfs_buffer, sizeof(procfs_buffer));
+            break;
         case PROCFS_UPTIME:
             len = generate_uptime(procfs_buffer, sizeof(procfs_buffer));
             break;
@@ -584,9 +810,13 @@ static vfs_node_t *procfs_create_dynamic(vfs_node_t *parent, const char *name, i
     
     int len = 0;
     switch (file_type) {
-        case PROCFS_MEMINFO: len = 300; break;
+        case PROCFS_MEMINFO: len = 512; break;
         case PROCFS_UPTIME: len = 32; break;
-        case PROCFS_CPUINFO: len = 400; break;
+        case PROCFS_SLABINFO: len = 1024; break;
+        case PROCFS_IOMEM: len = 2048; break;
+        case PROCFS_KMALLOC: len = 4096; break;
+        case PROCFS_SCHEDSTAT: len = 80 * (SMP_MAX_CPUS + 2); break;
+        case PROCFS_CPUINFO: len = 480 * SMP_MAX_CPUS; break;
         case PROCFS_VERSION: len = 100; break;
         case PROCFS_CMDLINE: len = 32; break;
         case PROCFS_FILESYSTEMS: len = 64; break;
@@ -627,6 +857,10 @@ vfs_node_t *procfs_init(vfs_node_t *parent)
     
     procfs_create_dynamic(procfs_root, "meminfo", PROCFS_MEMINFO);
     procfs_create_dynamic(procfs_root, "uptime", PROCFS_UPTIME);
+    procfs_create_dynamic(procfs_root, "slabinfo", PROCFS_SLABINFO);
+    procfs_create_dynamic(procfs_root, "iomem", PROCFS_IOMEM);
+    procfs_create_dynamic(procfs_root, "kmalloc", PROCFS_KMALLOC);
+    procfs_create_dynamic(procfs_root, "schedstat", PROCFS_SCHEDSTAT);
     procfs_create_dynamic(procfs_root, "cpuinfo", PROCFS_CPUINFO);
     procfs_create_dynamic(procfs_root, "version", PROCFS_VERSION);
     procfs_create_dynamic(procfs_root, "cmdline", PROCFS_CMDLINE);
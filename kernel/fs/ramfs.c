@@ -5,6 +5,7 @@
 #include <fs/ramfs.h>
 #include <fs/vfs.h>
 #include <mm/heap.h>
+#include <mm/pagecache.h>
 #include <drivers/pit.h>
 #include <string.h>
 
@@ -247,6 +248,16 @@ static int ramfs_unlink(vfs_node_t *node, const char *name)
             
             ramfs_remove_child(parent, child);
             
+            /* The page cache is keyed by the node's address, so its pages
+             * must go before a new node can be allocated there. Pages
+             * still mapped are read and written back through the node,
+             * and nothing says when the last mapping goes, so a file
+             * unlinked while mapped keeps its node and data for good.
+             */
+            if (pagecache_invalidate(&child->vfs) > 0) {
+                return 0;
+            }
+            
             if (child->data) {
                 kfree(child->data);
             }
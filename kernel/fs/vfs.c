@@ -3,6 +3,7 @@
  */
 
 #include <fs/vfs.h>
+#include <mm/pagecache.h>
 #include <string.h>
 
 static vfs_node_t *vfs_root = NULL;
@@ -37,7 +38,11 @@ int vfs_write(vfs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer)
     if (!node || !node->write) {
         return -1;
     }
-    return node->write(node, offset, size, buffer);
+    int written = node->write(node, offset, size, buffer);
+    if (written > 0) {
+        pagecache_update(node, offset, (uint32_t)written, buffer);
+    }
+    return written;
 }
 
 int vfs_append(vfs_node_t *node, uint32_t size, uint8_t *buffer)
@@ -45,7 +50,12 @@ int vfs_append(vfs_node_t *node, uint32_t size, uint8_t *buffer)
     if (!node || !node->write) {
         return -1;
     }
-    return node->write(node, node->length, size, buffer);
+    uint32_t offset = node->length;
+    int written = node->write(node, offset, size, buffer);
+    if (written > 0) {
+        pagecache_update(node, offset, (uint32_t)written, buffer);
+    }
+    return written;
 }
 
 int vfs_truncate(vfs_node_t *node)
@@ -54,6 +64,7 @@ int vfs_truncate(vfs_node_t *node)
         return -1;
     }
     node->length = 0;
+    pagecache_invalidate(node);
     return 0;
 }
 
@@ -235,19 +235,10 @@ int shm_create(uint32_t key, uint32_t size)
     }
     
     uint32_t pages = (size + 0xFFF) / 0x1000;
-    uint32_t phys = pmm_alloc_frame();
+    uint32_t phys = pmm_alloc_contiguous(pages, 0x1000, PMM_ZONE_ANY);
     if (phys == 0) {
         return -12;  
     }
-    for (uint32_t i = 1; i < pages; i++) {
-        uint32_t next = pmm_alloc_frame();
-        if (next == 0) {
-            for (uint32_t j = 0; j < i; j++) {
-                pmm_free_frame(phys + j * 0x1000);
-            }
-            return -12;
-        }
-    }
     
     shm_region_t *shm = &shm_regions[shmid];
     shm->key = key;
@@ -271,11 +262,9 @@ void *shm_attach(int shmid, uint32_t vaddr)
         return (void *)-1;
     }
     
-    uint32_t pages = (shm->size + 0xFFF) / 0x1000;
-    for (uint32_t i = 0; i < pages; i++) {
-        vmm_map_page(vaddr + i * 0x1000, 
-                     shm->phys_addr + i * 0x1000,
-                     PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+    if (vmm_map_range(vaddr, shm->phys_addr, shm->size,
+                      PAGE_PRESENT | PAGE_WRITE | PAGE_USER | PAGE_SHARED) != 0) {
+        return (void *)-1;
     }
     
     shm->ref_count++;
@@ -291,10 +280,7 @@ int shm_detach(void *addr)
     for (int i = 0; i < MAX_SHM_REGIONS; i++) {
         if (!shm_regions[i].in_use) continue;
         
-        uint32_t pages = (shm_regions[i].size + 0xFFF) / 0x1000;
-        for (uint32_t j = 0; j < pages; j++) {
-            vmm_unmap_page(vaddr + j * 0x1000);
-        }
+        vmm_unmap_range(vaddr, shm_regions[i].size);
         
         if (shm_regions[i].ref_count > 0) {
             shm_regions[i].ref_count--;
@@ -323,9 +309,7 @@ int shm_destroy(int shmid)
     }
     
     uint32_t pages = (shm->size + 0xFFF) / 0x1000;
-    for (uint32_t i = 0; i < pages; i++) {
-        pmm_free_frame(shm->phys_addr + i * 0x1000);
-    }
+    pmm_free_contiguous(shm->phys_addr, pages);
     
     shm->in_use = 0;
     
@@ -12,12 +12,16 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/heap.h>
+#include <mm/kstack.h>
+#include <mm/mmap.h>
 #include <drivers/pit.h>
 #include <drivers/pci.h>
 #include <kernel/shell.h>
 #include <acpi/acpi.h>
 #include <apic/lapic.h>
 #include <apic/ioapic.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/tsc.h>
 #include <fs/vfs.h>
 #include <fs/ramfs.h>
 #include <fs/fat32.h>
@@ -111,6 +115,7 @@ void kernel_main(multiboot_info_t *mboot_info, uint32_t magic)
     vga_puts("Initializing heap... ");
     serial_puts("[KERNEL] Initializing heap\n");
     heap_init(KERNEL_HEAP_START, KERNEL_HEAP_SIZE);
+    kstack_init();
     vga_puts_ok();
     vga_puts("\n");
     boot_delay();
@@ -118,6 +123,7 @@ void kernel_main(multiboot_info_t *mboot_info, uint32_t magic)
     vga_puts("Initializing PIT... ");
     serial_puts("[KERNEL] Initializing PIT\n");
     pit_init(100);
+    tsc_init();
     vga_puts_ok();
     vga_puts("\n");
     boot_delay();
@@ -204,6 +210,15 @@ void kernel_main(multiboot_info_t *mboot_info, uint32_t magic)
         serial_puts("[KERNEL] ACPI not available\n");
     }
     boot_delay();
+    
+    if (lapic_is_enabled()) {
+        vga_puts("Starting APs... ");
+        serial_puts("[KERNEL] Starting application processors\n");
+        smp_init();
+        vga_put_dec(smp_cpu_count());
+        vga_puts(" CPU(s) online\n");
+        boot_delay();
+    }
 
     vga_puts("Scanning PCI bus... ");
     serial_puts("[KERNEL] Scanning PCI bus\n");
@@ -329,6 +344,7 @@ void kernel_main(multiboot_info_t *mboot_info, uint32_t magic)
     vga_puts("Initializing processes... ");
     serial_puts("[KERNEL] Initializing processes\n");
     process_init();
+    mmap_init();
     vga_puts_ok();
     vga_puts("\n");
     boot_delay();
@@ -1,11 +1,36 @@
 /* Kernel Heap Allocator
- * Simple first-fit allocator for kernel memory
+ * Segregated-fit allocator for kernel memory
+ *
+ * Every block sits on an address-ordered list used for coalescing. Free
+ * blocks are additionally linked into one of HEAP_NUM_BINS size-class
+ * bins: exact 16-byte classes up to 256 bytes, then power-of-two classes.
+ * A bitmap of non-empty bins lets kmalloc jump straight to the first bin
+ * that can satisfy a request, so allocation cost no longer depends on the
+ * number of live blocks.
+ *
+ * Requests of VMALLOC_THRESHOLD bytes or more are passed on to vmalloc,
+ * which maps them page by page in a region of their own; kfree tells the
+ * two apart by address.
+ *
+ * Every allocation carries a tag naming the source file that asked for
+ * it (the kmalloc macro passes __FILE__), and per-tag totals are kept so
+ * a full heap can be traced back to the subsystem holding the memory.
+ *
+ * heap_lock covers the blocks, bins, counters and tags. kmalloc is used
+ * from interrupt handlers and page faults on every CPU, so it is taken
+ * with interrupts off; vmalloc has its own lock and is called outside.
  */
 
 #include <kernel/kernel.h>
 #include <mm/heap.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <mm/vmalloc.h>
+#include <sync/spinlock.h>
+
+/* The plain entry points are defined here as functions */
+#undef kmalloc
+#undef kmalloc_aligned
 
 typedef struct heap_block {
     uint32_t size;              
@@ -13,7 +38,10 @@ typedef struct heap_block {
     uint32_t magic;            
     struct heap_block *next;    
     struct heap_block *prev;    
+    struct heap_block *free_next;
+    struct heap_block *free_prev;
     uint8_t free;               
+    uint16_t tag;
 } heap_block_t;
 
 #define HEAP_MAGIC      0xDEADBEEF
@@ -22,6 +50,9 @@ typedef struct heap_block {
 #define HEADER_SIZE     sizeof(heap_block_t)
 #define GUARD_SIZE      sizeof(uint32_t)
 
+#define HEAP_NUM_BINS   32
+#define HEAP_SMALL_BINS 16      /* exact classes 16..256 */
+
 static uint32_t total_allocations = 0;
 static uint32_t total_frees = 0;
 static uint32_t current_allocations = 0;
@@ -31,18 +62,41 @@ static uint32_t peak_bytes = 0;
 
 /* Heap state */
 static uint32_t heap_start = 0;
-static uint32_t heap_end = 0;
+static uint32_t heap_top = 0;       /* end of the last block */
+static uint32_t heap_end = 0;       /* end of mapped memory */
 static uint32_t heap_max = 0;
-static heap_block_t *free_list = NULL;
+static heap_block_t *heap_last = NULL;
+
+static heap_block_t *heap_bins[HEAP_NUM_BINS];
+static uint32_t heap_bin_map = 0;
+
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+/* Tag table, hashed on the address of the tag string. Each translation
+ * unit passes the same __FILE__ literal every time, so comparing
+ * pointers is enough.
+ */
+static heap_tag_stats_t heap_tags[HEAP_MAX_TAGS] = {
+    [0] = { .name = "(other)" },
+};
 
 void heap_init(uint32_t start, uint32_t size)
 {
     heap_start = ALIGN_UP(start, 16);
+    heap_top = heap_start;
     heap_end = heap_start;
     heap_max = heap_start + size;
-    free_list = NULL;
+    heap_last = NULL;
+    
+    for (int i = 0; i < HEAP_NUM_BINS; i++) {
+        heap_bins[i] = NULL;
+    }
+    heap_bin_map = 0;
 }
 
+/* Frames mapped here must not come from reclaim, which frees page cache
+ * entries back into the heap that is being grown.
+ */
 static int heap_expand(uint32_t size)
 {
     uint32_t new_end = ALIGN_UP(heap_end + size, PAGE_SIZE);
@@ -51,117 +105,302 @@ static int heap_expand(uint32_t size)
         return -1; 
     }
     
-    for (uint32_t addr = heap_end; addr < new_end; addr += PAGE_SIZE) {
-        uint32_t phys = pmm_alloc_frame();
-        if (!phys) {
-            return -1;
+    uint32_t flags = pmm_noreclaim_save();
+    int result = 0;
+    while (heap_end < new_end) {
+        /* Grow by a whole 4MB page when the heap sits on a 4MB boundary:
+         * one PDE instead of a page table, and one TLB entry for it all.
+         */
+        if (!(heap_end & (LARGE_PAGE_SIZE - 1)) && heap_end + LARGE_PAGE_SIZE <= heap_max &&
+            vmm_large_pages_enabled()) {
+            uint32_t phys = pmm_alloc_frames(PMM_MAX_ORDER);
+            if (phys) {
+                if (vmm_map_large(heap_end, phys, PAGE_KERNEL) == 0) {
+                    heap_end += LARGE_PAGE_SIZE;
+                    continue;
+                }
+                pmm_free_frames(phys, PMM_MAX_ORDER);
+            }
+        }
+        
+        /* Otherwise map 4K pages up to the next 4MB boundary in one pass */
+        uint32_t chunk_end = ALIGN_UP(heap_end + 1, LARGE_PAGE_SIZE);
+        if (chunk_end > new_end) {
+            chunk_end = new_end;
         }
-        vmm_map_page(addr, phys, PAGE_KERNEL);
+        if (vmm_alloc_range(heap_end, chunk_end - heap_end, PAGE_KERNEL) != 0) {
+            result = -1;
+            break;
+        }
+        heap_end = chunk_end;
     }
+    pmm_noreclaim_restore(flags);
     
-    heap_end = new_end;
+    return result;
+}
+
+/* Claim bytes at the top of the heap, mapping more pages if needed */
+static int heap_reserve(uint32_t bytes)
+{
+    if (heap_top + bytes > heap_end) {
+        if (heap_expand(heap_top + bytes - heap_end) != 0) {
+            return -1;
+        }
+    }
+    heap_top += bytes;
     return 0;
 }
 
-static void set_guard(void *ptr, uint32_t user_size)
+static uint32_t bin_index(uint32_t size)
 {
-    uint32_t *guard = (uint32_t *)((uint8_t *)ptr + user_size);
-    *guard = HEAP_GUARD;
+    if (size <= HEAP_SMALL_BINS * 16) {
+        return size / 16 - 1;
+    }
+    
+    uint32_t bin = HEAP_SMALL_BINS;
+    uint32_t limit = HEAP_SMALL_BINS * 32;
+    while (size >= limit && bin < HEAP_NUM_BINS - 1) {
+        limit <<= 1;
+        bin++;
+    }
+    return bin;
 }
 
-static int check_guard(void *ptr, uint32_t user_size)
+static inline uint32_t bin_first_set(uint32_t map)
 {
-    uint32_t *guard = (uint32_t *)((uint8_t *)ptr + user_size);
-    return *guard == HEAP_GUARD;
+    uint32_t index;
+    __asm__ volatile("bsf %1, %0" : "=r"(index) : "rm"(map));
+    return index;
 }
 
-void *kmalloc(uint32_t size)
+static void bin_insert(heap_block_t *block)
 {
-    if (size == 0) {
-        return NULL;
+    uint32_t bin = bin_index(block->size);
+    block->free_prev = NULL;
+    block->free_next = heap_bins[bin];
+    if (heap_bins[bin]) {
+        heap_bins[bin]->free_prev = block;
+    }
+    heap_bins[bin] = block;
+    heap_bin_map |= (1U << bin);
+}
+
+static void bin_remove(heap_block_t *block)
+{
+    uint32_t bin = bin_index(block->size);
+    if (block->free_prev) {
+        block->free_prev->free_next = block->free_next;
+    } else {
+        heap_bins[bin] = block->free_next;
+    }
+    if (block->free_next) {
+        block->free_next->free_prev = block->free_prev;
     }
+    if (!heap_bins[bin]) {
+        heap_bin_map &= ~(1U << bin);
+    }
+}
+
+/* Exact bins hold blocks of a single size, so their head always fits.
+ * The request's own power-of-two bin may hold smaller blocks and is
+ * scanned; any higher non-empty bin is guaranteed to fit.
+ */
+static heap_block_t *bin_find(uint32_t size)
+{
+    uint32_t bin = bin_index(size);
     
-    uint32_t user_size = size;
-    size = ALIGN_UP(size + GUARD_SIZE, 16);
-    if (size < HEAP_MIN_SIZE) {
-        size = HEAP_MIN_SIZE;
-    }
-    
-    heap_block_t *block = free_list;
-    while (block) {
-        if (block->free && block->size >= size) {
-            if (block->size >= size + HEADER_SIZE + HEAP_MIN_SIZE) {
-                heap_block_t *new_block = (heap_block_t *)((uint8_t *)block + HEADER_SIZE + size);
-                new_block->size = block->size - size - HEADER_SIZE;
-                new_block->magic = HEAP_MAGIC;
-                new_block->free = 1;
-                new_block->next = block->next;
-                new_block->prev = block;
-                
-                if (block->next) {
-                    block->next->prev = new_block;
-                }
-                block->next = new_block;
-                block->size = size;
+    if (bin < HEAP_SMALL_BINS) {
+        if (heap_bins[bin]) {
+            return heap_bins[bin];
+        }
+    } else {
+        for (heap_block_t *block = heap_bins[bin]; block; block = block->free_next) {
+            if (block->size >= size) {
+                return block;
             }
-            
-            block->free = 0;
-            block->user_size = user_size;
-            void *ptr = (void *)((uint8_t *)block + HEADER_SIZE);
-            set_guard(ptr, user_size);
-            
-            total_allocations++;
-            current_allocations++;
-            bytes_allocated += user_size;
-            if (current_allocations > peak_allocations) peak_allocations = current_allocations;
-            if (bytes_allocated > peak_bytes) peak_bytes = bytes_allocated;
-            
-            return ptr;
         }
-        block = block->next;
     }
     
-    uint32_t needed = HEADER_SIZE + size;
-    uint32_t old_end = heap_end;
-    if (heap_expand(needed) != 0) {
+    if (bin + 1 >= HEAP_NUM_BINS) {
         return NULL;
     }
     
-    block = (heap_block_t *)old_end;
+    uint32_t map = heap_bin_map & ~((2U << bin) - 1);
+    if (!map) {
+        return NULL;
+    }
+    return heap_bins[bin_first_set(map)];
+}
+
+static void split_block(heap_block_t *block, uint32_t size)
+{
+    if (block->size < size + HEADER_SIZE + HEAP_MIN_SIZE) {
+        return;
+    }
+    
+    heap_block_t *new_block = (heap_block_t *)((uint8_t *)block + HEADER_SIZE + size);
+    new_block->size = block->size - size - HEADER_SIZE;
+    new_block->magic = HEAP_MAGIC;
+    new_block->free = 1;
+    new_block->next = block->next;
+    new_block->prev = block;
+    
+    if (block->next) {
+        block->next->prev = new_block;
+    } else {
+        heap_last = new_block;
+    }
+    block->next = new_block;
+    block->size = size;
+    
+    bin_insert(new_block);
+}
+
+/* No bin could satisfy the request: grow a trailing free block in place,
+ * or carve a new block from the top of the heap.
+ */
+static heap_block_t *heap_grow(uint32_t size)
+{
+    if (heap_last && heap_last->free) {
+        heap_block_t *block = heap_last;
+        if (heap_reserve(size - block->size) != 0) {
+            return NULL;
+        }
+        bin_remove(block);
+        block->size = size;
+        return block;
+    }
+    
+    uint32_t old_top = heap_top;
+    if (heap_reserve(HEADER_SIZE + size) != 0) {
+        return NULL;
+    }
+    
+    heap_block_t *block = (heap_block_t *)old_top;
     block->size = size;
-    block->user_size = user_size;
     block->magic = HEAP_MAGIC;
     block->free = 0;
     block->next = NULL;
-    block->prev = NULL;
+    block->prev = heap_last;
     
-    if (free_list == NULL) {
-        free_list = block;
-    } else {
-        heap_block_t *last = free_list;
-        while (last->next) {
-            last = last->next;
+    if (heap_last) {
+        heap_last->next = block;
+    }
+    heap_last = block;
+    
+    return block;
+}
+
+static uint16_t tag_index(const char *name)
+{
+    if (!name) return 0;
+    
+    uint32_t start = ((uint32_t)name >> 2) % (HEAP_MAX_TAGS - 1) + 1;
+    uint32_t i = start;
+    do {
+        if (heap_tags[i].name == name) return (uint16_t)i;
+        if (!heap_tags[i].name) {
+            heap_tags[i].name = name;
+            return (uint16_t)i;
         }
-        last->next = block;
-        block->prev = last;
+        i = (i % (HEAP_MAX_TAGS - 1)) + 1;
+    } while (i != start);
+    
+    return 0;
+}
+
+static void tag_account_alloc(uint16_t tag, uint32_t bytes)
+{
+    heap_tag_stats_t *t = &heap_tags[tag];
+    t->live++;
+    t->allocs++;
+    t->bytes += bytes;
+    if (t->bytes > t->peak_bytes) t->peak_bytes = t->bytes;
+}
+
+static void tag_account_free(uint16_t tag, uint32_t bytes)
+{
+    heap_tag_stats_t *t = &heap_tags[tag < HEAP_MAX_TAGS ? tag : 0];
+    if (t->live) t->live--;
+    t->bytes -= bytes <= t->bytes ? bytes : t->bytes;
+}
+
+static void set_guard(void *ptr, uint32_t user_size)
+{
+    uint32_t *guard = (uint32_t *)((uint8_t *)ptr + user_size);
+    *guard = HEAP_GUARD;
+}
+
+static int check_guard(void *ptr, uint32_t user_size)
+{
+    uint32_t *guard = (uint32_t *)((uint8_t *)ptr + user_size);
+    return *guard == HEAP_GUARD;
+}
+
+void *kmalloc_tagged(uint32_t size, const char *tag_name)
+{
+    if (size == 0) {
+        return NULL;
     }
     
-    void *ptr = (void *)((uint8_t *)block + HEADER_SIZE);
-    set_guard(ptr, user_size);
+    uint32_t user_size = size;
+    uint32_t flags;
+    spinlock_irq_save(&heap_lock, &flags);
+    uint16_t tag = tag_index(tag_name);
+    void *ptr;
+    
+    if (size >= VMALLOC_THRESHOLD) {
+        spinlock_irq_restore(&heap_lock, flags);
+        ptr = vmalloc_tagged(size, tag);
+        if (!ptr) {
+            return NULL;
+        }
+        spinlock_irq_save(&heap_lock, &flags);
+    } else {
+        size = ALIGN_UP(size + GUARD_SIZE, 16);
+        if (size < HEAP_MIN_SIZE) {
+            size = HEAP_MIN_SIZE;
+        }
+        
+        heap_block_t *block = bin_find(size);
+        if (block) {
+            bin_remove(block);
+            split_block(block, size);
+        } else {
+            block = heap_grow(size);
+            if (!block) {
+                spinlock_irq_restore(&heap_lock, flags);
+                return NULL;
+            }
+        }
+        
+        block->free = 0;
+        block->user_size = user_size;
+        block->tag = tag;
+        ptr = (void *)((uint8_t *)block + HEADER_SIZE);
+        set_guard(ptr, user_size);
+    }
     
     total_allocations++;
     current_allocations++;
     bytes_allocated += user_size;
     if (current_allocations > peak_allocations) peak_allocations = current_allocations;
     if (bytes_allocated > peak_bytes) peak_bytes = bytes_allocated;
+    tag_account_alloc(tag, user_size);
     
+    spinlock_irq_restore(&heap_lock, flags);
     return ptr;
 }
 
-void *kmalloc_aligned(uint32_t size, uint32_t alignment)
+void *kmalloc(uint32_t size)
+{
+    return kmalloc_tagged(size, NULL);
+}
+
+void *kmalloc_aligned_tagged(uint32_t size, uint32_t alignment, const char *tag_name)
 {
     uint32_t total = size + alignment + sizeof(void *);
-    void *ptr = kmalloc(total);
+    void *ptr = kmalloc_tagged(total, tag_name);
     if (!ptr) {
         return NULL;
     }
@@ -174,10 +413,18 @@ void *kmalloc_aligned(uint32_t size, uint32_t alignment)
     return (void *)aligned;
 }
 
+void *kmalloc_aligned(uint32_t size, uint32_t alignment)
+{
+    return kmalloc_aligned_tagged(size, alignment, NULL);
+}
+
 int heap_check_overflow(void *ptr)
 {
     if (!ptr) return 0;
     
+    /* vmalloc areas are bounded by an unmapped guard page instead */
+    if (is_vmalloc_addr(ptr)) return vmalloc_size(ptr, NULL) != 0;
+    
     heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - HEADER_SIZE);
     if (block->magic != HEAP_MAGIC) return 0;
     
@@ -190,9 +437,28 @@ void kfree(void *ptr)
         return;
     }
     
+    uint32_t flags;
+    if (is_vmalloc_addr(ptr)) {
+        uint16_t tag;
+        uint32_t user_size = vmalloc_size(ptr, &tag);
+        if (!user_size) {
+            return;
+        }
+        spinlock_irq_save(&heap_lock, &flags);
+        total_frees++;
+        current_allocations--;
+        bytes_allocated -= user_size;
+        tag_account_free(tag, user_size);
+        spinlock_irq_restore(&heap_lock, flags);
+        vfree(ptr);
+        return;
+    }
+    
     heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - HEADER_SIZE);
     
+    spinlock_irq_save(&heap_lock, &flags);
     if (block->magic != HEAP_MAGIC) {
+        spinlock_irq_restore(&heap_lock, flags);
         return; 
     }
     
@@ -204,24 +470,37 @@ void kfree(void *ptr)
     total_frees++;
     current_allocations--;
     bytes_allocated -= block->user_size;
+    tag_account_free(block->tag, block->user_size);
     
     block->free = 1;
     
-    if (block->next && block->next->free) {
-        block->size += HEADER_SIZE + block->next->size;
-        block->next = block->next->next;
+    heap_block_t *next = block->next;
+    if (next && next->free) {
+        bin_remove(next);
+        block->size += HEADER_SIZE + next->size;
+        block->next = next->next;
         if (block->next) {
             block->next->prev = block;
+        } else {
+            heap_last = block;
         }
     }
     
-    if (block->prev && block->prev->free) {
-        block->prev->size += HEADER_SIZE + block->size;
-        block->prev->next = block->next;
+    heap_block_t *prev = block->prev;
+    if (prev && prev->free) {
+        bin_remove(prev);
+        prev->size += HEADER_SIZE + block->size;
+        prev->next = block->next;
         if (block->next) {
-            block->next->prev = block->prev;
+            block->next->prev = prev;
+        } else {
+            heap_last = prev;
         }
+        block = prev;
     }
+    
+    bin_insert(block);
+    spinlock_irq_restore(&heap_lock, flags);
 }
 
 void kfree_aligned(void *ptr)
@@ -249,3 +528,26 @@ int heap_check_leaks(void)
 {
     return (total_allocations != total_frees) ? (total_allocations - total_frees) : 0;
 }
+
+/* Copy out the tags in use, largest current footprint first */
+int heap_get_tag_stats(heap_tag_stats_t *out, int max)
+{
+    int count = 0;
+    if (max <= 0) return 0;
+    
+    uint32_t flags;
+    spinlock_irq_save(&heap_lock, &flags);
+    for (int i = 0; i < HEAP_MAX_TAGS; i++) {
+        if (!heap_tags[i].name || !heap_tags[i].allocs) continue;
+        if (count == max && out[max - 1].bytes >= heap_tags[i].bytes) continue;
+        
+        int pos = count < max ? count++ : max - 1;
+        while (pos > 0 && out[pos - 1].bytes < heap_tags[i].bytes) {
+            out[pos] = out[pos - 1];
+            pos--;
+        }
+        out[pos] = heap_tags[i];
+    }
+    spinlock_irq_restore(&heap_lock, flags);
+    return count;
+}
@@ -0,0 +1,244 @@
+/* Kernel Stacks
+ * Guard-page protected kernel stacks in a region of their own
+ *
+ * Stacks no longer share the heap, so an overflow runs into unmapped
+ * memory instead of the next heap block. That fault cannot be delivered
+ * on the stack that overflowed, so the CPU escalates it to a double
+ * fault; #DF is therefore a task gate with a stack of its own, which
+ * reports the overflow.
+ *
+ * Freed stacks go into a small cache that keeps them mapped, so task
+ * churn costs no page table work.
+ */
+
+#include <kernel/kernel.h>
+#include <mm/kstack.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <arch/x86/gdt.h>
+#include <arch/x86/idt.h>
+#include <arch/x86/smp.h>
+#include <drivers/serial.h>
+#include <sync/spinlock.h>
+
+#define KSTACK_SLOTS        ((KSTACK_END - KSTACK_START) / KSTACK_SLOT_SIZE)
+#define KSTACK_NONE         0xFFFFFFFF
+
+static uint8_t slot_pages[KSTACK_SLOTS];    /* mapped pages; 0 if free */
+static uint16_t cache[KSTACK_CACHE_SIZE];
+static uint32_t cache_count = 0;
+static uint32_t next_slot = 0;
+static uint32_t stacks_in_use = 0;
+static uint32_t deferred_slot[SMP_MAX_CPUS];
+static spinlock_t kstack_lock = SPINLOCK_INIT;
+
+static inline uint32_t slot_base(uint32_t slot)
+{
+    return KSTACK_START + slot * KSTACK_SLOT_SIZE + KSTACK_SLOT_SIZE - slot_pages[slot] * PAGE_SIZE;
+}
+
+static inline uint32_t current_esp(void)
+{
+    uint32_t esp;
+    __asm__ volatile("mov %%esp, %0" : "=r"(esp));
+    return esp;
+}
+
+/* Whether the calling CPU is on slot's stack */
+static int running_on(uint32_t slot)
+{
+    return (current_esp() - KSTACK_START) / KSTACK_SLOT_SIZE == slot;
+}
+
+/* Entered through the #DF task gate, on a stack of this CPU's own. The
+ * interrupted context was saved in this CPU's main TSS by the task
+ * switch.
+ */
+static void kstack_double_fault(void)
+{
+    tss_entry_t *tss = tss_get_entry();
+    cpu_t *cpu = smp_is_bsp() ? NULL : smp_get_cpu(smp_cpu_id());
+    if (cpu && cpu->gdt) {
+        tss = gdt_cpu_get_tss(cpu->gdt);
+    }
+    uint32_t cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    
+    if (kstack_is_guard(tss->esp) || kstack_is_guard(cr2)) {
+        panic_with_regs("Kernel stack overflow", tss->eip, tss->cs, tss->eflags, 0);
+    }
+    panic_with_regs("Double Fault", tss->eip, tss->cs, tss->eflags, 0);
+}
+
+/* Page tables for the whole region exist before any process directory
+ * is created, so switching to a stack never needs a PDE sync fault.
+ */
+void kstack_init(void)
+{
+    if (vmm_alloc_tables(KSTACK_START, KSTACK_END - KSTACK_START) != 0) {
+        serial_puts("[KSTACK] Failed to allocate page tables\n");
+    }
+    
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        deferred_slot[cpu] = KSTACK_NONE;
+    }
+    
+    gdt_init_double_fault(vmm_get_kernel_directory(), kstack_double_fault);
+    idt_set_handler(8, 0, GDT_DF_TSS_SEGMENT, IDT_TASK_GATE);
+    
+    serial_puts("[KSTACK] Guarded kernel stacks enabled\n");
+}
+
+/* Unmap a slot's stack and give its frames back; the slot itself must
+ * already be reserved by the caller.
+ */
+static void slot_release(uint32_t slot)
+{
+    uint32_t base = slot_base(slot);
+    uint32_t pages = slot_pages[slot];
+    uint32_t frames[KSTACK_MAX_SIZE / PAGE_SIZE];
+    
+    for (uint32_t i = 0; i < pages; i++) {
+        frames[i] = vmm_get_physical(base + i * PAGE_SIZE) & ~0xFFF;
+    }
+    
+    /* No CPU may still reach a frame once it is back in the PMM */
+    vmm_unmap_range(base, pages * PAGE_SIZE);
+    
+    for (uint32_t i = 0; i < pages; i++) {
+        if (frames[i]) pmm_free_frame(frames[i]);
+    }
+}
+
+/* Cache or unmap a stack nobody runs on any more */
+static void slot_retire(uint32_t slot)
+{
+    uint32_t flags;
+    spinlock_irq_save(&kstack_lock, &flags);
+    if (cache_count < KSTACK_CACHE_SIZE) {
+        cache[cache_count++] = (uint16_t)slot;
+        spinlock_irq_restore(&kstack_lock, flags);
+        return;
+    }
+    spinlock_irq_restore(&kstack_lock, flags);
+    
+    slot_release(slot);
+    
+    spinlock_irq_save(&kstack_lock, &flags);
+    slot_pages[slot] = 0;
+    spinlock_irq_restore(&kstack_lock, flags);
+}
+
+/* A stack freed by the task still running on it is retired later, by
+ * the same CPU once it has moved to another stack. Only that CPU can
+ * tell, so each CPU keeps its own.
+ */
+static void reap_deferred(void)
+{
+    uint32_t flags;
+    spinlock_irq_save(&kstack_lock, &flags);
+    uint32_t cpu = smp_cpu_id();
+    uint32_t slot = deferred_slot[cpu];
+    if (slot == KSTACK_NONE || running_on(slot)) {
+        spinlock_irq_restore(&kstack_lock, flags);
+        return;
+    }
+    deferred_slot[cpu] = KSTACK_NONE;
+    spinlock_irq_restore(&kstack_lock, flags);
+    
+    slot_retire(slot);
+}
+
+void *kstack_alloc(uint32_t size)
+{
+    size = ALIGN_UP(size, PAGE_SIZE);
+    if (size == 0 || size > KSTACK_MAX_SIZE) return NULL;
+    
+    reap_deferred();
+    
+    uint32_t pages = size / PAGE_SIZE;
+    uint32_t slot = KSTACK_NONE;
+    uint32_t flags;
+    spinlock_irq_save(&kstack_lock, &flags);
+    
+    for (uint32_t i = cache_count; i > 0; i--) {
+        if (slot_pages[cache[i - 1]] == pages) {
+            slot = cache[i - 1];
+            cache[i - 1] = cache[--cache_count];
+            stacks_in_use++;
+            spinlock_irq_restore(&kstack_lock, flags);
+            return (void *)slot_base(slot);
+        }
+    }
+    
+    for (uint32_t n = 0; n < KSTACK_SLOTS; n++) {
+        uint32_t i = (next_slot + n) % KSTACK_SLOTS;
+        if (!slot_pages[i]) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == KSTACK_NONE) {
+        spinlock_irq_restore(&kstack_lock, flags);
+        serial_puts("[KSTACK] Out of stack slots\n");
+        return NULL;
+    }
+    
+    slot_pages[slot] = (uint8_t)pages;
+    next_slot = (slot + 1) % KSTACK_SLOTS;
+    stacks_in_use++;
+    spinlock_irq_restore(&kstack_lock, flags);
+    
+    uint32_t base = slot_base(slot);
+    if (vmm_alloc_range(base, size, PAGE_KERNEL) != 0) {
+        slot_release(slot);
+        spinlock_irq_save(&kstack_lock, &flags);
+        slot_pages[slot] = 0;
+        stacks_in_use--;
+        spinlock_irq_restore(&kstack_lock, flags);
+        return NULL;
+    }
+    
+    return (void *)base;
+}
+
+void kstack_free(void *stack)
+{
+    uint32_t addr = (uint32_t)stack;
+    if (addr < KSTACK_START || addr >= KSTACK_END) return;
+    
+    uint32_t slot = (addr - KSTACK_START) / KSTACK_SLOT_SIZE;
+    if (!slot_pages[slot] || addr != slot_base(slot)) {
+        serial_puts("[KSTACK] WARNING: free of unknown stack\n");
+        return;
+    }
+    
+    uint32_t flags;
+    spinlock_irq_save(&kstack_lock, &flags);
+    stacks_in_use--;
+    spinlock_irq_restore(&kstack_lock, flags);
+    
+    reap_deferred();
+    if (running_on(slot)) {
+        spinlock_irq_save(&kstack_lock, &flags);
+        deferred_slot[smp_cpu_id()] = slot;
+        spinlock_irq_restore(&kstack_lock, flags);
+        return;
+    }
+    slot_retire(slot);
+}
+
+/* Whether addr lies in the unmapped part of a stack slot */
+int kstack_is_guard(uint32_t addr)
+{
+    if (addr < KSTACK_START || addr >= KSTACK_END) return 0;
+    
+    uint32_t slot = (addr - KSTACK_START) / KSTACK_SLOT_SIZE;
+    return !slot_pages[slot] || addr < slot_base(slot);
+}
+
+void kstack_get_stats(uint32_t *in_use, uint32_t *cached)
+{
+    if (in_use) *in_use = stacks_in_use;
+    if (cached) *cached = cache_count;
+}
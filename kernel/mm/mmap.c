@@ -1,88 +1,454 @@
 /* Memory Mapping
  * mmap, munmap, mprotect, COW, demand paging
+ *
+ * Each process keeps its VMAs in process_t as an array sorted by start
+ * address, so a fault finds its VMA with a binary search. Adjacent VMAs
+ * that would behave identically are merged, which keeps the array short
+ * for programs that map memory in small pieces. A pointer into the array
+ * is only valid until the next call that adds, removes or splits a VMA.
  */
 
 #include <mm/mmap.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <mm/heap.h>
+#include <mm/pagecache.h>
+#include <mm/swap.h>
+#include <mm/reclaim.h>
+#include <mm/kstack.h>
+#include <fs/vfs.h>
 #include <kernel/process.h>
+#include <kernel/kernel.h>
+#include <arch/x86/idt.h>
 #include <drivers/serial.h>
 #include <string.h>
 
-/* Per-process VMA table (simplified - in real OS this would be in process_t) */
-static vma_t process_vmas[64][MAX_VMAS_PER_PROC];
-
 #define USER_MMAP_START     0x40000000
 #define USER_MMAP_END       0x80000000
 #define USER_STACK_TOP      0xBFFFF000
 #define USER_STACK_BOTTOM   0xBF800000  
 
-static uint32_t next_mmap_addr = USER_MMAP_START;
+#define VMA_INITIAL_CAPACITY    8
+
+/* Pages mapped per anonymous fault, including the faulting one */
+static uint32_t fault_around_pages = FAULT_AROUND_DEFAULT;
+
+static int vma_populate(vma_t *vma, uint32_t start, uint32_t end);
+
+/* Present or swapped out: either way the page must not be refilled */
+static int page_in_use(uint32_t page)
+{
+    return (vmm_get_pte(page) & (PAGE_PRESENT | PAGE_SWAPPED)) != 0;
+}
+
+static void rss_add(uint32_t pages)
+{
+    process_t *proc = process_current();
+    if (proc) {
+        proc->rss_pages += pages;
+    }
+}
+
+/* Index of the first VMA that ends above addr */
+static uint32_t vma_lower_bound(process_t *proc, uint32_t addr)
+{
+    uint32_t lo = 0;
+    uint32_t hi = proc->vma_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (proc->vmas[mid].end <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Make room for one more VMA */
+static int vma_reserve(process_t *proc)
+{
+    if (proc->vma_count < proc->vma_capacity) return 0;
+    if (proc->vma_count >= MAX_VMAS_PER_PROC) return -12;
+    
+    uint32_t capacity = proc->vma_capacity ? proc->vma_capacity * 2 : VMA_INITIAL_CAPACITY;
+    if (capacity > MAX_VMAS_PER_PROC) capacity = MAX_VMAS_PER_PROC;
+    
+    vma_t *vmas = (vma_t *)kmalloc(capacity * sizeof(vma_t));
+    if (!vmas) return -12;
+    
+    if (proc->vmas) {
+        memcpy(vmas, proc->vmas, proc->vma_count * sizeof(vma_t));
+        kfree(proc->vmas);
+    }
+    proc->vmas = vmas;
+    proc->vma_capacity = capacity;
+    return 0;
+}
+
+static vma_t *vma_insert_at(process_t *proc, uint32_t index, const vma_t *vma)
+{
+    if (vma_reserve(proc) != 0) return NULL;
+    
+    memmove(&proc->vmas[index + 1], &proc->vmas[index],
+            (proc->vma_count - index) * sizeof(vma_t));
+    proc->vmas[index] = *vma;
+    proc->vma_count++;
+    return &proc->vmas[index];
+}
+
+static void vma_remove_at(process_t *proc, uint32_t index)
+{
+    memmove(&proc->vmas[index], &proc->vmas[index + 1],
+            (proc->vma_count - index - 1) * sizeof(vma_t));
+    proc->vma_count--;
+}
+
+/* Whether b, which starts where a ends, can be folded into a */
+static int vma_mergeable(const vma_t *a, const vma_t *b)
+{
+    if (a->end != b->start) return 0;
+    if (a->prot != b->prot || a->flags != b->flags) return 0;
+    if (a->lazy != b->lazy || a->cow != b->cow || a->file != b->file) return 0;
+    return !a->file || a->file_offset + (a->end - a->start) == b->file_offset;
+}
+
+/* Fold the VMA at index into its neighbours where possible. Returns the
+ * index of the VMA that now covers its range.
+ */
+static uint32_t vma_merge(process_t *proc, uint32_t index)
+{
+    if (index + 1 < proc->vma_count && vma_mergeable(&proc->vmas[index], &proc->vmas[index + 1])) {
+        proc->vmas[index].end = proc->vmas[index + 1].end;
+        vma_remove_at(proc, index + 1);
+    }
+    if (index > 0 && vma_mergeable(&proc->vmas[index - 1], &proc->vmas[index])) {
+        proc->vmas[index - 1].end = proc->vmas[index].end;
+        vma_remove_at(proc, index);
+        index--;
+    }
+    return index;
+}
+
+/* Cut the VMA at index in two at addr, which must lie strictly inside it */
+static int vma_split(process_t *proc, uint32_t index, uint32_t addr)
+{
+    vma_t tail = proc->vmas[index];
+    tail.start = addr;
+    tail.file_offset += addr - proc->vmas[index].start;
+    
+    if (!vma_insert_at(proc, index + 1, &tail)) return -12;
+    proc->vmas[index].end = addr;
+    return 0;
+}
+
+/* Add a VMA for a range that must be free, merging it into a neighbour
+ * when they match. Returns the VMA now covering the range.
+ */
+static vma_t *vma_add(process_t *proc, const vma_t *vma)
+{
+    uint32_t index = vma_lower_bound(proc, vma->start);
+    if (index < proc->vma_count && proc->vmas[index].start < vma->end) return NULL;
+    
+    if (index > 0 && vma_mergeable(&proc->vmas[index - 1], vma)) {
+        proc->vmas[index - 1].end = vma->end;
+        return &proc->vmas[vma_merge(proc, index - 1)];
+    }
+    if (index < proc->vma_count && vma_mergeable(vma, &proc->vmas[index])) {
+        proc->vmas[index].start = vma->start;
+        proc->vmas[index].file_offset = vma->file_offset;
+        return &proc->vmas[index];
+    }
+    return vma_insert_at(proc, index, vma);
+}
+
+/* First-fit search for length free bytes in the mmap area. As with the
+ * classic free area cache, the search resumes where the last one ended
+ * unless a hole that might be large enough was skipped further down;
+ * munmap pulls the hint back over whatever it frees.
+ */
+static uint32_t vma_find_gap(process_t *proc, uint32_t length)
+{
+    uint32_t start = proc->mmap_hint;
+    if (length <= proc->mmap_hole || start < USER_MMAP_START || start > USER_MMAP_END) {
+        start = USER_MMAP_START;
+        proc->mmap_hole = 0;
+    }
+    
+    uint32_t addr = start;
+    uint32_t index = vma_lower_bound(proc, addr);
+    for (;;) {
+        if (length > USER_MMAP_END - addr) {
+            if (start == USER_MMAP_START) return 0;
+            addr = start = USER_MMAP_START;
+            proc->mmap_hole = 0;
+            index = vma_lower_bound(proc, addr);
+            continue;
+        }
+        
+        if (index >= proc->vma_count || addr + length <= proc->vmas[index].start) {
+            proc->mmap_hint = addr + length;
+            return addr;
+        }
+        
+        if (addr < proc->vmas[index].start && proc->vmas[index].start - addr > proc->mmap_hole) {
+            proc->mmap_hole = proc->vmas[index].start - addr;
+        }
+        addr = proc->vmas[index].end;
+        index++;
+    }
+}
 
 void vma_init_process(void *p)
 {
     process_t *proc = (process_t *)p;
-    if (!proc || proc->pid >= 64) return;
+    if (!proc) return;
     
-    memset(process_vmas[proc->pid], 0, sizeof(vma_t) * MAX_VMAS_PER_PROC);
+    proc->vmas = NULL;
+    proc->vma_count = 0;
+    proc->vma_capacity = 0;
+    proc->mmap_hint = USER_MMAP_START;
+    proc->mmap_hole = 0;
 }
 
-static vma_t *get_vma_table(void)
+/* Give a forked child the parent's mappings. The page tables themselves
+ * are cloned by vmm_clone_directory; here the page cache just learns that
+ * each cache page the parent has mapped now has one more mapper.
+ */
+int vma_fork_process(void *parent_p, void *child_p)
 {
-    process_t *proc = process_current();
-    if (!proc || proc->pid >= 64) return NULL;
-    return process_vmas[proc->pid];
+    process_t *parent = (process_t *)parent_p;
+    process_t *child = (process_t *)child_p;
+    if (!parent || !child) return -22;
+    
+    vma_init_process(child);
+    if (parent->vma_count) {
+        child->vmas = (vma_t *)kmalloc(parent->vma_capacity * sizeof(vma_t));
+        if (!child->vmas) return -12;
+        memcpy(child->vmas, parent->vmas, parent->vma_count * sizeof(vma_t));
+        child->vma_count = parent->vma_count;
+        child->vma_capacity = parent->vma_capacity;
+    }
+    child->mmap_hint = parent->mmap_hint;
+    child->mmap_hole = parent->mmap_hole;
+    
+    for (uint32_t i = 0; i < parent->vma_count; i++) {
+        vma_t *vma = &parent->vmas[i];
+        if (!vma->file) continue;
+        
+        vfs_node_t *node = (vfs_node_t *)vma->file;
+        for (uint32_t page = vma->start; page < vma->end; page += 0x1000) {
+            uint32_t offset = vma->file_offset + (page - vma->start);
+            uint32_t phys = vmm_get_physical(page) & ~0xFFF;
+            if (phys && phys == pagecache_lookup(node, offset)) {
+                pagecache_get(node, offset);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Drop the page cache references held by a dead process's mappings and
+ * free its VMAs. Its page directory, if any, must still exist; frames are
+ * released separately by vmm_destroy_directory.
+ */
+void vma_release_process(void *p)
+{
+    process_t *proc = (process_t *)p;
+    if (!proc) return;
+    
+    for (uint32_t i = 0; i < proc->vma_count && proc->page_directory; i++) {
+        vma_t *vma = &proc->vmas[i];
+        if (!vma->file) continue;
+        
+        vfs_node_t *node = (vfs_node_t *)vma->file;
+        for (uint32_t page = vma->start; page < vma->end; page += 0x1000) {
+            uint32_t offset = vma->file_offset + (page - vma->start);
+            uint32_t pte = vmm_lookup_pte(proc->page_directory, page);
+            if ((pte & PAGE_PRESENT) && (pte & 0xFFFFF000) == pagecache_lookup(node, offset)) {
+                pagecache_put(node, offset);
+            }
+        }
+    }
+    
+    if (proc->vmas) {
+        kfree(proc->vmas);
+    }
+    vma_init_process(proc);
 }
 
 vma_t *vma_find(uint32_t addr)
 {
-    vma_t *vmas = get_vma_table();
-    if (!vmas) return NULL;
+    process_t *proc = process_current();
+    if (!proc) return NULL;
     
-    for (int i = 0; i < MAX_VMAS_PER_PROC; i++) {
-        if (vmas[i].in_use && addr >= vmas[i].start && addr < vmas[i].end) {
-            return &vmas[i];
-        }
+    uint32_t index = vma_lower_bound(proc, addr);
+    if (index < proc->vma_count && proc->vmas[index].start <= addr) {
+        return &proc->vmas[index];
     }
     return NULL;
 }
 
 vma_t *vma_create(uint32_t start, uint32_t end, uint32_t prot, uint32_t flags)
 {
-    vma_t *vmas = get_vma_table();
-    if (!vmas) return NULL;
-    
-    for (int i = 0; i < MAX_VMAS_PER_PROC; i++) {
-        if (!vmas[i].in_use) {
-            vmas[i].start = start;
-            vmas[i].end = end;
-            vmas[i].prot = prot;
-            vmas[i].flags = flags;
-            vmas[i].file = NULL;
-            vmas[i].file_offset = 0;
-            vmas[i].in_use = 1;
-            vmas[i].cow = 0;
-            vmas[i].lazy = (flags & MAP_ANONYMOUS) ? 1 : 0;
-            return &vmas[i];
-        }
-    }
-    return NULL;
+    process_t *proc = process_current();
+    if (!proc || start >= end) return NULL;
+    
+    vma_t vma;
+    memset(&vma, 0, sizeof(vma));
+    vma.start = start;
+    vma.end = end;
+    vma.prot = prot;
+    vma.flags = flags;
+    vma.lazy = (flags & MAP_ANONYMOUS) ? 1 : 0;
+    return vma_add(proc, &vma);
 }
 
 int vma_destroy(vma_t *vma)
 {
-    if (!vma) return -1;
-    vma->in_use = 0;
+    process_t *proc = process_current();
+    if (!proc || !vma || vma < proc->vmas || vma >= proc->vmas + proc->vma_count) return -1;
+    
+    vma_remove_at(proc, (uint32_t)(vma - proc->vmas));
     return 0;
 }
 
+static vfs_node_t *mmap_file_node(int fd)
+{
+    process_t *proc = process_current();
+    if (!proc || fd < 0 || fd >= MAX_FDS_PER_PROC) return NULL;
+    if (!proc->fd_table[fd].in_use) return NULL;
+    
+    vfs_node_t *node = proc->fd_table[fd].node;
+    if (!node || (node->flags & 0x07) != VFS_FILE) return NULL;
+    return node;
+}
+
+/* PTEs vma_release_pages snapshots before each unmap */
+#define VMA_RELEASE_BATCH   64
+
+static void vma_release_page(process_t *proc, vma_t *vma, uint32_t page, uint32_t pte)
+{
+    if (!(pte & PAGE_PRESENT)) {
+        if (pte & PAGE_SWAPPED) {
+            swap_entry_free(pte);
+        }
+        return;
+    }
+    
+    uint32_t phys = pte & ~0xFFF;
+    if (vma->file) {
+        /* Cache pages go back to the cache (written back first if a
+         * shared mapping dirtied them); private copies are freed.
+         */
+        vfs_node_t *node = (vfs_node_t *)vma->file;
+        uint32_t offset = vma->file_offset + (page - vma->start);
+        if (phys == pagecache_lookup(node, offset)) {
+            if ((vma->flags & MAP_SHARED) && (pte & PAGE_DIRTY)) {
+                pagecache_writeback(node, offset);
+            }
+            pagecache_put(node, offset);
+        } else {
+            pmm_free_frame(phys);
+        }
+    } else {
+        /* Shared anonymous frames carry a reference per mapping; shm
+         * frames (PAGE_SHARED) belong to their segment.
+         */
+        if (!(pte & PAGE_SHARED)) {
+            pmm_free_frame(phys);
+        }
+    }
+    if (proc && proc->rss_pages > 0) {
+        proc->rss_pages--;
+    }
+}
+
+/* Clear the PTEs behind [start, end) of vma and free the frames. A
+ * frame is only freed once its PTE is gone from the TLB, so nothing can
+ * still write through a stale entry after it is reused.
+ */
+static void vma_release_pages(vma_t *vma, uint32_t start, uint32_t end)
+{
+    process_t *proc = process_current();
+    uint32_t ptes[VMA_RELEASE_BATCH];
+    
+    while (start < end) {
+        uint32_t batch_end = end;
+        if ((end - start) / 0x1000 > VMA_RELEASE_BATCH) {
+            batch_end = start + VMA_RELEASE_BATCH * 0x1000;
+        }
+        
+        uint32_t count = 0;
+        for (uint32_t page = start; page < batch_end; page += 0x1000) {
+            ptes[count++] = vmm_get_pte(page);
+        }
+        
+        /* Drops the PTEs and flushes once for the batch */
+        vmm_unmap_range(start, batch_end - start);
+        
+        count = 0;
+        for (uint32_t page = start; page < batch_end; page += 0x1000) {
+            vma_release_page(proc, vma, page, ptes[count++]);
+        }
+        start = batch_end;
+    }
+}
+
+/* Unmap [start, end) of the current process, trimming, splitting or
+ * removing every VMA it overlaps. Returns the number of VMAs touched.
+ */
+static int vma_unmap(process_t *proc, uint32_t start, uint32_t end)
+{
+    uint32_t index = vma_lower_bound(proc, start);
+    
+    /* Punching a hole needs one more VMA; get it before freeing anything */
+    if (index < proc->vma_count && proc->vmas[index].start < start && proc->vmas[index].end > end) {
+        if (vma_split(proc, index, end) != 0) return -12;
+    }
+    
+    int touched = 0;
+    while (index < proc->vma_count && proc->vmas[index].start < end) {
+        vma_t *vma = &proc->vmas[index];
+        uint32_t from = vma->start > start ? vma->start : start;
+        uint32_t to = vma->end < end ? vma->end : end;
+        
+        vma_release_pages(vma, from, to);
+        touched++;
+        
+        if (from == vma->start && to == vma->end) {
+            vma_remove_at(proc, index);
+            continue;
+        }
+        if (from == vma->start) {
+            vma->file_offset += to - vma->start;
+            vma->start = to;
+        } else {
+            vma->end = from;
+        }
+        index++;
+    }
+    
+    if (touched && start >= USER_MMAP_START && start < proc->mmap_hint) {
+        proc->mmap_hint = start;
+    }
+    return touched;
+}
+
 void *sys_mmap(void *addr, uint32_t length, int prot, int flags, int fd, uint32_t offset)
 {
-    (void)fd;
-    (void)offset;
+    if (length == 0 || length > USER_MMAP_END - USER_MMAP_START) return MAP_FAILED;
     
-    if (length == 0) return MAP_FAILED;
+    process_t *proc = process_current();
+    if (!proc) return MAP_FAILED;
+    
+    vfs_node_t *node = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (offset & 0xFFF) return MAP_FAILED;
+        if (!(flags & (MAP_SHARED | MAP_PRIVATE))) return MAP_FAILED;
+        node = mmap_file_node(fd);
+        if (!node) return MAP_FAILED;
+    }
     
     length = (length + 0xFFF) & ~0xFFF;
     
@@ -90,70 +456,44 @@ void *sys_mmap(void *addr, uint32_t length, int prot, int flags, int fd, uint32_
     
     if (flags & MAP_FIXED) {
         vaddr = (uint32_t)addr;
-        if (vaddr < USER_MMAP_START || vaddr + length > USER_MMAP_END) {
+        if ((vaddr & 0xFFF) || vaddr < USER_MMAP_START || length > USER_MMAP_END - vaddr) {
+            return MAP_FAILED;
+        }
+        /* A fixed mapping replaces whatever was there */
+        if (vma_unmap(proc, vaddr, vaddr + length) < 0) {
             return MAP_FAILED;
         }
     } else {
-        vaddr = next_mmap_addr;
-        if (vaddr + length > USER_MMAP_END) {
+        vaddr = vma_find_gap(proc, length);
+        if (!vaddr) {
             return MAP_FAILED;
         }
-        next_mmap_addr += length;
     }
     
-    vma_t *vma = vma_create(vaddr, vaddr + length, prot, flags);
+    /* File pages come from the page cache on first touch, so mappings
+     * of the same file share frames until a private mapping writes.
+     */
+    vma_t new_vma;
+    memset(&new_vma, 0, sizeof(new_vma));
+    new_vma.start = vaddr;
+    new_vma.end = vaddr + length;
+    new_vma.prot = prot;
+    new_vma.flags = flags;
+    new_vma.file = node;
+    new_vma.file_offset = node ? offset : 0;
+    new_vma.lazy = (flags & MAP_ANONYMOUS) ? 1 : 0;
+    
+    vma_t *vma = vma_add(proc, &new_vma);
     if (!vma) {
         return MAP_FAILED;
     }
     
-    uint32_t page_flags = PAGE_USER | PAGE_PRESENT | PAGE_WRITE;
-    (void)prot;  
-    
-    if (flags & MAP_ANONYMOUS) {
-        /* Anonymous mapping - always allocate immediately for now */
-        /* (Lazy allocation requires page fault handler integration) */
-        {
-            for (uint32_t page = vaddr; page < vaddr + length; page += 0x1000) {
-                uint32_t phys = pmm_alloc_frame();
-                if (!phys) {
-                    for (uint32_t p = vaddr; p < page; p += 0x1000) {
-                        uint32_t ph = vmm_get_physical(p);
-                        vmm_unmap_page(p);
-                        pmm_free_frame(ph);
-                    }
-                    vma_destroy(vma);
-                    return MAP_FAILED;
-                }
-                serial_puts("[MMAP] Mapping page 0x");
-                char hex[9];
-                for (int k = 7; k >= 0; k--) {
-                    int nibble = (page >> (k * 4)) & 0xF;
-                    hex[7-k] = nibble < 10 ? '0' + nibble : 'A' + nibble - 10;
-                }
-                hex[8] = '\0';
-                serial_puts(hex);
-                serial_puts(" -> phys 0x");
-                for (int k = 7; k >= 0; k--) {
-                    int nibble = (phys >> (k * 4)) & 0xF;
-                    hex[7-k] = nibble < 10 ? '0' + nibble : 'A' + nibble - 10;
-                }
-                serial_puts(hex);
-                serial_puts("\n");
-                
-                vmm_map_page(page, phys, page_flags);
-                
-                if (!vmm_is_mapped(page)) {
-                    serial_puts("[MMAP] ERROR: Page not mapped!\n");
-                }
-                
-                memset((void *)page, 0, 0x1000);
-            }
-            serial_puts("[MMAP] Created anonymous mapping\n");
-        }
-    } else {
-        serial_puts("[MMAP] File mapping not fully implemented\n");
-        vma_destroy(vma);
-        return MAP_FAILED;
+    /* Anonymous memory (vma->lazy) is populated on first touch by
+     * demand_page_alloc from the page fault handler, unless the caller
+     * asked for everything up front.
+     */
+    if (flags & MAP_POPULATE) {
+        vma_populate(vma, vaddr, vaddr + length);
     }
     
     return (void *)vaddr;
@@ -167,33 +507,78 @@ int sys_munmap(void *addr, uint32_t length)
     if (length == 0) return -22;
     
     length = (length + 0xFFF) & ~0xFFF;
+    if (vaddr + length < vaddr) return -22;
+    
+    process_t *proc = process_current();
+    if (!proc) return -22;
     
-    vma_t *vma = vma_find(vaddr);
-    if (!vma) return -22;
+    int result = vma_unmap(proc, vaddr, vaddr + length);
+    if (result < 0) return result;
+    if (result == 0) return -22;
+    
+    serial_puts("[MMAP] Unmapped region\n");
+    return 0;
+}
+
+/* Move the program break. The heap is an anonymous VMA starting at the
+ * end of the loaded image, below the mmap area; growing it only extends
+ * the VMA and pages are faulted in on first touch. Returns the new
+ * break, or the current one if the request cannot be met.
+ */
+uint32_t sys_brk(uint32_t addr)
+{
+    process_t *proc = process_current();
+    if (!proc || !proc->brk_start) return 0;
+    if (addr < proc->brk_start || addr > USER_MMAP_START) return proc->brk;
+    
+    uint32_t old_end = (proc->brk + 0xFFF) & ~0xFFF;
+    uint32_t new_end = (addr + 0xFFF) & ~0xFFF;
+    
+    if (new_end > old_end) {
+        vma_t heap;
+        memset(&heap, 0, sizeof(heap));
+        heap.start = old_end;
+        heap.end = new_end;
+        heap.prot = PROT_READ | PROT_WRITE;
+        heap.flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        heap.lazy = 1;
+        if (!vma_add(proc, &heap)) return proc->brk;
+    } else if (new_end < old_end) {
+        if (vma_unmap(proc, new_end, old_end) < 0) return proc->brk;
+    }
+    
+    proc->brk = addr;
+    return addr;
+}
+
+/* Rewrite the PTEs of a VMA whose protection just changed */
+static void vma_apply_prot(vma_t *vma)
+{
+    uint32_t page_flags = PAGE_USER | PAGE_PRESENT;
+    if (vma->prot & PROT_WRITE) {
+        page_flags |= PAGE_WRITE;
+    }
     
-    for (uint32_t page = vaddr; page < vaddr + length; page += 0x1000) {
+    for (uint32_t page = vma->start; page < vma->end; page += 0x1000) {
         if (vmm_is_mapped(page)) {
             uint32_t phys = vmm_get_physical(page);
-            vmm_unmap_page(page);
+            uint32_t old_flags = vmm_get_flags(page);
+            uint32_t flags = page_flags | (old_flags & (PAGE_SHARED | PAGE_SHARED_ANON));
             
-            if (!(vma->flags & MAP_SHARED)) {
-                pmm_free_frame(phys);
+            /* Pages still shared copy-on-write stay read-only */
+            if (old_flags & PAGE_COW) {
+                flags = (flags & ~PAGE_WRITE) | PAGE_COW;
             }
+            
+            /* A private mapping must never write through to the cache */
+            if (vma->file && !(vma->flags & MAP_SHARED) &&
+                (phys & ~0xFFF) == pagecache_lookup((vfs_node_t *)vma->file,
+                                                    vma->file_offset + (page - vma->start))) {
+                flags &= ~PAGE_WRITE;
+            }
+            vmm_map_page_noflush(page, phys, flags);
         }
     }
-    
-    if (vaddr == vma->start && vaddr + length == vma->end) {
-        vma_destroy(vma);
-    } else {
-        if (vaddr == vma->start) {
-            vma->start = vaddr + length;
-        } else if (vaddr + length == vma->end) {
-            vma->end = vaddr;
-        }
-    }
-    
-    serial_puts("[MMAP] Unmapped region\n");
-    return 0;
 }
 
 int sys_mprotect(void *addr, uint32_t length, int prot)
@@ -204,124 +589,336 @@ int sys_mprotect(void *addr, uint32_t length, int prot)
     if (length == 0) return -22;
     
     length = (length + 0xFFF) & ~0xFFF;
+    uint32_t end = vaddr + length;
+    if (end < vaddr) return -22;
     
-    vma_t *vma = vma_find(vaddr);
-    if (!vma) return -22;
+    process_t *proc = process_current();
+    if (!proc) return -22;
     
-    vma->prot = prot;
+    uint32_t index = vma_lower_bound(proc, vaddr);
+    if (index >= proc->vma_count || proc->vmas[index].start > vaddr) return -22;
     
-    uint32_t page_flags = PAGE_USER | PAGE_PRESENT;
-    if (prot & PROT_WRITE) {
-        page_flags |= PAGE_WRITE;
+    /* The range gets VMAs of its own; the rest keeps its protection */
+    if (proc->vmas[index].start < vaddr) {
+        if (vma_split(proc, index, vaddr) != 0) return -12;
+        index++;
     }
     
-    for (uint32_t page = vaddr; page < vaddr + length; page += 0x1000) {
-        if (vmm_is_mapped(page)) {
-            uint32_t phys = vmm_get_physical(page);
-            vmm_unmap_page(page);
-            vmm_map_page(page, phys, page_flags);
-        }
+    for (; index < proc->vma_count && proc->vmas[index].start < end; index++) {
+        if (proc->vmas[index].end > end && vma_split(proc, index, end) != 0) return -12;
+        
+        proc->vmas[index].prot = prot;
+        vma_apply_prot(&proc->vmas[index]);
     }
+    vmm_flush_range(vaddr, end);
+    
+    /* Pieces that now match their neighbours go back together */
+    for (index = vma_lower_bound(proc, vaddr);
+         index < proc->vma_count && proc->vmas[index].start <= end;
+         index = vma_merge(proc, index) + 1);
     
     serial_puts("[MMAP] Changed protection\n");
     return 0;
 }
 
+/* Give a private mapping its own copy of a cache page before it writes */
+static int filemap_copy_private(uint32_t page_addr, uint32_t cache_phys, vfs_node_t *node, uint32_t offset)
+{
+    uint32_t new_phys = pmm_alloc_frame();
+    if (!new_phys) return -12;
+    
+    void *src = vmm_temp_map(cache_phys);
+    if (!src) {
+        pmm_free_frame(new_phys);
+        return -12;
+    }
+    
+    vmm_map_page(page_addr, new_phys, PAGE_USER | PAGE_PRESENT | PAGE_WRITE);
+    memcpy((void *)page_addr, src, 0x1000);
+    vmm_temp_unmap(src);
+    
+    pagecache_put(node, offset);
+    return 0;
+}
+
+static int filemap_fault(uint32_t fault_addr, uint32_t error_code, vma_t *vma)
+{
+    uint32_t page_addr = fault_addr & ~0xFFF;
+    vfs_node_t *node = (vfs_node_t *)vma->file;
+    uint32_t offset = vma->file_offset + (page_addr - vma->start);
+    int write = (error_code & PF_WRITE) != 0;
+    
+    if (vma->prot == PROT_NONE) return -1;
+    if (write && !(vma->prot & PROT_WRITE)) return -1;
+    
+    if (error_code & PF_PRESENT) {
+        /* Only a private write to a shared cache page is recoverable */
+        if (!write || (vma->flags & MAP_SHARED)) return -1;
+        
+        uint32_t phys = vmm_get_physical(page_addr) & ~0xFFF;
+        if (phys != pagecache_lookup(node, offset)) return -1;
+        return filemap_copy_private(page_addr, phys, node, offset);
+    }
+    
+    uint32_t phys = pagecache_get(node, offset);
+    if (!phys) return -12;
+    
+    if (write && !(vma->flags & MAP_SHARED)) {
+        if (filemap_copy_private(page_addr, phys, node, offset) != 0) {
+            pagecache_put(node, offset);
+            return -12;
+        }
+    } else {
+        uint32_t flags = PAGE_USER | PAGE_PRESENT | PAGE_SHARED;
+        if ((vma->flags & MAP_SHARED) && (vma->prot & PROT_WRITE)) {
+            flags |= PAGE_WRITE;
+        }
+        vmm_map_page_noflush(page_addr, phys, flags);
+    }
+    
+    rss_add(1);
+    return 0;
+}
 
 int handle_page_fault(uint32_t fault_addr, uint32_t error_code)
 {
-    serial_puts("[PAGEFAULT] Fault at 0x");
-    char hex[9];
-    for (int k = 7; k >= 0; k--) {
-        int nibble = (fault_addr >> (k * 4)) & 0xF;
-        hex[7-k] = nibble < 10 ? '0' + nibble : 'A' + nibble - 10;
+    /* Kernel page table created after this directory was */
+    if (fault_addr >= KERNEL_VMA && !(error_code & PF_PRESENT)) {
+        return vmm_sync_kernel_pde(fault_addr) ? 0 : -1;
     }
-    hex[8] = '\0';
-    serial_puts(hex);
-    serial_puts("\n");
     
-    if ((error_code & 0x1) && (error_code & 0x2)) {
-        if (cow_handle_fault(fault_addr) == 0) {
-            return 0;
+    /* Swapped-out anonymous page; -1 means it was never swapped */
+    if (!(error_code & PF_PRESENT)) {
+        int result = swap_in(fault_addr);
+        if (result != -1) {
+            return result == 0 ? 0 : -1;
         }
     }
     
-    vma_t *vma = vma_find(fault_addr);
-    if (vma && vma->lazy) {
-        if (demand_page_alloc(fault_addr, vma) == 0) {
+    if ((error_code & PF_PRESENT) && (error_code & PF_WRITE)) {
+        if (cow_handle_fault(fault_addr) == 0) {
             return 0;
         }
     }
     
-    if (fault_addr >= USER_STACK_BOTTOM && fault_addr < USER_STACK_TOP) {
-        if (stack_grow(fault_addr) == 0) {
-            return 0;
+    vma_t *file_vma = vma_find(fault_addr);
+    if (file_vma && file_vma->file) {
+        return filemap_fault(fault_addr, error_code, file_vma) == 0 ? 0 : -1;
+    }
+    
+    if (!(error_code & PF_PRESENT)) {
+        vma_t *vma = vma_find(fault_addr);
+        if (vma && vma->lazy) {
+            if ((error_code & PF_WRITE) && !(vma->prot & PROT_WRITE)) {
+                return -1;
+            }
+            if (demand_page_alloc(fault_addr, vma) == 0) {
+                return 0;
+            }
+        }
+        
+        if (fault_addr >= USER_STACK_BOTTOM && fault_addr < USER_STACK_TOP) {
+            if (stack_grow(fault_addr) == 0) {
+                return 0;
+            }
         }
     }
     
     return -1;
 }
 
+static void page_fault_isr(registers_t *regs)
+{
+    uint32_t fault_addr;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(fault_addr));
+    
+    if (handle_page_fault(fault_addr, regs->err_code) == 0) {
+        return;
+    }
+    
+    serial_puts("[PAGEFAULT] Unhandled fault at 0x");
+    char hex[9];
+    for (int k = 7; k >= 0; k--) {
+        int nibble = (fault_addr >> (k * 4)) & 0xF;
+        hex[7-k] = nibble < 10 ? '0' + nibble : 'A' + nibble - 10;
+    }
+    hex[8] = '\0';
+    serial_puts(hex);
+    serial_puts("\n");
+    
+    if (kstack_is_guard(fault_addr)) {
+        panic_with_regs("Kernel stack overflow", regs->eip, regs->cs, regs->eflags, regs->err_code);
+    }
+    panic_with_regs("Page Fault", regs->eip, regs->cs, regs->eflags, regs->err_code);
+}
+
 
 int cow_mark_page(uint32_t virt)
 {
     if (!vmm_is_mapped(virt)) return -1;
     
-    uint32_t phys = vmm_get_physical(virt);
-    vmm_unmap_page(virt);
-    vmm_map_page(virt, phys, PAGE_USER | PAGE_PRESENT);  
+    uint32_t phys = vmm_get_physical(virt) & ~0xFFF;
+    vmm_map_page(virt, phys, PAGE_USER | PAGE_PRESENT | PAGE_COW);
     
     return 0;
 }
 
+/* Write to a PAGE_COW page. The last reference takes the frame over in
+ * place; otherwise the writer gets a private copy and drops its reference
+ * on the shared frame.
+ */
 int cow_handle_fault(uint32_t fault_addr)
 {
     uint32_t page_addr = fault_addr & ~0xFFF;
     
+    uint32_t pte_flags = vmm_get_flags(page_addr);
+    if (!(pte_flags & PAGE_PRESENT) || !(pte_flags & PAGE_COW)) return -1;
+    
     vma_t *vma = vma_find(fault_addr);
-    if (!vma || !vma->cow) return -1;
-    if (!(vma->prot & PROT_WRITE)) return -1;
+    if (vma && !(vma->prot & PROT_WRITE)) return -1;
     
-    uint32_t old_phys = vmm_get_physical(page_addr);
-    if (!old_phys) return -1;
+    uint32_t old_phys = vmm_get_physical(page_addr) & ~0xFFF;
+    
+    if (pmm_frame_refcount(old_phys) <= 1) {
+        vmm_map_page(page_addr, old_phys, PAGE_USER | PAGE_PRESENT | PAGE_WRITE);
+        return 0;
+    }
     
     uint32_t new_phys = pmm_alloc_frame();
-    if (!new_phys) return -12;  
+    if (!new_phys) return -12;
     
-    vmm_map_page(0xFFFFE000, new_phys, PAGE_KERNEL);
-    memcpy((void *)0xFFFFE000, (void *)page_addr, 0x1000);
-    vmm_unmap_page(0xFFFFE000);
+    void *src = vmm_temp_map(old_phys);
+    if (!src) {
+        pmm_free_frame(new_phys);
+        return -12;
+    }
     
-    vmm_unmap_page(page_addr);
     vmm_map_page(page_addr, new_phys, PAGE_USER | PAGE_PRESENT | PAGE_WRITE);
+    memcpy((void *)page_addr, src, 0x1000);
+    vmm_temp_unmap(src);
     
-    serial_puts("[COW] Copied page\n");
+    pmm_free_frame(old_phys);
     return 0;
 }
 
+/* Back one not-present anonymous page with a pre-zeroed frame. The page
+ * was not present, so installing the final PTE needs no TLB flush.
+ */
+static int anon_fill_page(uint32_t page_addr, vma_t *vma)
+{
+    uint32_t phys = pmm_alloc_zeroed_frame();
+    if (!phys) return -12;
+    
+    /* Shared anonymous pages stay shared across fork instead of COW;
+     * each address space mapping one holds a reference on the frame.
+     */
+    uint32_t flags = PAGE_USER | PAGE_PRESENT;
+    if (vma->flags & MAP_SHARED) flags |= PAGE_SHARED_ANON;
+    if (vma->prot & PROT_WRITE) flags |= PAGE_WRITE;
+    
+    vmm_map_page_noflush(page_addr, phys, flags);
+    if (!(vma->flags & MAP_SHARED)) {
+        reclaim_track_anon(phys, page_addr);
+    }
+    return 0;
+}
 
 int demand_page_alloc(uint32_t virt, vma_t *vma)
 {
     uint32_t page_addr = virt & ~0xFFF;
     
     if (vmm_is_mapped(page_addr)) return -1; 
+    if (vma->prot == PROT_NONE) return -1;
+    
+    if (anon_fill_page(page_addr, vma) != 0) return -12;
+    uint32_t mapped = 1;
+    
+    /* Fault-around: fill the rest of the aligned window this page sits
+     * in, so sequential access takes one fault per window instead of
+     * one per page.
+     */
+    uint32_t start = page_addr;
+    uint32_t end = page_addr + 0x1000;
+    uint32_t window = fault_around_pages * 0x1000;
+    if (window > 0x1000) {
+        start = page_addr - (page_addr % window);
+        end = start + window;
+        if (start < vma->start) start = vma->start;
+        if (end > vma->end || end < start) end = vma->end;
+        
+        for (uint32_t page = start; page < end; page += 0x1000) {
+            if (page == page_addr || page_in_use(page)) continue;
+            if (anon_fill_page(page, vma) != 0) break;
+            mapped++;
+        }
+    }
     
-    uint32_t phys = pmm_alloc_frame();
-    if (!phys) return -12; 
-    
-    uint32_t flags = PAGE_USER | PAGE_PRESENT;
-    if (vma->prot & PROT_WRITE) {
+    rss_add(mapped);
+    return 0;
+}
+
+/* Prefault [start, end) of a file mapping from the page cache. Private
+ * pages are mapped read-only and still copied on first write.
+ */
+static int filemap_populate(vma_t *vma, uint32_t start, uint32_t end)
+{
+    vfs_node_t *node = (vfs_node_t *)vma->file;
+    uint32_t flags = PAGE_USER | PAGE_PRESENT | PAGE_SHARED;
+    if ((vma->flags & MAP_SHARED) && (vma->prot & PROT_WRITE)) {
         flags |= PAGE_WRITE;
     }
     
-    vmm_map_page(page_addr, phys, flags);
+    uint32_t mapped = 0;
+    for (uint32_t page = start; page < end; page += 0x1000) {
+        if (vmm_is_mapped(page)) continue;
     
-    if (vma->flags & MAP_ANONYMOUS) {
-        memset((void *)page_addr, 0, 0x1000);
+        uint32_t phys = pagecache_get(node, vma->file_offset + (page - vma->start));
+        if (!phys) break;
+        vmm_map_page_noflush(page, phys, flags);
+        mapped++;
     }
     
-    serial_puts("[DEMAND] Allocated page on fault\n");
-    return 0;
+    rss_add(mapped);
+    return (int)mapped;
+}
+
+/* Fill [start, end) of a VMA in one pass; nothing was present, so there
+ * is nothing to flush.
+ * Stops quietly when memory runs out; the rest stays demand-paged.
+ */
+static int vma_populate(vma_t *vma, uint32_t start, uint32_t end)
+{
+    if (vma->prot == PROT_NONE) return -1;
+    if (vma->file) return filemap_populate(vma, start, end);
+    
+    uint32_t mapped = 0;
+    for (uint32_t page = start; page < end; page += 0x1000) {
+        if (page_in_use(page)) continue;
+        if (anon_fill_page(page, vma) != 0) break;
+        mapped++;
+    }
+    
+    rss_add(mapped);
+    return (int)mapped;
+}
+
+/* MAP_POPULATE for a whole VMA */
+int mmap_populate(vma_t *vma)
+{
+    if (!vma) return -1;
+    return vma_populate(vma, vma->start, vma->end);
+}
+
+void mmap_set_fault_around(uint32_t pages)
+{
+    if (pages < 1) pages = 1;
+    if (pages > FAULT_AROUND_MAX) pages = FAULT_AROUND_MAX;
+    fault_around_pages = pages;
+}
+
+uint32_t mmap_get_fault_around(void)
+{
+    return fault_around_pages;
 }
 
 
@@ -331,20 +928,20 @@ int stack_grow(uint32_t fault_addr)
     
     if (vmm_is_mapped(page_addr)) return -1;
     
-    uint32_t phys = pmm_alloc_frame();
+    uint32_t phys = pmm_alloc_zeroed_frame();
     if (!phys) return -12;
     
     vmm_map_page(page_addr, phys, PAGE_USER | PAGE_PRESENT | PAGE_WRITE);
-    memset((void *)page_addr, 0, 0x1000);
+    reclaim_track_anon(phys, page_addr);
     
-    serial_puts("[STACK] Grew stack\n");
+    rss_add(1);
     return 0;
 }
 
 
 void mmap_init(void)
 {
-    memset(process_vmas, 0, sizeof(process_vmas));
-    next_mmap_addr = USER_MMAP_START;
+    register_interrupt_handler(14, page_fault_isr);
+    reclaim_init();
     serial_puts("[MMAP] Initialized\n");
 }
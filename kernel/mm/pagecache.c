@@ -0,0 +1,266 @@
+/* Page Cache
+ * Frames holding file contents, shared by every mapping of a file page
+ *
+ * Entries are hashed by (vfs_node, page offset). mapcount tracks how many
+ * PTEs point at the frame; unmapped pages stay cached so the next fault
+ * or mmap of the same file page is a hash lookup rather than a read.
+ */
+
+#include <kernel/kernel.h>
+#include <mm/pagecache.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/slab.h>
+#include <sync/spinlock.h>
+#include <drivers/serial.h>
+#include <string.h>
+
+static page_cache_entry_t *pagecache_hash[PAGECACHE_BUCKETS];
+static kmem_cache_t *pagecache_entry_cache = NULL;
+static spinlock_t pagecache_lock = SPINLOCK_INIT;
+static spinlock_t pagecache_cache_lock = SPINLOCK_INIT;
+
+static uint32_t pagecache_pages = 0;
+static uint32_t pagecache_shrink_hand = 0;
+static uint32_t pagecache_hits = 0;
+static uint32_t pagecache_misses = 0;
+
+static inline uint32_t pagecache_bucket(vfs_node_t *node, uint32_t offset)
+{
+    return (((uint32_t)node >> 4) ^ (offset >> 12)) & (PAGECACHE_BUCKETS - 1);
+}
+
+static page_cache_entry_t *pagecache_find(vfs_node_t *node, uint32_t offset)
+{
+    page_cache_entry_t *entry = pagecache_hash[pagecache_bucket(node, offset)];
+    while (entry) {
+        if (entry->node == node && entry->offset == offset) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+/* Read one page of the file into a fresh frame, zero-filling past EOF */
+static uint32_t pagecache_fill(vfs_node_t *node, uint32_t offset)
+{
+    uint32_t phys = pmm_alloc_frame();
+    if (!phys) return 0;
+    
+    uint8_t *page = (uint8_t *)vmm_temp_map(phys);
+    if (!page) {
+        pmm_free_frame(phys);
+        return 0;
+    }
+    
+    memset(page, 0, PAGE_SIZE);
+    if (offset < node->length) {
+        uint32_t len = node->length - offset;
+        if (len > PAGE_SIZE) len = PAGE_SIZE;
+        if (node->read && node->read(node, offset, len, page) < 0) {
+            vmm_temp_unmap(page);
+            pmm_free_frame(phys);
+            return 0;
+        }
+    }
+    
+    vmm_temp_unmap(page);
+    return phys;
+}
+
+/* Return the frame caching this file page, reading it in on a miss, and
+ * take a mapping reference. Returns 0 on failure.
+ */
+uint32_t pagecache_get(vfs_node_t *node, uint32_t offset)
+{
+    if (!node) return 0;
+    offset &= ~0xFFF;
+    
+    uint32_t flags;
+    if (!pagecache_entry_cache) {
+        spinlock_irq_save(&pagecache_cache_lock, &flags);
+        if (!pagecache_entry_cache) {
+            pagecache_entry_cache = kmem_cache_create("pagecache_entry", sizeof(page_cache_entry_t), 0, NULL);
+        }
+        spinlock_irq_restore(&pagecache_cache_lock, flags);
+        if (!pagecache_entry_cache) return 0;
+    }
+    
+    spinlock_irq_save(&pagecache_lock, &flags);
+    page_cache_entry_t *entry = pagecache_find(node, offset);
+    if (entry) {
+        entry->mapcount++;
+        pagecache_hits++;
+        spinlock_irq_restore(&pagecache_lock, flags);
+        return entry->phys;
+    }
+    spinlock_irq_restore(&pagecache_lock, flags);
+    
+    /* The read may block on disk, so fill outside the lock */
+    uint32_t phys = pagecache_fill(node, offset);
+    if (!phys) return 0;
+    
+    entry = (page_cache_entry_t *)kmem_cache_alloc(pagecache_entry_cache);
+    if (!entry) {
+        pmm_free_frame(phys);
+        return 0;
+    }
+    
+    entry->node = node;
+    entry->offset = offset;
+    entry->phys = phys;
+    entry->mapcount = 1;
+    
+    spinlock_irq_save(&pagecache_lock, &flags);
+    
+    /* Another task may have read the same page while we were filling */
+    page_cache_entry_t *existing = pagecache_find(node, offset);
+    if (existing) {
+        existing->mapcount++;
+        pagecache_hits++;
+        uint32_t existing_phys = existing->phys;
+        spinlock_irq_restore(&pagecache_lock, flags);
+        kmem_cache_free(pagecache_entry_cache, entry);
+        pmm_free_frame(phys);
+        return existing_phys;
+    }
+    
+    uint32_t bucket = pagecache_bucket(node, offset);
+    entry->next = pagecache_hash[bucket];
+    pagecache_hash[bucket] = entry;
+    pagecache_pages++;
+    pagecache_misses++;
+    spinlock_irq_restore(&pagecache_lock, flags);
+    
+    return phys;
+}
+
+void pagecache_put(vfs_node_t *node, uint32_t offset)
+{
+    uint32_t flags;
+    spinlock_irq_save(&pagecache_lock, &flags);
+    page_cache_entry_t *entry = pagecache_find(node, offset & ~0xFFF);
+    if (entry && entry->mapcount > 0) {
+        entry->mapcount--;
+    }
+    spinlock_irq_restore(&pagecache_lock, flags);
+}
+
+uint32_t pagecache_lookup(vfs_node_t *node, uint32_t offset)
+{
+    uint32_t flags;
+    spinlock_irq_save(&pagecache_lock, &flags);
+    page_cache_entry_t *entry = pagecache_find(node, offset & ~0xFFF);
+    uint32_t phys = entry ? entry->phys : 0;
+    spinlock_irq_restore(&pagecache_lock, flags);
+    return phys;
+}
+
+/* Write a cached page back to the file, never extending it */
+int pagecache_writeback(vfs_node_t *node, uint32_t offset)
+{
+    offset &= ~0xFFF;
+    uint32_t phys = pagecache_lookup(node, offset);
+    if (!phys) return -1;
+    if (offset >= node->length || !node->write) return 0;
+    
+    uint32_t len = node->length - offset;
+    if (len > PAGE_SIZE) len = PAGE_SIZE;
+    
+    uint8_t *page = (uint8_t *)vmm_temp_map(phys);
+    if (!page) return -12;
+    
+    int result = node->write(node, offset, len, page);
+    vmm_temp_unmap(page);
+    
+    return result < 0 ? result : 0;
+}
+
+/* Keep cached pages coherent with data written through vfs_write */
+void pagecache_update(vfs_node_t *node, uint32_t offset, uint32_t size, const uint8_t *buffer)
+{
+    if (!pagecache_pages || size == 0) return;
+    
+    uint32_t end = offset + size;
+    for (uint32_t page_off = offset & ~0xFFF; page_off < end; page_off += PAGE_SIZE) {
+        uint32_t phys = pagecache_lookup(node, page_off);
+        if (!phys) continue;
+        
+        uint32_t from = offset > page_off ? offset - page_off : 0;
+        uint32_t to = end - page_off < PAGE_SIZE ? end - page_off : PAGE_SIZE;
+        
+        uint8_t *page = (uint8_t *)vmm_temp_map(phys);
+        if (!page) continue;
+        memcpy(page + from, buffer + (page_off + from - offset), to - from);
+        vmm_temp_unmap(page);
+    }
+}
+
+/* Drop every unmapped page of a file, e.g. after truncation or unlink.
+ * Returns how many pages stayed because they are still mapped.
+ */
+uint32_t pagecache_invalidate(vfs_node_t *node)
+{
+    uint32_t mapped = 0;
+    uint32_t flags;
+    spinlock_irq_save(&pagecache_lock, &flags);
+    
+    for (int i = 0; i < PAGECACHE_BUCKETS; i++) {
+        page_cache_entry_t **link = &pagecache_hash[i];
+        while (*link) {
+            page_cache_entry_t *entry = *link;
+            if (entry->node == node && entry->mapcount == 0) {
+                *link = entry->next;
+                pmm_free_frame(entry->phys);
+                kmem_cache_free(pagecache_entry_cache, entry);
+                pagecache_pages--;
+            } else {
+                if (entry->node == node) mapped++;
+                link = &entry->next;
+            }
+        }
+    }
+    
+    spinlock_irq_restore(&pagecache_lock, flags);
+    return mapped;
+}
+
+/* Memory pressure: free up to target unmapped pages. Cached pages are
+ * kept coherent with the file by vfs_write, so none needs writing back.
+ * The bucket hand rotates so repeated calls spread over the whole cache.
+ */
+uint32_t pagecache_shrink(uint32_t target)
+{
+    uint32_t freed = 0;
+    uint32_t flags;
+    spinlock_irq_save(&pagecache_lock, &flags);
+    
+    for (int n = 0; n < PAGECACHE_BUCKETS && freed < target; n++) {
+        page_cache_entry_t **link = &pagecache_hash[pagecache_shrink_hand];
+        pagecache_shrink_hand = (pagecache_shrink_hand + 1) & (PAGECACHE_BUCKETS - 1);
+        
+        while (*link && freed < target) {
+            page_cache_entry_t *entry = *link;
+            if (entry->mapcount == 0) {
+                *link = entry->next;
+                pmm_free_frame(entry->phys);
+                kmem_cache_free(pagecache_entry_cache, entry);
+                pagecache_pages--;
+                freed++;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+    
+    spinlock_irq_restore(&pagecache_lock, flags);
+    return freed;
+}
+
+void pagecache_get_stats(uint32_t *pages, uint32_t *hits, uint32_t *misses)
+{
+    if (pages) *pages = pagecache_pages;
+    if (hits) *hits = pagecache_hits;
+    if (misses) *misses = pagecache_misses;
+}
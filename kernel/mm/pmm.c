@@ -1,10 +1,17 @@
 /* Physical Memory Manager (PMM)
- * Manages physical page frame allocation using a bitmap
+ * Manages physical page frame allocation using a bitmap with a
+ * binary buddy allocator layered on top for O(log n) alloc/free
  */
 
 #include <kernel/kernel.h>
 #include <kernel/multiboot.h>
 #include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/reclaim.h>
+#include <sync/spinlock.h>
+#include <arch/x86/smp.h>
+#include <drivers/serial.h>
+#include <string.h>
 
 static uint32_t *pmm_bitmap = NULL;
 static uint32_t pmm_bitmap_size = 0;     
@@ -13,73 +20,688 @@ static uint32_t pmm_used_frames = 0;
 
 static uint32_t pmm_total_memory = 0;     
 
+/* Firmware memory map as reported by the bootloader */
+static pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+static uint32_t pmm_region_count = 0;
+static uint32_t pmm_kernel_end = 0;
+
 #define BITMAP_INDEX(frame)     ((frame) / 32)
 #define BITMAP_OFFSET(frame)    ((frame) % 32)
 #define BITMAP_SET(frame)       (pmm_bitmap[BITMAP_INDEX(frame)] |= (1 << BITMAP_OFFSET(frame)))
 #define BITMAP_CLEAR(frame)     (pmm_bitmap[BITMAP_INDEX(frame)] &= ~(1 << BITMAP_OFFSET(frame)))
 #define BITMAP_TEST(frame)      (pmm_bitmap[BITMAP_INDEX(frame)] & (1 << BITMAP_OFFSET(frame)))
 
+/* Buddy free lists
+ * Each free block is linked through its head frame. The links and the
+ * per-frame order byte live right after the bitmap, so a free block never
+ * has to be mapped to be put on or taken off a list. */
+typedef struct pmm_buddy_link {
+    uint32_t next;
+    uint32_t prev;
+} pmm_buddy_link_t;
+
+#define PMM_NO_FRAME        0xFFFFFFFF
+#define PMM_ORDER_FREE      0x80        /* frame heads a free block */
+
+/* boot.asm only maps the first 4 MB at KERNEL_VMA */
+#define PMM_BOOT_MAPPED_LIMIT   0x400000
+
+static pmm_buddy_link_t *pmm_buddy_links = NULL;
+static uint8_t *pmm_frame_order = NULL;
+
+/* Per-frame reference counts, stored between the buddy links and the
+ * order bytes. A frame in use has a count of at least 1; pages shared
+ * copy-on-write after fork count every page table that maps them. */
+static uint16_t *pmm_refcount = NULL;
+static uint32_t pmm_free_head[PMM_MAX_ORDER + 1];
+static uint32_t pmm_free_count[PMM_MAX_ORDER + 1];
+
+/* Frames zeroed ahead of time by the idle task, handed out by
+ * pmm_alloc_zeroed_frame() so faults and exec skip the 4K memset. They
+ * count as used; pmm_alloc_frame() drains the pool before failing. */
+static uint32_t pmm_zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t pmm_zero_pool_count = 0;
+static uint32_t pmm_zero_pool_hits = 0;
+static uint32_t pmm_zero_pool_misses = 0;
+static spinlock_t pmm_zero_pool_lock = SPINLOCK_INIT;
+
+/* Per-CPU depth of pmm_noreclaim_save() sections */
+static uint32_t pmm_noreclaim[SMP_MAX_CPUS];
+
+/* Guards the bitmap, buddy lists and refcounts. Frames are allocated and
+ * freed from page faults and interrupt handlers on any CPU, so it is
+ * always taken with interrupts off. Never held across reclaim. */
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
 extern uint32_t _kernel_end_phys;
+extern uint32_t boot_page_directory;
 
-void pmm_init(multiboot_info_t *mboot)
+static void buddy_list_add(uint32_t frame, uint32_t order)
 {
-    if (mboot->flags & MULTIBOOT_INFO_MEMORY) {
-        pmm_total_memory = (mboot->mem_upper + 1024) * 1024;
+    uint32_t head = pmm_free_head[order];
+
+    pmm_buddy_links[frame].next = head;
+    pmm_buddy_links[frame].prev = PMM_NO_FRAME;
+    if (head != PMM_NO_FRAME) {
+        pmm_buddy_links[head].prev = frame;
+    }
+    pmm_free_head[order] = frame;
+    pmm_frame_order[frame] = PMM_ORDER_FREE | order;
+    pmm_free_count[order]++;
+}
+
+static void buddy_list_remove(uint32_t frame, uint32_t order)
+{
+    uint32_t next = pmm_buddy_links[frame].next;
+    uint32_t prev = pmm_buddy_links[frame].prev;
+
+    if (prev != PMM_NO_FRAME) {
+        pmm_buddy_links[prev].next = next;
     } else {
-        pmm_total_memory = 256 * 1024 * 1024;
+        pmm_free_head[order] = next;
     }
-    
-    if (pmm_total_memory == 0) {
-        pmm_total_memory = 256 * 1024 * 1024;
+    if (next != PMM_NO_FRAME) {
+        pmm_buddy_links[next].prev = prev;
+    }
+    pmm_frame_order[frame] = 0;
+    pmm_free_count[order]--;
+}
+
+static int buddy_is_free_head(uint32_t frame, uint32_t order)
+{
+    return frame < pmm_total_frames &&
+           pmm_frame_order[frame] == (PMM_ORDER_FREE | order);
+}
+
+/* Insert a block whose frames are already clear in the bitmap,
+ * merging with its buddy for as long as the buddy is free too */
+static void buddy_free_block(uint32_t frame, uint32_t order)
+{
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1 << order);
+        if (!buddy_is_free_head(buddy, order)) {
+            break;
+        }
+        buddy_list_remove(buddy, order);
+        frame &= ~(1 << order);
+        order++;
     }
+
+    buddy_list_add(frame, order);
+}
+
+/* Find the free block containing frame, or PMM_NO_FRAME */
+static uint32_t buddy_find_block(uint32_t frame, uint32_t *order_out)
+{
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        uint32_t head = frame & ~((1 << order) - 1);
+        if (buddy_is_free_head(head, order)) {
+            *order_out = order;
+            return head;
+        }
+    }
+    return PMM_NO_FRAME;
+}
+
+/* Take a single frame out of the free block that contains it,
+ * returning the remaining halves to the free lists */
+static void buddy_carve_frame(uint32_t frame)
+{
+    uint32_t order;
+    uint32_t head = buddy_find_block(frame, &order);
+    if (head == PMM_NO_FRAME) {
+        return;
+    }
+
+    buddy_list_remove(head, order);
+
+    while (order > 0) {
+        order--;
+        uint32_t upper = head + (1 << order);
+        if (frame >= upper) {
+            buddy_list_add(head, order);
+            head = upper;
+        } else {
+            buddy_list_add(upper, order);
+        }
+    }
+}
+
+static void region_add(uint64_t base, uint64_t length, uint32_t type)
+{
+    if (length == 0 || pmm_region_count >= PMM_MAX_REGIONS) {
+        return;
+    }
+    pmm_regions[pmm_region_count].base = base;
+    pmm_regions[pmm_region_count].length = length;
+    pmm_regions[pmm_region_count].type = type;
+    pmm_region_count++;
+}
+
+/* Copy the region list out of the multiboot info while it is still
+ * intact. Without a memory map, fall back to the mem_lower/mem_upper
+ * pair, or a guess if even that is missing. */
+static void parse_memory_map(multiboot_info_t *mboot)
+{
+    if ((mboot->flags & MULTIBOOT_INFO_MEM_MAP) && mboot->mmap_length &&
+        mboot->mmap_addr + mboot->mmap_length <= PMM_BOOT_MAPPED_LIMIT) {
+        uint32_t addr = mboot->mmap_addr + KERNEL_VMA;
+        uint32_t end = addr + mboot->mmap_length;
+        while (addr + sizeof(multiboot_mmap_entry_t) <= end) {
+            multiboot_mmap_entry_t *entry = (multiboot_mmap_entry_t *)addr;
+            region_add(entry->addr, entry->len, entry->type);
+            addr += entry->size + sizeof(entry->size);
+        }
+        if (pmm_region_count) {
+            return;
+        }
+    }
+
+    if (mboot->flags & MULTIBOOT_INFO_MEMORY) {
+        region_add(0, (uint64_t)mboot->mem_lower * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+        region_add(0x100000, (uint64_t)mboot->mem_upper * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+    }
+    if (!pmm_region_count) {
+        region_add(0x100000, 255 * 1024 * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+    }
+}
+
+/* Usable frames of a region, rounded inward and clipped to what the
+ * allocator tracks; returns 0 if none. */
+static int region_frames(const pmm_region_t *region, uint32_t *first, uint32_t *last)
+{
+    if (region->type != MULTIBOOT_MEMORY_AVAILABLE || region->base >= 0x100000000ULL) {
+        return 0;
+    }
+
+    uint64_t start = (region->base + PAGE_SIZE - 1) >> 12;
+    uint64_t end = (region->base + region->length) >> 12;
+    if (end > pmm_total_frames) {
+        end = pmm_total_frames;
+    }
+    if (start >= end) {
+        return 0;
+    }
+
+    *first = (uint32_t)start;
+    *last = (uint32_t)end;
+    return 1;
+}
+
+/* Whether [base, end) is RAM the firmware calls available with no
+ * reserved entry overlapping it */
+static int range_usable(uint64_t base, uint64_t end)
+{
+    int covered = 0;
+    for (uint32_t i = 0; i < pmm_region_count; i++) {
+        const pmm_region_t *region = &pmm_regions[i];
+        uint64_t region_end = region->base + region->length;
+        if (region->type == MULTIBOOT_MEMORY_AVAILABLE) {
+            if (region->base <= base && region_end >= end) {
+                covered = 1;
+            }
+        } else if (region->base < end && region_end > base) {
+            return 0;
+        }
+    }
+    return covered;
+}
+
+static uint32_t meta_size(uint32_t frames)
+{
+    return ((frames + 31) / 32) * sizeof(uint32_t) +
+           frames * sizeof(pmm_buddy_link_t) +
+           frames * sizeof(uint16_t) +
+           frames;
+}
+
+/* Metadata for a lot of RAM outgrows the boot mapping. Map it past
+ * PMM_BOOT_MAPPED_LIMIT with page tables placed at *meta_start, still
+ * inside the boot mapping, and move *meta_start past them. The tables
+ * become part of the kernel directory for good. Returns the end of the
+ * metadata, or 0 if the memory after the boot mapping is not usable RAM.
+ */
+static uint32_t pmm_map_metadata(uint32_t *meta_start, uint32_t frames)
+{
+    uint32_t tables = 0;
+    uint32_t end;
+    for (;;) {
+        end = ALIGN_UP(*meta_start + tables * PAGE_SIZE + meta_size(frames), PAGE_SIZE);
+        uint32_t needed = (end - PMM_BOOT_MAPPED_LIMIT + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+        if (needed <= tables) break;
+        tables = needed;
+    }
+
+    if (*meta_start + tables * PAGE_SIZE > PMM_BOOT_MAPPED_LIMIT ||
+        !range_usable(PMM_BOOT_MAPPED_LIMIT, end)) {
+        return 0;
+    }
+
+    uint32_t *pd = (uint32_t *)((uint32_t)&boot_page_directory + KERNEL_VMA);
+    for (uint32_t t = 0; t < tables; t++) {
+        uint32_t table_phys = *meta_start + t * PAGE_SIZE;
+        uint32_t *table = (uint32_t *)(table_phys + KERNEL_VMA);
+        uint32_t base = PMM_BOOT_MAPPED_LIMIT + t * LARGE_PAGE_SIZE;
+        for (uint32_t i = 0; i < 1024; i++) {
+            uint32_t phys = base + i * PAGE_SIZE;
+            table[i] = phys < end ? (phys | PAGE_PRESENT | PAGE_WRITE) : 0;
+        }
+        pd[(KERNEL_VMA + base) >> 22] = table_phys | PAGE_PRESENT | PAGE_WRITE;
+    }
+    __asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+
+    *meta_start += tables * PAGE_SIZE;
+    return end;
+}
+
+void pmm_init(multiboot_info_t *mboot)
+{
+    parse_memory_map(mboot);
+
+    /* Track frames up to the end of the highest usable region; holes in
+     * between stay marked used forever */
+    uint64_t top = 0;
+    for (uint32_t i = 0; i < pmm_region_count; i++) {
+        uint64_t end = pmm_regions[i].base + pmm_regions[i].length;
+        if (pmm_regions[i].type == MULTIBOOT_MEMORY_AVAILABLE && end > top) {
+            top = end;
+        }
+    }
+    if (top > 0x100000000ULL) {
+        top = 0x100000000ULL;
+    }
+    pmm_total_frames = (uint32_t)(top >> 12);
     
-    pmm_total_frames = pmm_total_memory / PAGE_SIZE;
+    /* Bitmap, buddy links, refcounts and order bytes follow the kernel
+     * image, mapped beyond the boot mapping if they do not fit in it.
+     * Only if that memory is unusable is RAM left untracked. */
+    uint32_t meta_start = (uint32_t)&_kernel_end_phys;
+    uint32_t kernel_end = ALIGN_UP(meta_start + meta_size(pmm_total_frames), PAGE_SIZE);
+    if (kernel_end > PMM_BOOT_MAPPED_LIMIT) {
+        kernel_end = pmm_map_metadata(&meta_start, pmm_total_frames);
+    }
+    uint32_t reported_frames = pmm_total_frames;
+    while (!kernel_end) {
+        kernel_end = ALIGN_UP(meta_start + meta_size(pmm_total_frames), PAGE_SIZE);
+        if (kernel_end > PMM_BOOT_MAPPED_LIMIT && pmm_total_frames > 1024) {
+            pmm_total_frames -= 1024;
+            kernel_end = 0;
+        }
+    }
+    if (pmm_total_frames < reported_frames) {
+        serial_printf("[PMM] Metadata does not fit, ignoring %u frames (%u MB) above %u MB\n",
+                      reported_frames - pmm_total_frames,
+                      (reported_frames - pmm_total_frames) / 256,
+                      pmm_total_frames / 256);
+    }
     pmm_bitmap_size = (pmm_total_frames + 31) / 32;
-    pmm_bitmap = (uint32_t *)((uint32_t)&_kernel_end_phys + KERNEL_VMA);
+    pmm_kernel_end = kernel_end;
+    
+    pmm_bitmap = (uint32_t *)(meta_start + KERNEL_VMA);
+    pmm_buddy_links = (pmm_buddy_link_t *)(pmm_bitmap + pmm_bitmap_size);
+    pmm_refcount = (uint16_t *)(pmm_buddy_links + pmm_total_frames);
+    pmm_frame_order = (uint8_t *)(pmm_refcount + pmm_total_frames);
+
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        pmm_free_head[order] = PMM_NO_FRAME;
+        pmm_free_count[order] = 0;
+    }
+    for (uint32_t frame = 0; frame < pmm_total_frames; frame++) {
+        pmm_frame_order[frame] = 0;
+        pmm_refcount[frame] = 1;
+    }
     
     for (uint32_t i = 0; i < pmm_bitmap_size; i++) {
         pmm_bitmap[i] = 0xFFFFFFFF;
     }
     pmm_used_frames = pmm_total_frames;
     
-    for (uint32_t frame = 256; frame < pmm_total_frames; frame++) {
-        BITMAP_CLEAR(frame);
-        pmm_used_frames--;
+    /* Free usable RAM only, never the first megabyte (BIOS data, option
+     * ROMs) even where the map calls it available */
+    pmm_total_memory = 0;
+    for (uint32_t i = 0; i < pmm_region_count; i++) {
+        uint32_t first, last;
+        if (!region_frames(&pmm_regions[i], &first, &last)) {
+            continue;
+        }
+        pmm_total_memory += (last - first) * PAGE_SIZE;
+        if (first < 256) {
+            first = 256;
+        }
+        for (uint32_t frame = first; frame < last; frame++) {
+            if (BITMAP_TEST(frame)) {
+                BITMAP_CLEAR(frame);
+                pmm_refcount[frame] = 0;
+                pmm_used_frames--;
+            }
+        }
     }
     
-    uint32_t kernel_end = (uint32_t)&_kernel_end_phys + (pmm_bitmap_size * sizeof(uint32_t));
-    kernel_end = ALIGN_UP(kernel_end, PAGE_SIZE);
+    /* Some firmware reports overlapping entries; reserved wins */
+    for (uint32_t i = 0; i < pmm_region_count; i++) {
+        const pmm_region_t *region = &pmm_regions[i];
+        if (region->type == MULTIBOOT_MEMORY_AVAILABLE || region->base >= pmm_total_frames * (uint64_t)PAGE_SIZE) {
+            continue;
+        }
+        uint64_t end = (region->base + region->length + PAGE_SIZE - 1) >> 12;
+        if (end > pmm_total_frames) {
+            end = pmm_total_frames;
+        }
+        for (uint32_t frame = (uint32_t)(region->base >> 12); frame < end; frame++) {
+            if (!BITMAP_TEST(frame)) {
+                BITMAP_SET(frame);
+                pmm_refcount[frame] = 1;
+                pmm_used_frames++;
+            }
+        }
+    }
     
     for (uint32_t addr = 0x100000; addr < kernel_end; addr += PAGE_SIZE) {
         pmm_mark_used(addr);
     }
+
+    for (uint32_t frame = 0; frame < pmm_total_frames; frame++) {
+        if (!BITMAP_TEST(frame)) {
+            buddy_free_block(frame, 0);
+        }
+    }
 }
 
-uint32_t pmm_alloc_frame(void)
+/* Pop a block of the given order that ends at or below limit (a frame
+ * number), splitting a larger block if needed. Unconstrained callers pass
+ * pmm_total_frames so the head of each list always qualifies. */
+static uint32_t buddy_take(uint32_t order, uint32_t limit)
+{
+    for (uint32_t k = order; k <= PMM_MAX_ORDER; k++) {
+        uint32_t frame = pmm_free_head[k];
+        while (frame != PMM_NO_FRAME && frame + (1 << k) > limit) {
+            frame = pmm_buddy_links[frame].next;
+        }
+        if (frame == PMM_NO_FRAME) {
+            continue;
+        }
+
+        buddy_list_remove(frame, k);
+        while (k > order) {
+            k--;
+            buddy_list_add(frame + (1 << k), k);
+        }
+        return frame;
+    }
+    return PMM_NO_FRAME;
+}
+
+static void mark_range_used(uint32_t frame, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        BITMAP_SET(frame + i);
+        pmm_refcount[frame + i] = 1;
+    }
+    pmm_used_frames += count;
+}
+
+/* Caller holds pmm_lock */
+static void free_frames_locked(uint32_t frame, uint32_t order)
+{
+    uint32_t count = 1 << order;
+
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (BITMAP_TEST(frame + i)) {
+            used++;
+        }
+    }
+
+    if (used == count) {
+        for (uint32_t i = 0; i < count; i++) {
+            BITMAP_CLEAR(frame + i);
+            pmm_refcount[frame + i] = 0;
+        }
+        pmm_used_frames -= count;
+        buddy_free_block(frame, order);
+        return;
+    }
+
+    /* Partially freed already - release the remaining frames one by one */
+    for (uint32_t i = 0; i < count; i++) {
+        if (BITMAP_TEST(frame + i)) {
+            BITMAP_CLEAR(frame + i);
+            pmm_refcount[frame + i] = 0;
+            pmm_used_frames--;
+            buddy_free_block(frame + i, 0);
+        }
+    }
+}
+
+/* Release [first, first + count) frames as the largest aligned blocks;
+ * caller holds pmm_lock */
+static void free_range(uint32_t first, uint32_t count)
+{
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER &&
+               !((first + i) & ((2 << order) - 1)) &&
+               i + (2 << order) <= count) {
+            order++;
+        }
+        free_frames_locked(first + i, order);
+        i += 1 << order;
+    }
+}
+
+uint32_t pmm_alloc_frames(uint32_t order)
 {
-    if (pmm_used_frames >= pmm_total_frames) {
+    if (order > PMM_MAX_ORDER) {
         return 0;
     }
     
-    for (uint32_t i = 0; i < pmm_bitmap_size; i++) {
-        if (pmm_bitmap[i] != 0xFFFFFFFF) {
-            for (uint32_t j = 0; j < 32; j++) {
-                uint32_t frame = i * 32 + j;
-                if (frame >= pmm_total_frames) {
-                    return 0;
-                }
-                if (!BITMAP_TEST(frame)) {
-                    BITMAP_SET(frame);
-                    pmm_used_frames++;
-                    return frame * PAGE_SIZE;
-                }
-            }
+    uint32_t flags;
+    spinlock_irq_save(&pmm_lock, &flags);
+
+    uint32_t frame = buddy_take(order, pmm_total_frames);
+    if (frame == PMM_NO_FRAME) {
+        spinlock_irq_restore(&pmm_lock, flags);
+        return 0;
+    }
+
+    mark_range_used(frame, 1 << order);
+    spinlock_irq_restore(&pmm_lock, flags);
+    return frame * PAGE_SIZE;
+}
+
+uint32_t pmm_alloc_contiguous(uint32_t count, uint32_t align, uint32_t zone)
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    uint32_t order = 0;
+    while ((1U << order) < count || ((uint32_t)PAGE_SIZE << order) < align) {
+        order++;
+        if (order > PMM_MAX_ORDER) {
+            return 0;
         }
     }
     
+    uint32_t limit = pmm_total_frames;
+    if (zone == PMM_ZONE_DMA && limit > PMM_ZONE_DMA_LIMIT / PAGE_SIZE) {
+        limit = PMM_ZONE_DMA_LIMIT / PAGE_SIZE;
+    }
+
+    uint32_t flags;
+    spinlock_irq_save(&pmm_lock, &flags);
+
+    uint32_t frame = buddy_take(order, limit);
+    if (frame == PMM_NO_FRAME) {
+        spinlock_irq_restore(&pmm_lock, flags);
+        return 0;
+    }
+
+    mark_range_used(frame, 1 << order);
+
+    /* Hand back the tail of the power-of-two block */
+    if (count < (1U << order)) {
+        free_range(frame + count, (1 << order) - count);
+    }
+
+    spinlock_irq_restore(&pmm_lock, flags);
+    return frame * PAGE_SIZE;
+}
+
+void pmm_free_contiguous(uint32_t addr, uint32_t count)
+{
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frame + count > pmm_total_frames) {
+        return;
+    }
+
+    uint32_t flags;
+    spinlock_irq_save(&pmm_lock, &flags);
+    free_range(frame, count);
+    spinlock_irq_restore(&pmm_lock, flags);
+}
+
+static uint32_t zero_pool_take(void)
+{
+    uint32_t flags;
+    uint32_t phys = 0;
+    spinlock_irq_save(&pmm_zero_pool_lock, &flags);
+    if (pmm_zero_pool_count > 0) {
+        phys = pmm_zero_pool[--pmm_zero_pool_count];
+    }
+    spinlock_irq_restore(&pmm_zero_pool_lock, flags);
+    return phys;
+}
+
+/* Start a section whose frame allocations must not reclaim. The heap and
+ * slab allocators grow through here while their own state is half
+ * updated; reclaim freeing cache pages back into them at that point
+ * would deadlock on their lock or corrupt their lists. Interrupts stay
+ * off until pmm_noreclaim_restore() so the section keeps its CPU. */
+uint32_t pmm_noreclaim_save(void)
+{
+    uint32_t flags;
+    __asm__ volatile("pushfl\n popl %0\n cli" : "=r"(flags) : : "memory");
+    pmm_noreclaim[smp_cpu_id()]++;
+    return flags;
+}
+
+void pmm_noreclaim_restore(uint32_t flags)
+{
+    pmm_noreclaim[smp_cpu_id()]--;
+    __asm__ volatile("pushl %0\n popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/* Single frames are what reclaim can produce, so only this path falls
+ * back to it once the buddy lists and the zero pool are both empty */
+uint32_t pmm_alloc_frame(void)
+{
+    uint32_t phys = pmm_alloc_frames(0);
+    if (!phys) {
+        phys = zero_pool_take();
+    }
+    if (!phys && !pmm_noreclaim[smp_cpu_id()] && reclaim_pages(RECLAIM_BATCH)) {
+        phys = pmm_alloc_frames(0);
+    }
+    return phys;
+}
+
+static int zero_frame(uint32_t phys)
+{
+    void *page = vmm_temp_map(phys);
+    if (!page) {
+        return -1;
+    }
+    memset(page, 0, PAGE_SIZE);
+    vmm_temp_unmap(page);
     return 0;
 }
 
+/* A frame guaranteed to read as zeros: from the pool when possible,
+ * otherwise allocated and cleared here. Returns 0 when out of memory. */
+uint32_t pmm_alloc_zeroed_frame(void)
+{
+    uint32_t phys = zero_pool_take();
+    if (phys) {
+        pmm_zero_pool_hits++;
+        return phys;
+    }
+
+    pmm_zero_pool_misses++;
+    phys = pmm_alloc_frame();
+    if (!phys) {
+        return 0;
+    }
+    if (zero_frame(phys) != 0) {
+        pmm_free_frame(phys);
+        return 0;
+    }
+    return phys;
+}
+
+/* Top the pool up by at most max frames; returns how many were added.
+ * Called from the idle task, so the memset costs nobody any latency.
+ * Stops short of the last PMM_ZERO_POOL_RESERVE free frames. */
+uint32_t pmm_zero_pool_refill(uint32_t max)
+{
+    uint32_t added = 0;
+
+    while (added < max && pmm_zero_pool_count < PMM_ZERO_POOL_SIZE) {
+        if (pmm_total_frames - pmm_used_frames <= PMM_ZERO_POOL_RESERVE) {
+            break;
+        }
+
+        uint32_t phys = pmm_alloc_frames(0);
+        if (!phys) {
+            break;
+        }
+
+        int zeroed = zero_frame(phys) == 0;
+
+        uint32_t flags;
+        spinlock_irq_save(&pmm_zero_pool_lock, &flags);
+        if (zeroed && pmm_zero_pool_count < PMM_ZERO_POOL_SIZE) {
+            pmm_zero_pool[pmm_zero_pool_count++] = phys;
+            phys = 0;
+        } else {
+            pmm_free_frame(phys);
+        }
+        spinlock_irq_restore(&pmm_zero_pool_lock, flags);
+
+        if (phys) {
+            break;
+        }
+        added++;
+    }
+
+    return added;
+}
+
+void pmm_get_zero_pool_stats(uint32_t *pooled, uint32_t *hits, uint32_t *misses)
+{
+    if (pooled) *pooled = pmm_zero_pool_count;
+    if (hits) *hits = pmm_zero_pool_hits;
+    if (misses) *misses = pmm_zero_pool_misses;
+}
+
+void pmm_free_frames(uint32_t addr, uint32_t order)
+{
+    uint32_t frame = addr / PAGE_SIZE;
+    uint32_t count = 1 << order;
+
+    if (order > PMM_MAX_ORDER || (frame & (count - 1)) ||
+        frame + count > pmm_total_frames) {
+        return;
+    }
+
+    uint32_t flags;
+    spinlock_irq_save(&pmm_lock, &flags);
+    free_frames_locked(frame, order);
+    spinlock_irq_restore(&pmm_lock, flags);
+}
+
+/* Drop one reference; the frame is only released with the last one */
 void pmm_free_frame(uint32_t addr)
 {
     uint32_t frame = addr / PAGE_SIZE;
@@ -87,10 +709,19 @@ void pmm_free_frame(uint32_t addr)
         return;
     }
     
-    if (BITMAP_TEST(frame)) {
+    uint32_t flags;
+    spinlock_irq_save(&pmm_lock, &flags);
+
+    if (pmm_refcount[frame] > 1) {
+        pmm_refcount[frame]--;
+    } else if (BITMAP_TEST(frame)) {
         BITMAP_CLEAR(frame);
+        pmm_refcount[frame] = 0;
         pmm_used_frames--;
+        buddy_free_block(frame, 0);
     }
+
+    spinlock_irq_restore(&pmm_lock, flags);
 }
 
 void pmm_mark_used(uint32_t addr)
@@ -100,10 +731,43 @@ void pmm_mark_used(uint32_t addr)
         return;
     }
     
+    uint32_t flags;
+    spinlock_irq_save(&pmm_lock, &flags);
+
     if (!BITMAP_TEST(frame)) {
+        buddy_carve_frame(frame);
         BITMAP_SET(frame);
+        pmm_refcount[frame] = 1;
         pmm_used_frames++;
     }
+
+    spinlock_irq_restore(&pmm_lock, flags);
+}
+
+void pmm_frame_ref(uint32_t addr)
+{
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frame >= pmm_total_frames) {
+        return;
+    }
+
+    uint32_t flags;
+    spinlock_irq_save(&pmm_lock, &flags);
+
+    if (BITMAP_TEST(frame) && pmm_refcount[frame] < 0xFFFF) {
+        pmm_refcount[frame]++;
+    }
+
+    spinlock_irq_restore(&pmm_lock, flags);
+}
+
+uint32_t pmm_frame_refcount(uint32_t addr)
+{
+    uint32_t frame = addr / PAGE_SIZE;
+    if (frame >= pmm_total_frames) {
+        return 0;
+    }
+    return pmm_refcount[frame];
 }
 
 uint32_t pmm_get_total_memory(void)
@@ -111,12 +775,39 @@ uint32_t pmm_get_total_memory(void)
     return pmm_total_memory;
 }
 
+/* Holes and reserved ranges are never free, so count from usable RAM */
 uint32_t pmm_get_used_memory(void)
 {
-    return pmm_used_frames * PAGE_SIZE;
+    return pmm_total_memory - pmm_get_free_memory();
 }
 
 uint32_t pmm_get_free_memory(void)
 {
     return (pmm_total_frames - pmm_used_frames) * PAGE_SIZE;
 }
+
+uint32_t pmm_get_regions(const pmm_region_t **regions)
+{
+    if (regions) *regions = pmm_regions;
+    return pmm_region_count;
+}
+
+/* End of the kernel image plus allocator metadata (physical) */
+uint32_t pmm_get_kernel_end(void)
+{
+    return pmm_kernel_end;
+}
+
+/* Number of frames the allocator tracks, holes included */
+uint32_t pmm_get_frame_count(void)
+{
+    return pmm_total_frames;
+}
+
+uint32_t pmm_get_free_blocks(uint32_t order)
+{
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+    return pmm_free_count[order];
+}
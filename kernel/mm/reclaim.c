@@ -0,0 +1,170 @@
+/* Reclaim
+ * Frees frames when the allocator runs dry
+ *
+ * Cheapest first: unmapped page cache pages are simply dropped. After
+ * that, if a swap area is enabled, a clock hand sweeps the frame table
+ * looking for private anonymous pages; a page whose accessed bit is set
+ * gets a second chance, one that was not touched since the last sweep is
+ * written to swap and its frame freed. The disk write is done between
+ * steps of the clock, with its lock dropped.
+ *
+ * The clock needs to find the PTE of a frame. Anonymous faults record
+ * the owning pid and virtual address per frame; an entry is only
+ * trusted after checking that this PTE still maps the frame, so stale
+ * entries for freed or forked frames are harmless.
+ */
+
+#include <kernel/kernel.h>
+#include <mm/reclaim.h>
+#include <mm/swap.h>
+#include <mm/pagecache.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/heap.h>
+#include <kernel/process.h>
+#include <drivers/serial.h>
+#include <sync/spinlock.h>
+#include <string.h>
+
+/* Per-frame owner: virtual page in the top 20 bits, pid in the low 12 */
+#define RMAP_PID_MASK   0xFFF
+
+static uint32_t *reclaim_rmap = NULL;
+static uint32_t reclaim_frames = 0;
+static uint32_t clock_hand = 0;
+static volatile int reclaiming = 0;
+static spinlock_t reclaim_lock = SPINLOCK_INIT;
+
+static uint32_t reclaim_runs = 0;
+static uint32_t reclaim_cache_freed = 0;
+static uint32_t reclaim_swapped = 0;
+
+void reclaim_init(void)
+{
+    reclaim_frames = pmm_get_frame_count();
+    reclaim_rmap = (uint32_t *)kmalloc(reclaim_frames * sizeof(uint32_t));
+    if (!reclaim_rmap) {
+        reclaim_frames = 0;
+        serial_puts("[RECLAIM] No memory for reverse map, swap disabled\n");
+        return;
+    }
+    memset(reclaim_rmap, 0, reclaim_frames * sizeof(uint32_t));
+}
+
+/* Remember which page of which process a private anonymous frame backs */
+void reclaim_track_anon(uint32_t phys, uint32_t virt)
+{
+    uint32_t frame = phys / PAGE_SIZE;
+    process_t *proc = process_current();
+    if (!reclaim_rmap || frame >= reclaim_frames || !proc) return;
+    
+    reclaim_rmap[frame] = (virt & ~0xFFF) | (proc->pid & RMAP_PID_MASK);
+}
+
+static process_t *rmap_owner(uint32_t entry)
+{
+    uint32_t index = 0;
+    process_t *proc;
+    while ((proc = process_iterate(&index)) != NULL) {
+        if ((proc->pid & RMAP_PID_MASK) == (entry & RMAP_PID_MASK) && proc->page_directory) {
+            return proc;
+        }
+    }
+    return NULL;
+}
+
+/* One step of the clock. Returns 1 if the frame was swapped out */
+static int clock_visit(uint32_t frame)
+{
+    uint32_t entry = reclaim_rmap[frame];
+    if (!entry) return 0;
+    
+    uint32_t phys = frame * PAGE_SIZE;
+    process_t *proc = rmap_owner(entry);
+    if (!proc || pmm_frame_refcount(phys) != 1) {
+        reclaim_rmap[frame] = 0;
+        return 0;
+    }
+    
+    uint32_t virt = entry & ~0xFFF;
+    uint32_t pte = vmm_lookup_pte(proc->page_directory, virt);
+    if (!(pte & PAGE_PRESENT) || (pte & 0xFFFFF000) != phys ||
+        !(pte & PAGE_USER) || (pte & (PAGE_SHARED | PAGE_SHARED_ANON | PAGE_COW))) {
+        reclaim_rmap[frame] = 0;
+        return 0;
+    }
+    
+    if (pte & PAGE_ACCESSED) {
+        vmm_set_pte(proc->page_directory, virt, pte & ~PAGE_ACCESSED);
+        return 0;
+    }
+    
+    int slot = swap_out(phys);
+    if (slot < 0) return 0;
+    
+    vmm_set_pte(proc->page_directory, virt,
+                ((uint32_t)slot << 12) | PAGE_SWAPPED | (pte & (PAGE_USER | PAGE_WRITE)));
+    reclaim_rmap[frame] = 0;
+    if (proc->rss_pages > 0) proc->rss_pages--;
+    pmm_free_frame(phys);
+    return 1;
+}
+
+/* Sweep at most two full turns: the first may only clear accessed bits */
+static uint32_t reclaim_anon(uint32_t target)
+{
+    if (!reclaim_rmap || !swap_is_enabled()) return 0;
+    
+    /* A page left over from a failed write blocks swap_out */
+    if (swap_writeback() != 0) return 0;
+    
+    uint32_t freed = 0;
+    uint32_t flags;
+    spinlock_irq_save(&reclaim_lock, &flags);
+    
+    for (uint32_t scanned = 0; scanned < reclaim_frames * 2 && freed < target; scanned++) {
+        int swapped = clock_visit(clock_hand);
+        if (++clock_hand >= reclaim_frames) {
+            clock_hand = 0;
+        }
+        if (swapped) {
+            freed++;
+            spinlock_irq_restore(&reclaim_lock, flags);
+            int result = swap_writeback();
+            spinlock_irq_save(&reclaim_lock, &flags);
+            if (result != 0) break;
+        }
+    }
+    
+    spinlock_irq_restore(&reclaim_lock, flags);
+    return freed;
+}
+
+/* Free up to target frames. Called by the allocator when it comes up
+ * empty; allocations made while reclaiming do not recurse, and only one
+ * CPU reclaims at a time.
+ */
+uint32_t reclaim_pages(uint32_t target)
+{
+    if (__sync_lock_test_and_set(&reclaiming, 1)) return 0;
+    reclaim_runs++;
+    
+    uint32_t freed = pagecache_shrink(target);
+    reclaim_cache_freed += freed;
+    
+    if (freed < target) {
+        uint32_t swapped = reclaim_anon(target - freed);
+        reclaim_swapped += swapped;
+        freed += swapped;
+    }
+    
+    __sync_lock_release(&reclaiming);
+    return freed;
+}
+
+void reclaim_get_stats(uint32_t *runs, uint32_t *cache_freed, uint32_t *swapped)
+{
+    if (runs) *runs = reclaim_runs;
+    if (cache_freed) *cache_freed = reclaim_cache_freed;
+    if (swapped) *swapped = reclaim_swapped;
+}
@@ -0,0 +1,296 @@
+/* Slab Allocator
+ * Object caches for fixed-size kernel objects, layered on kmalloc
+ *
+ * Each slab is one kmalloc'd block holding a header followed by equally
+ * sized slots. A slot is a hidden word plus the object itself: while the
+ * object is allocated the word points back at its slab, while it is free
+ * the word links the slab's free list. Keeping the link outside the object
+ * means constructed state survives a free/alloc cycle, so the constructor
+ * only runs once per slot when the slab is created.
+ */
+
+#include <kernel/kernel.h>
+#include <mm/slab.h>
+#include <mm/heap.h>
+#include <mm/pmm.h>
+#include <drivers/serial.h>
+#include <string.h>
+
+#define SLAB_MAGIC      0x51AB51AB
+#define SLOT_HDR_SIZE   sizeof(uint32_t)
+
+typedef struct kmem_slab {
+    uint32_t magic;
+    kmem_cache_t *cache;
+    struct kmem_slab *next;
+    struct kmem_slab *prev;
+    uint32_t *free;
+    uint32_t inuse;
+} kmem_slab_t;
+
+static kmem_cache_t kmem_caches[KMEM_MAX_CACHES];
+static spinlock_t kmem_caches_lock = SPINLOCK_INIT;
+
+static void slab_list_add(kmem_slab_t **head, kmem_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(kmem_slab_t **head, kmem_slab_t *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/* Offset of the first slot, chosen so that the object (not the hidden
+ * word in front of it) lands on the cache alignment.
+ */
+static uint32_t slab_first_slot(kmem_cache_t *cache)
+{
+    return ALIGN_UP(sizeof(kmem_slab_t) + SLOT_HDR_SIZE, cache->align) - SLOT_HDR_SIZE;
+}
+
+/* Called with cache->lock held. Reclaim frees page cache entries into
+ * their slab cache, so the heap must not reclaim on our behalf here.
+ */
+static kmem_slab_t *slab_grow(kmem_cache_t *cache)
+{
+    uint8_t *mem;
+    uint32_t flags = pmm_noreclaim_save();
+    if (cache->align > 8) {
+        mem = (uint8_t *)kmalloc_aligned(cache->slab_bytes, cache->align);
+    } else {
+        mem = (uint8_t *)kmalloc(cache->slab_bytes);
+    }
+    pmm_noreclaim_restore(flags);
+    if (!mem) {
+        return NULL;
+    }
+    
+    kmem_slab_t *slab = (kmem_slab_t *)mem;
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->free = NULL;
+    slab->inuse = 0;
+    
+    uint8_t *first = mem + slab_first_slot(cache);
+    for (uint32_t i = cache->objs_per_slab; i > 0; i--) {
+        uint8_t *slot = first + (i - 1) * cache->stride;
+        if (cache->ctor) {
+            cache->ctor(slot + SLOT_HDR_SIZE);
+        }
+        *(uint32_t **)slot = slab->free;
+        slab->free = (uint32_t *)slot;
+    }
+    
+    cache->num_slabs++;
+    return slab;
+}
+
+static void slab_release(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+    slab->magic = 0;
+    cache->num_slabs--;
+    if (cache->align > 8) {
+        kfree_aligned(slab);
+    } else {
+        kfree(slab);
+    }
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor)
+{
+    if (size == 0) {
+        return NULL;
+    }
+    
+    if (align < sizeof(uint32_t)) {
+        align = sizeof(uint32_t);
+    }
+    if (align & (align - 1)) {
+        return NULL;
+    }
+    
+    uint32_t flags;
+    spinlock_irq_save(&kmem_caches_lock, &flags);
+    kmem_cache_t *cache = NULL;
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!kmem_caches[i].in_use) {
+            cache = &kmem_caches[i];
+            break;
+        }
+    }
+    if (!cache) {
+        spinlock_irq_restore(&kmem_caches_lock, flags);
+        serial_puts("[SLAB] No free cache descriptors\n");
+        return NULL;
+    }
+    
+    memset(cache, 0, sizeof(kmem_cache_t));
+    strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+    cache->name[KMEM_NAME_LEN - 1] = '\0';
+    cache->obj_size = size;
+    cache->align = align;
+    cache->stride = ALIGN_UP(size + SLOT_HDR_SIZE, align);
+    cache->ctor = ctor;
+    spinlock_init(&cache->lock);
+    
+    uint32_t first = slab_first_slot(cache);
+    uint32_t objs = 0;
+    if (KMEM_SLAB_SIZE > first) {
+        objs = (KMEM_SLAB_SIZE - first) / cache->stride;
+    }
+    if (objs < KMEM_MIN_OBJS) {
+        objs = KMEM_MIN_OBJS;
+    }
+    cache->objs_per_slab = objs;
+    cache->slab_bytes = first + objs * cache->stride;
+    cache->in_use = 1;
+    spinlock_irq_restore(&kmem_caches_lock, flags);
+    
+    serial_puts("[SLAB] Created cache ");
+    serial_puts(cache->name);
+    serial_puts("\n");
+    
+    return cache;
+}
+
+int kmem_cache_destroy(kmem_cache_t *cache)
+{
+    if (!cache || !cache->in_use) {
+        return -22;
+    }
+    
+    uint32_t flags;
+    spinlock_irq_save(&cache->lock, &flags);
+    
+    if (cache->active_objs > 0) {
+        spinlock_irq_restore(&cache->lock, flags);
+        return -16;
+    }
+    
+    while (cache->empty) {
+        kmem_slab_t *slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        slab_release(cache, slab);
+    }
+    cache->in_use = 0;
+    
+    spinlock_irq_restore(&cache->lock, flags);
+    return 0;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    if (!cache) {
+        return NULL;
+    }
+    
+    uint32_t flags;
+    spinlock_irq_save(&cache->lock, &flags);
+    
+    kmem_slab_t *slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->num_empty--;
+        } else {
+            slab = slab_grow(cache);
+            if (!slab) {
+                spinlock_irq_restore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    uint32_t *slot = slab->free;
+    slab->free = *(uint32_t **)slot;
+    *(kmem_slab_t **)slot = slab;
+    slab->inuse++;
+    
+    if (slab->inuse == cache->objs_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    
+    cache->active_objs++;
+    cache->total_allocs++;
+    
+    spinlock_irq_restore(&cache->lock, flags);
+    return (uint8_t *)slot + SLOT_HDR_SIZE;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (!cache || !obj) {
+        return;
+    }
+    
+    uint32_t *slot = (uint32_t *)((uint8_t *)obj - SLOT_HDR_SIZE);
+    kmem_slab_t *slab = *(kmem_slab_t **)slot;
+    
+    if (!slab || slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        serial_puts("[SLAB] WARNING: Bad or double free in cache ");
+        serial_puts(cache->name);
+        serial_puts("\n");
+        return;
+    }
+    
+    uint32_t flags;
+    spinlock_irq_save(&cache->lock, &flags);
+    
+    if (slab->inuse == cache->objs_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    *(uint32_t **)slot = slab->free;
+    slab->free = slot;
+    slab->inuse--;
+    
+    cache->active_objs--;
+    cache->total_frees++;
+    
+    /* Keep one empty slab around to absorb alloc/free churn, hand the
+     * rest back to the heap.
+     */
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->num_empty > 0) {
+            slab_release(cache, slab);
+        } else {
+            slab_list_add(&cache->empty, slab);
+            cache->num_empty++;
+        }
+    }
+    
+    spinlock_irq_restore(&cache->lock, flags);
+}
+
+kmem_cache_t *kmem_cache_get(int index)
+{
+    if (index < 0 || index >= KMEM_MAX_CACHES) {
+        return NULL;
+    }
+    if (!kmem_caches[index].in_use) {
+        return NULL;
+    }
+    return &kmem_caches[index];
+}
@@ -0,0 +1,295 @@
+/* Swap
+ * Anonymous pages paged out to a sector range of an ATA disk
+ *
+ * The area is split into page-sized slots. Each slot has a use count so
+ * a swapped-out page can be inherited by fork like any other private
+ * page; the slot is released when the last PTE naming it goes away.
+ *
+ * Reclaim runs with interrupts off, far too long to also sit through a
+ * PIO transfer. swap_out only copies the page into a bounce buffer and
+ * claims a slot; the caller writes it with swap_writeback once its locks
+ * are dropped. Until then swap_in serves that slot from the buffer.
+ */
+
+#include <kernel/kernel.h>
+#include <mm/swap.h>
+#include <mm/reclaim.h>
+#include <mm/mmap.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/heap.h>
+#include <kernel/process.h>
+#include <drivers/ata.h>
+#include <drivers/serial.h>
+#include <sync/spinlock.h>
+#include <string.h>
+
+static int swap_drive = -1;
+static uint32_t swap_start_lba = 0;
+static uint32_t swap_slots = 0;
+static uint32_t swap_free_slots = 0;
+static uint32_t swap_hand = 0;
+static uint8_t *swap_map = NULL;        /* use count per slot */
+static uint8_t *swap_bounce = NULL;     /* page waiting to be written */
+static int swap_bounce_slot = -1;       /* its slot, -1 when empty */
+static spinlock_t swap_lock = SPINLOCK_INIT;
+
+static uint32_t swap_ins = 0;
+static uint32_t swap_outs = 0;
+
+int swap_enable(int drive, uint32_t start_lba, uint32_t sectors)
+{
+    if (swap_map) return -16;
+    
+    ata_drive_t *disk = ata_get_drive(drive);
+    if (!disk || disk->type != ATA_TYPE_ATA) return -19;
+    if (start_lba >= disk->sectors || sectors > disk->sectors - start_lba) return -22;
+    
+    uint32_t slots = sectors / SWAP_SECTORS_PER_SLOT;
+    if (slots > SWAP_MAX_SLOTS) slots = SWAP_MAX_SLOTS;
+    if (slots == 0) return -22;
+    
+    uint8_t *map = (uint8_t *)kmalloc(slots);
+    if (!map) return -12;
+    memset(map, 0, slots);
+    
+    uint8_t *bounce = (uint8_t *)kmalloc(PAGE_SIZE);
+    if (!bounce) {
+        kfree(map);
+        return -12;
+    }
+    
+    uint32_t flags;
+    spinlock_irq_save(&swap_lock, &flags);
+    swap_map = map;
+    swap_bounce = bounce;
+    swap_bounce_slot = -1;
+    swap_drive = drive;
+    swap_start_lba = start_lba;
+    swap_slots = slots;
+    swap_free_slots = slots;
+    swap_hand = 0;
+    spinlock_irq_restore(&swap_lock, flags);
+    
+    serial_puts("[SWAP] Enabled swap area\n");
+    return 0;
+}
+
+int swap_is_enabled(void)
+{
+    return swap_map != NULL;
+}
+
+static inline uint32_t slot_lba(uint32_t slot)
+{
+    return swap_start_lba + slot * SWAP_SECTORS_PER_SLOT;
+}
+
+static int slot_read(uint32_t slot, uint32_t phys)
+{
+    void *page = vmm_temp_map(phys);
+    if (!page) return -12;
+    
+    int result = ata_read_sectors(swap_drive, slot_lba(slot), SWAP_SECTORS_PER_SLOT, page);
+    vmm_temp_unmap(page);
+    
+    return result == SWAP_SECTORS_PER_SLOT ? 0 : -5;
+}
+
+/* Copy between a frame and the bounce buffer; caller holds swap_lock */
+static int bounce_copy(uint32_t phys, int to_bounce)
+{
+    uint8_t *page = (uint8_t *)vmm_temp_map(phys);
+    if (!page) return -12;
+    
+    if (to_bounce) {
+        memcpy(swap_bounce, page, PAGE_SIZE);
+    } else {
+        memcpy(page, swap_bounce, PAGE_SIZE);
+    }
+    vmm_temp_unmap(page);
+    return 0;
+}
+
+/* Drop one use of a slot; caller holds swap_lock */
+static void slot_put(uint32_t slot)
+{
+    /* A saturated count can no longer be trusted; leak the slot */
+    if (slot >= swap_slots || swap_map[slot] == 0 || swap_map[slot] == 0xFF) return;
+    
+    if (--swap_map[slot] == 0) {
+        swap_free_slots++;
+    }
+}
+
+/* Give a frame's contents a slot; the frame may be freed on return.
+ * Returns the slot, or -1 if the area is full or missing, or the
+ * previous page still waits for swap_writeback.
+ */
+int swap_out(uint32_t phys)
+{
+    uint32_t flags;
+    spinlock_irq_save(&swap_lock, &flags);
+    
+    if (!swap_map || swap_free_slots == 0 || swap_bounce_slot >= 0) {
+        spinlock_irq_restore(&swap_lock, flags);
+        return -1;
+    }
+    
+    uint32_t slot = swap_hand;
+    while (swap_map[slot]) {
+        slot = (slot + 1) % swap_slots;
+    }
+    
+    if (bounce_copy(phys, 1) != 0) {
+        spinlock_irq_restore(&swap_lock, flags);
+        return -1;
+    }
+    
+    swap_hand = (slot + 1) % swap_slots;
+    swap_map[slot] = 1;
+    swap_free_slots--;
+    swap_bounce_slot = (int)slot;
+    swap_outs++;
+    spinlock_irq_restore(&swap_lock, flags);
+    return (int)slot;
+}
+
+/* Write the page swap_out buffered to disk. Called with interrupts
+ * enabled and no locks held. On error the page stays in the buffer,
+ * still readable by swap_in, and the write is retried next time.
+ */
+int swap_writeback(void)
+{
+    int slot = swap_bounce_slot;
+    if (slot < 0) return 0;
+    
+    int result = ata_write_sectors(swap_drive, slot_lba((uint32_t)slot),
+                                   SWAP_SECTORS_PER_SLOT, swap_bounce);
+    if (result != SWAP_SECTORS_PER_SLOT) {
+        serial_puts("[SWAP] Write failed, page kept in memory\n");
+        return -5;
+    }
+    
+    uint32_t flags;
+    spinlock_irq_save(&swap_lock, &flags);
+    swap_bounce_slot = -1;
+    spinlock_irq_restore(&swap_lock, flags);
+    return 0;
+}
+
+/* Page fault path: bring a swapped-out page of the current address space
+ * back. Returns -1 if virt is not swapped out, so the caller can go on
+ * with its other fault handling.
+ */
+int swap_in(uint32_t virt)
+{
+    uint32_t page = virt & ~0xFFF;
+    uint32_t pte = vmm_get_pte(page);
+    if ((pte & (PAGE_PRESENT | PAGE_SWAPPED)) != PAGE_SWAPPED) return -1;
+    
+    uint32_t phys = pmm_alloc_frame();
+    if (!phys) return -12;
+    
+    uint32_t flags;
+    spinlock_irq_save(&swap_lock, &flags);
+    
+    /* The allocation may have reclaimed; look again */
+    pte = vmm_get_pte(page);
+    if ((pte & (PAGE_PRESENT | PAGE_SWAPPED)) != PAGE_SWAPPED) {
+        spinlock_irq_restore(&swap_lock, flags);
+        pmm_free_frame(phys);
+        return (pte & PAGE_PRESENT) ? 0 : -1;
+    }
+    
+    uint32_t slot = SWAP_PTE_SLOT(pte);
+    if (slot >= swap_slots) {
+        spinlock_irq_restore(&swap_lock, flags);
+        pmm_free_frame(phys);
+        return -5;
+    }
+    
+    int result;
+    if ((int)slot == swap_bounce_slot) {
+        result = bounce_copy(phys, 0);
+    } else {
+        /* Read with the lock dropped, holding a use so the slot is not
+         * handed out again meanwhile.
+         */
+        int pinned = swap_map[slot] < 0xFE;
+        if (pinned) swap_map[slot]++;
+        spinlock_irq_restore(&swap_lock, flags);
+        
+        result = slot_read(slot, phys);
+        
+        spinlock_irq_save(&swap_lock, &flags);
+        if (pinned) slot_put(slot);
+        
+        uint32_t now = vmm_get_pte(page);
+        if (now != pte) {
+            spinlock_irq_restore(&swap_lock, flags);
+            pmm_free_frame(phys);
+            return (now & PAGE_PRESENT) ? 0 : -1;
+        }
+    }
+    if (result != 0) {
+        spinlock_irq_restore(&swap_lock, flags);
+        pmm_free_frame(phys);
+        return -5;
+    }
+    
+    /* The VMA has the final say, in case mprotect ran meanwhile */
+    uint32_t page_flags = PAGE_USER | PAGE_PRESENT | (pte & PAGE_WRITE);
+    vma_t *vma = vma_find(page);
+    if (vma) {
+        page_flags &= ~PAGE_WRITE;
+        if (vma->prot & PROT_WRITE) page_flags |= PAGE_WRITE;
+    }
+    vmm_map_page(page, phys, page_flags);
+    
+    slot_put(slot);
+    swap_ins++;
+    spinlock_irq_restore(&swap_lock, flags);
+    
+    reclaim_track_anon(phys, page);
+    process_t *proc = process_current();
+    if (proc) proc->rss_pages++;
+    return 0;
+}
+
+/* fork copied a swapped-out PTE */
+void swap_entry_dup(uint32_t pte)
+{
+    uint32_t slot = SWAP_PTE_SLOT(pte);
+    uint32_t flags;
+    spinlock_irq_save(&swap_lock, &flags);
+    if (slot < swap_slots && swap_map[slot] && swap_map[slot] < 0xFF) {
+        swap_map[slot]++;
+    }
+    spinlock_irq_restore(&swap_lock, flags);
+}
+
+/* A swapped-out PTE was unmapped or its address space torn down */
+void swap_entry_free(uint32_t pte)
+{
+    uint32_t flags;
+    spinlock_irq_save(&swap_lock, &flags);
+    slot_put(SWAP_PTE_SLOT(pte));
+    spinlock_irq_restore(&swap_lock, flags);
+}
+
+void swap_get_stats(uint32_t *total, uint32_t *free, uint32_t *ins, uint32_t *outs)
+{
+    if (total) *total = swap_slots;
+    if (free) *free = swap_free_slots;
+    if (ins) *ins = swap_ins;
+    if (outs) *outs = swap_outs;
+}
+
+int swap_get_device(int *drive, uint32_t *start_lba)
+{
+    if (!swap_map) return -1;
+    if (drive) *drive = swap_drive;
+    if (start_lba) *start_lba = swap_start_lba;
+    return 0;
+}
@@ -0,0 +1,225 @@
+/* Vmalloc
+ * Virtually contiguous kernel allocations for large buffers
+ *
+ * Each area gets its own page-aligned slot between VMALLOC_START and
+ * VMALLOC_END, backed by individually allocated frames, so big buffers
+ * neither carve up the small-object heap nor need physically contiguous
+ * memory. Areas are kept on an address-ordered list and placed first
+ * fit; every area is followed by an unmapped guard page so running off
+ * the end faults instead of corrupting the neighbour.
+ *
+ * vmap_phys places memory the caller already owns, such as a DMA
+ * buffer, in the same region; vfree then drops only the mapping.
+ */
+
+#include <kernel/kernel.h>
+#include <mm/vmalloc.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/heap.h>
+#include <drivers/serial.h>
+#include <sync/spinlock.h>
+
+typedef struct vm_area {
+    uint32_t addr;
+    uint32_t size;              /* mapped bytes, guard page excluded */
+    uint32_t user_size;
+    uint16_t tag;               /* heap accounting tag of the owner */
+    uint8_t borrowed;           /* frames belong to the vmap_phys caller */
+    struct vm_area *next;
+} vm_area_t;
+
+static vm_area_t *vm_areas = NULL;
+static uint32_t vm_area_count = 0;
+static uint32_t vm_bytes = 0;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+
+/* Find a gap for size bytes plus a guard page and link area into it;
+ * caller holds vmalloc_lock
+ */
+static int area_insert(vm_area_t *area, uint32_t size)
+{
+    uint32_t addr = VMALLOC_START;
+    vm_area_t **link = &vm_areas;
+    
+    while (*link) {
+        if ((*link)->addr - addr >= size + PAGE_SIZE) break;
+        addr = (*link)->addr + (*link)->size + PAGE_SIZE;
+        link = &(*link)->next;
+    }
+    
+    if (addr >= VMALLOC_END || VMALLOC_END - addr < size + PAGE_SIZE) return -1;
+    
+    area->addr = addr;
+    area->size = size;
+    area->next = *link;
+    *link = area;
+    vm_area_count++;
+    vm_bytes += size;
+    return 0;
+}
+
+/* Unlink the area starting at addr; caller holds vmalloc_lock */
+static vm_area_t *area_remove(uint32_t addr)
+{
+    vm_area_t **link = &vm_areas;
+    while (*link && (*link)->addr != addr) {
+        link = &(*link)->next;
+    }
+    
+    vm_area_t *area = *link;
+    if (area) {
+        *link = area->next;
+        vm_area_count--;
+        vm_bytes -= area->size;
+    }
+    return area;
+}
+
+/* Frames of an area handed back per batch, after their PTEs are gone */
+#define AREA_RELEASE_BATCH  64
+
+/* Unmap an area and free its frames. Each batch is unmapped and shot
+ * down on every CPU before its frames go back to the PMM, so nothing
+ * can write through a stale mapping into a reused frame.
+ */
+static void area_release(uint32_t addr, uint32_t size)
+{
+    uint32_t frames[AREA_RELEASE_BATCH];
+    
+    for (uint32_t start = 0; start < size; start += AREA_RELEASE_BATCH * PAGE_SIZE) {
+        uint32_t end = size - start > AREA_RELEASE_BATCH * PAGE_SIZE ?
+                       start + AREA_RELEASE_BATCH * PAGE_SIZE : size;
+        
+        uint32_t count = 0;
+        for (uint32_t off = start; off < end; off += PAGE_SIZE) {
+            frames[count++] = vmm_get_physical(addr + off) & ~0xFFF;
+        }
+        
+        vmm_unmap_range(addr + start, end - start);
+        
+        for (uint32_t i = 0; i < count; i++) {
+            if (frames[i]) pmm_free_frame(frames[i]);
+        }
+    }
+}
+
+void *vmalloc_tagged(uint32_t size, uint16_t tag)
+{
+    if (size == 0 || size > VMALLOC_END - VMALLOC_START) return NULL;
+    
+    vm_area_t *area = (vm_area_t *)kmalloc(sizeof(vm_area_t));
+    if (!area) return NULL;
+    
+    uint32_t mapped = ALIGN_UP(size, PAGE_SIZE);
+    uint32_t flags;
+    spinlock_irq_save(&vmalloc_lock, &flags);
+    int result = area_insert(area, mapped);
+    spinlock_irq_restore(&vmalloc_lock, flags);
+    
+    if (result != 0) {
+        serial_puts("[VMALLOC] Address space exhausted\n");
+        kfree(area);
+        return NULL;
+    }
+    area->user_size = size;
+    area->tag = tag;
+    area->borrowed = 0;
+    
+    /* Frames come pre-zeroed; a partial failure is rolled back */
+    if (vmm_alloc_range(area->addr, mapped, PAGE_KERNEL) != 0) {
+        area_release(area->addr, mapped);
+        spinlock_irq_save(&vmalloc_lock, &flags);
+        area_remove(area->addr);
+        spinlock_irq_restore(&vmalloc_lock, flags);
+        kfree(area);
+        return NULL;
+    }
+    
+    return (void *)area->addr;
+}
+
+void *vmalloc(uint32_t size)
+{
+    return vmalloc_tagged(size, 0);
+}
+
+/* Map size bytes of physical memory starting at the page-aligned phys */
+void *vmap_phys(uint32_t phys, uint32_t size, uint32_t page_flags)
+{
+    if (size == 0 || (phys & 0xFFF) || size > VMALLOC_END - VMALLOC_START) return NULL;
+    
+    vm_area_t *area = (vm_area_t *)kmalloc(sizeof(vm_area_t));
+    if (!area) return NULL;
+    
+    uint32_t mapped = ALIGN_UP(size, PAGE_SIZE);
+    uint32_t flags;
+    spinlock_irq_save(&vmalloc_lock, &flags);
+    int result = area_insert(area, mapped);
+    spinlock_irq_restore(&vmalloc_lock, flags);
+    
+    if (result != 0) {
+        serial_puts("[VMALLOC] Address space exhausted\n");
+        kfree(area);
+        return NULL;
+    }
+    area->user_size = size;
+    area->tag = 0;
+    area->borrowed = 1;
+    
+    if (vmm_map_range(area->addr, phys, mapped, page_flags) != 0) {
+        vmm_unmap_range(area->addr, mapped);
+        spinlock_irq_save(&vmalloc_lock, &flags);
+        area_remove(area->addr);
+        spinlock_irq_restore(&vmalloc_lock, flags);
+        kfree(area);
+        return NULL;
+    }
+    
+    return (void *)area->addr;
+}
+
+void vfree(void *ptr)
+{
+    if (!ptr) return;
+    
+    uint32_t flags;
+    spinlock_irq_save(&vmalloc_lock, &flags);
+    vm_area_t *area = area_remove((uint32_t)ptr);
+    spinlock_irq_restore(&vmalloc_lock, flags);
+    
+    if (!area) {
+        serial_puts("[VMALLOC] WARNING: vfree of unknown address\n");
+        return;
+    }
+    
+    if (area->borrowed) {
+        vmm_unmap_range(area->addr, area->size);
+    } else {
+        area_release(area->addr, area->size);
+    }
+    kfree(area);
+}
+
+/* Size originally requested for the area at ptr, or 0 if there is none */
+uint32_t vmalloc_size(void *ptr, uint16_t *tag)
+{
+    uint32_t size = 0;
+    uint32_t flags;
+    spinlock_irq_save(&vmalloc_lock, &flags);
+    for (vm_area_t *area = vm_areas; area; area = area->next) {
+        if (area->addr == (uint32_t)ptr) {
+            size = area->user_size;
+            if (tag) *tag = area->tag;
+            break;
+        }
+    }
+    spinlock_irq_restore(&vmalloc_lock, flags);
+    return size;
+}
+
+void vmalloc_get_stats(uint32_t *areas, uint32_t *bytes)
+{
+    if (areas) *areas = vm_area_count;
+    if (bytes) *bytes = vm_bytes;
+}
@@ -5,42 +5,149 @@
 #include <kernel/kernel.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
-
-static uint32_t *current_page_dir = NULL;
+#include <mm/swap.h>
+#include <sync/spinlock.h>
+#include <kernel/scheduler.h>
+#include <arch/x86/smp.h>
 
 #define RECURSIVE_PD_INDEX      1023
 #define RECURSIVE_PD_ADDR       0xFFFFF000
 #define RECURSIVE_PT_BASE       0xFFC00000
 
+/* PD entries below KERNEL_VMA belong to user space */
+#define USER_PD_ENTRIES         768
+
+#define CR4_PSE                 (1 << 4)
+#define CR4_PGE                 (1 << 7)
+
+#define LARGE_PAGE_MASK         (LARGE_PAGE_SIZE - 1)
+
 #define GET_PT(pd_index)        ((uint32_t *)(RECURSIVE_PT_BASE + ((pd_index) * PAGE_SIZE)))
 #define GET_PD()                ((uint32_t *)RECURSIVE_PD_ADDR)
 
 extern uint32_t boot_page_directory;
 
+/* The boot directory doubles as the kernel's master directory: every
+ * kernel page table is installed here first and shared by reference
+ * with each process directory.
+ */
+static uint32_t kernel_page_dir = 0;
+static uint32_t *kernel_pd = NULL;
+
+/* Physical address of the directory in each CPU's CR3 */
+static uint32_t current_cr3[SMP_MAX_CPUS];
+static uint32_t cr3_switches = 0;
+
+/* PAGE_GLOBAL once CR4.PGE is on, 0 before; or'ed into kernel PTEs */
+static uint32_t kernel_global_flag = 0;
+
+/* Set once CR4.PSE is on and 4MB PDEs may be installed */
+static int pse_enabled = 0;
+
+static uint32_t temp_slot_map[SMP_MAX_CPUS];
+static spinlock_t temp_lock = SPINLOCK_INIT;
+
 void vmm_init(void)
 {
-    current_page_dir = &boot_page_directory;
+    kernel_page_dir = (uint32_t)&boot_page_directory;
+    kernel_pd = (uint32_t *)(kernel_page_dir + KERNEL_VMA);
+    kernel_pd[RECURSIVE_PD_INDEX] = kernel_page_dir | PAGE_PRESENT | PAGE_WRITE;
+    /* APs start on the kernel directory too, see smp_init */
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        current_cr3[cpu] = kernel_page_dir;
+    }
     
-    uint32_t *pd = (uint32_t *)((uint32_t)current_page_dir + KERNEL_VMA);
-    pd[RECURSIVE_PD_INDEX] = (uint32_t)current_page_dir | PAGE_PRESENT | PAGE_WRITE;
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (edx & (1 << 3)) {
+        uint32_t cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PSE) : "memory");
+        pse_enabled = 1;
+    }
     
     vmm_flush_tlb();
 }
 
-void vmm_map_page(uint32_t virt, uint32_t phys, uint32_t flags)
+/* A kernel PDE created after a directory was made only exists in the
+ * master directory until it is first needed; pull it in on demand.
+ * Returns nonzero if the PDE is present afterwards.
+ */
+static int vmm_pde_present(uint32_t pd_index)
+{
+    uint32_t *pd = GET_PD();
+    if (pd[pd_index] & PAGE_PRESENT) return 1;
+    if (pd_index < USER_PD_ENTRIES || pd_index == RECURSIVE_PD_INDEX) return 0;
+    if (!(kernel_pd[pd_index] & PAGE_PRESENT)) return 0;
+    
+    pd[pd_index] = kernel_pd[pd_index];
+    vmm_invlpg((uint32_t)GET_PT(pd_index));
+    return 1;
+}
+
+/* Page fault hook: returns nonzero only if a missing kernel PDE was
+ * pulled in, i.e. the faulting access can simply be retried.
+ */
+int vmm_sync_kernel_pde(uint32_t virt)
 {
     uint32_t pd_index = (virt >> 22) & 0x3FF;
-    uint32_t pt_index = (virt >> 12) & 0x3FF;
+    if (GET_PD()[pd_index] & PAGE_PRESENT) return 0;
+    return vmm_pde_present(pd_index);
+}
+
+/* Replace a 4MB PDE by a page table mapping the same 1024 frames, so a
+ * single 4K page inside it can be changed. Returns 0 or -12. Only the
+ * current and master directories see the new table, so kernel large
+ * pages are meant for mappings that are never remapped piecewise.
+ */
+static int vmm_split_large(uint32_t pd_index)
+{
+    uint32_t *pd = GET_PD();
+    uint32_t pde = pd[pd_index];
+    
+    uint32_t pt_phys = pmm_alloc_frame();
+    if (!pt_phys) return -12;
     
+    uint32_t *pt = (uint32_t *)vmm_temp_map(pt_phys);
+    if (!pt) {
+        pmm_free_frame(pt_phys);
+        return -12;
+    }
+    
+    uint32_t base = pde & ~LARGE_PAGE_MASK;
+    uint32_t flags = pde & (0xFFF & ~PAGE_SIZE_4M);
+    for (int i = 0; i < 1024; i++) {
+        pt[i] = (base + i * PAGE_SIZE) | flags;
+    }
+    vmm_temp_unmap(pt);
+    
+    pd[pd_index] = pt_phys | (pde & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER));
+    if (pd_index >= USER_PD_ENTRIES) {
+        kernel_pd[pd_index] = pd[pd_index];
+    }
+    
+    uint32_t virt = pd_index << 22;
+    vmm_flush_range(virt, virt + LARGE_PAGE_SIZE);
+    return 0;
+}
+
+/* Page table covering pd_index, created or split out of a 4MB page if
+ * needed. Returns NULL when out of memory.
+ */
+static uint32_t *vmm_get_table(uint32_t pd_index, uint32_t flags)
+{
     uint32_t *pd = GET_PD();
     
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
+    if (!vmm_pde_present(pd_index)) {
         uint32_t pt_phys = pmm_alloc_frame();
         if (!pt_phys) {
-            return;
+            return NULL;
         }
         
         pd[pd_index] = pt_phys | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+        if (pd_index >= USER_PD_ENTRIES) {
+            kernel_pd[pd_index] = pd[pd_index];
+        }
         
         vmm_invlpg((uint32_t)GET_PT(pd_index));
         
@@ -48,14 +155,73 @@ void vmm_map_page(uint32_t virt, uint32_t phys, uint32_t flags)
         for (int i = 0; i < 1024; i++) {
             pt[i] = 0;
         }
+    } else if ((pd[pd_index] & PAGE_SIZE_4M) && vmm_split_large(pd_index) < 0) {
+        return NULL;
     } else if (flags & PAGE_USER) {
         pd[pd_index] |= PAGE_USER;
     }
     
-    uint32_t *pt = GET_PT(pd_index);
+    return GET_PT(pd_index);
+}
+
+/* Install a PTE without invalidating the TLB entry. Only safe when the
+ * page was not present before, or when the caller flushes afterwards.
+ */
+void vmm_map_page_noflush(uint32_t virt, uint32_t phys, uint32_t flags)
+{
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+    
+    uint32_t *pt = vmm_get_table(pd_index, flags);
+    if (!pt) {
+        return;
+    }
+    
+    if (pd_index >= USER_PD_ENTRIES) {
+        flags |= kernel_global_flag;
+    }
+    
     pt[pt_index] = (phys & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT;
+}
+
+void vmm_map_page(uint32_t virt, uint32_t phys, uint32_t flags)
+{
+    vmm_map_page_noflush(virt, phys, flags);
+    vmm_invlpg(virt);
+}
+
+/* Map one 4MB page with a single PDE. Both addresses must be 4MB
+ * aligned and the PDE unused; returns -1 otherwise, or without PSE, so
+ * callers can fall back to 4K pages.
+ */
+int vmm_map_large(uint32_t virt, uint32_t phys, uint32_t flags)
+{
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    
+    if (!pse_enabled || (virt & LARGE_PAGE_MASK) || (phys & LARGE_PAGE_MASK)) {
+        return -1;
+    }
+    if (pd_index == RECURSIVE_PD_INDEX || vmm_pde_present(pd_index)) {
+        return -1;
+    }
+    
+    if (pd_index >= USER_PD_ENTRIES) {
+        flags |= kernel_global_flag;
+    }
+    
+    uint32_t *pd = GET_PD();
+    pd[pd_index] = phys | (flags & 0xFFF) | PAGE_SIZE_4M | PAGE_PRESENT;
+    if (pd_index >= USER_PD_ENTRIES) {
+        kernel_pd[pd_index] = pd[pd_index];
+    }
     
     vmm_invlpg(virt);
+    return 0;
+}
+
+int vmm_large_pages_enabled(void)
+{
+    return pse_enabled;
 }
 
 void vmm_unmap_page(uint32_t virt)
@@ -63,28 +229,175 @@ void vmm_unmap_page(uint32_t virt)
     uint32_t pd_index = (virt >> 22) & 0x3FF;
     uint32_t pt_index = (virt >> 12) & 0x3FF;
     
-    uint32_t *pd = GET_PD();
+    if (!vmm_pde_present(pd_index)) {
+        return;
+    }
     
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
+    if ((GET_PD()[pd_index] & PAGE_SIZE_4M) && vmm_split_large(pd_index) < 0) {
         return;
     }
     
     uint32_t *pt = GET_PT(pd_index);
     pt[pt_index] = 0;
     
-    vmm_invlpg(virt);
+    vmm_flush_range(virt, virt + PAGE_SIZE);
+}
+
+/* Shared walker for vmm_map_range and vmm_alloc_range: the page table is
+ * looked up once per 4MB chunk and the PTEs filled in a tight loop. With
+ * alloc set each page not yet mapped gets a zeroed frame and mapped pages
+ * are left alone; otherwise pages map the contiguous range at phys.
+ * Only replaced PTEs can be cached, so the TLB is flushed once at the end
+ * and only if there were any.
+ */
+static int vmm_fill_range(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags, int alloc)
+{
+    uint32_t start = virt & ~0xFFF;
+    uint32_t end = ALIGN_UP(virt + size, PAGE_SIZE);
+    uint32_t addr = start;
+    int replaced = 0;
+    int result = 0;
+    
+    phys &= ~0xFFF;
+    
+    while (addr < end && result == 0) {
+        uint32_t pd_index = (addr >> 22) & 0x3FF;
+        uint32_t *pt = vmm_get_table(pd_index, flags);
+        if (!pt) {
+            result = -12;
+            break;
+        }
+        
+        uint32_t pte_flags = (flags & 0xFFF) | PAGE_PRESENT;
+        if (pd_index >= USER_PD_ENTRIES) {
+            pte_flags |= kernel_global_flag;
+        }
+        
+        uint32_t chunk_end = (addr & ~LARGE_PAGE_MASK) + LARGE_PAGE_SIZE;
+        if (chunk_end > end || chunk_end == 0) {
+            chunk_end = end;
+        }
+        
+        for (; addr < chunk_end; addr += PAGE_SIZE) {
+            uint32_t *pte = &pt[(addr >> 12) & 0x3FF];
+            uint32_t frame;
+            
+            if (alloc) {
+                if (*pte & PAGE_PRESENT) continue;
+                frame = pmm_alloc_zeroed_frame();
+                if (!frame) {
+                    result = -12;
+                    break;
+                }
+            } else {
+                frame = phys + (addr - start);
+                if (*pte & PAGE_PRESENT) replaced = 1;
+            }
+            
+            *pte = frame | pte_flags;
+        }
+    }
+    
+    if (replaced) {
+        vmm_flush_range(start, end);
+    }
+    return result;
+}
+
+/* Map [virt, virt + size) onto physically contiguous memory at phys.
+ * Returns 0, or -12 if a page table could not be allocated.
+ */
+int vmm_map_range(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags)
+{
+    return vmm_fill_range(virt, phys, size, flags, 0);
+}
+
+/* Back every unmapped page of [virt, virt + size) with a zeroed frame.
+ * Returns -12 when memory runs out; pages mapped so far stay mapped, so
+ * calling again later picks up where this left off.
+ */
+int vmm_alloc_range(uint32_t virt, uint32_t size, uint32_t flags)
+{
+    return vmm_fill_range(virt, 0, size, flags, 1);
+}
+
+/* Create the kernel page tables covering [virt, virt + size) without
+ * mapping anything, so every directory made afterwards already has them.
+ */
+int vmm_alloc_tables(uint32_t virt, uint32_t size)
+{
+    uint32_t first = virt >> 22;
+    uint32_t last = (virt + size - 1) >> 22;
+    
+    for (uint32_t pd_index = first; pd_index <= last; pd_index++) {
+        if (!vmm_get_table(pd_index, PAGE_KERNEL)) {
+            return -12;
+        }
+    }
+    return 0;
+}
+
+/* Clear every PTE in [virt, virt + size) with one TLB flush at the end.
+ * Frames are not freed. 4MB pages wholly inside the range are dropped
+ * as a unit; partly covered ones are split first.
+ */
+void vmm_unmap_range(uint32_t virt, uint32_t size)
+{
+    uint32_t start = virt & ~0xFFF;
+    uint32_t end = ALIGN_UP(virt + size, PAGE_SIZE);
+    uint32_t addr = start;
+    uint32_t *pd = GET_PD();
+    
+    while (addr < end) {
+        uint32_t pd_index = (addr >> 22) & 0x3FF;
+        uint32_t chunk_end = (addr & ~LARGE_PAGE_MASK) + LARGE_PAGE_SIZE;
+        if (chunk_end > end || chunk_end == 0) {
+            chunk_end = end;
+        }
+        
+        if (!vmm_pde_present(pd_index)) {
+            addr = chunk_end;
+            continue;
+        }
+        
+        if (pd[pd_index] & PAGE_SIZE_4M) {
+            if (!(addr & LARGE_PAGE_MASK) && chunk_end - addr == LARGE_PAGE_SIZE) {
+                pd[pd_index] = 0;
+                if (pd_index >= USER_PD_ENTRIES) {
+                    kernel_pd[pd_index] = 0;
+                }
+                addr = chunk_end;
+                continue;
+            }
+            if (vmm_split_large(pd_index) < 0) {
+                addr = chunk_end;
+                continue;
+            }
+        }
+        
+        uint32_t *pt = GET_PT(pd_index);
+        for (; addr < chunk_end; addr += PAGE_SIZE) {
+            pt[(addr >> 12) & 0x3FF] = 0;
+        }
+    }
+    
+    vmm_flush_range(start, end);
 }
 
 uint32_t vmm_get_physical(uint32_t virt)
 {
     uint32_t pd_index = (virt >> 22) & 0x3FF;
     uint32_t pt_index = (virt >> 12) & 0x3FF;
-    uint32_t *pd = GET_PD();
     
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
+    if (!vmm_pde_present(pd_index)) {
         return 0;
     }
     
+    uint32_t pde = GET_PD()[pd_index];
+    if (pde & PAGE_SIZE_4M) {
+        return (pde & ~LARGE_PAGE_MASK) | (virt & LARGE_PAGE_MASK);
+    }
+    
     uint32_t *pt = GET_PT(pd_index);
     
     if (!(pt[pt_index] & PAGE_PRESENT)) {
@@ -94,17 +407,37 @@ uint32_t vmm_get_physical(uint32_t virt)
     return (pt[pt_index] & 0xFFFFF000) | (virt & 0xFFF);
 }
 
-int vmm_is_mapped(uint32_t virt)
+uint32_t vmm_get_flags(uint32_t virt)
 {
     uint32_t pd_index = (virt >> 22) & 0x3FF;
     uint32_t pt_index = (virt >> 12) & 0x3FF;
     
-    uint32_t *pd = GET_PD();
+    if (!vmm_pde_present(pd_index)) {
+        return 0;
+    }
+    
+    uint32_t pde = GET_PD()[pd_index];
+    if (pde & PAGE_SIZE_4M) {
+        return pde & 0xFFF;
+    }
+    
+    uint32_t *pt = GET_PT(pd_index);
+    return pt[pt_index] & 0xFFF;
+}
+
+int vmm_is_mapped(uint32_t virt)
+{
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
     
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
+    if (!vmm_pde_present(pd_index)) {
         return 0;
     }
     
+    if (GET_PD()[pd_index] & PAGE_SIZE_4M) {
+        return 1;
+    }
+    
     uint32_t *pt = GET_PT(pd_index);
     return (pt[pt_index] & PAGE_PRESENT) != 0;
 }
@@ -123,7 +456,370 @@ void vmm_invlpg(uint32_t virt)
     __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
 }
 
+/* Flush global entries too: toggling CR4.PGE drops the whole TLB */
+void vmm_flush_tlb_all(void)
+{
+    if (!kernel_global_flag) {
+        vmm_flush_tlb();
+        return;
+    }
+    
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+/* Invalidate [start, end) on this CPU. Short ranges use invlpg per
+ * page; past VMM_FLUSH_RANGE_MAX pages refilling the TLB is cheaper than
+ * that many invlpgs, so fall back to a full flush. A CR3 reload leaves
+ * global kernel entries alone, so kernel ranges need the PGE toggle
+ * instead.
+ */
+void vmm_flush_range_local(uint32_t start, uint32_t end)
+{
+    start &= ~0xFFF;
+    if (end <= start) return;
+    
+    if ((end - start) / PAGE_SIZE <= VMM_FLUSH_RANGE_MAX) {
+        for (uint32_t addr = start; addr < end && addr >= start; addr += PAGE_SIZE) {
+            vmm_invlpg(addr);
+        }
+    } else if (end > KERNEL_VMA) {
+        vmm_flush_tlb_all();
+    } else {
+        vmm_flush_tlb();
+    }
+}
+
+/* Invalidate [start, end) here and, for kernel ranges, on every other
+ * CPU, returning once none of them can still use the old translations.
+ */
+void vmm_flush_range(uint32_t start, uint32_t end)
+{
+    vmm_flush_range_local(start, end);
+    if (end > KERNEL_VMA) {
+        smp_tlb_shootdown(start & ~0xFFF, end);
+    }
+}
+
+/* Mark every existing kernel mapping global and turn on CR4.PGE, so
+ * kernel translations survive address-space switches. The recursive
+ * slot is per-directory and must never be global.
+ */
+void vmm_enable_global_pages(void)
+{
+    if (kernel_global_flag) return;
+    
+    for (int i = USER_PD_ENTRIES; i < RECURSIVE_PD_INDEX; i++) {
+        if (!(kernel_pd[i] & PAGE_PRESENT)) continue;
+        
+        if (kernel_pd[i] & PAGE_SIZE_4M) {
+            kernel_pd[i] |= PAGE_GLOBAL;
+            continue;
+        }
+        
+        if (!vmm_pde_present(i)) continue;
+        
+        uint32_t *pt = GET_PT(i);
+        for (int j = 0; j < 1024; j++) {
+            if (pt[j] & PAGE_PRESENT) {
+                pt[j] |= PAGE_GLOBAL;
+            }
+        }
+    }
+    
+    kernel_global_flag = PAGE_GLOBAL;
+    
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PGE) : "memory");
+}
+
 uint32_t *vmm_get_current_pagedir(void)
 {
     return GET_PD();
 }
+
+/* Short-lived kernel mapping of an arbitrary frame, for copying into or
+ * out of memory that has no permanent kernel address.
+ *
+ * Each CPU has its own slots and the caller stays on its CPU until it
+ * unmaps, so the local invlpg on map and unmap is the only TLB flush a
+ * slot ever needs.
+ */
+void *vmm_temp_map(uint32_t phys)
+{
+    uint32_t flags;
+    spinlock_irq_save(&temp_lock, &flags);
+    
+    uint32_t cpu = smp_cpu_id();
+    for (int slot = 0; slot < VMM_TEMP_SLOTS; slot++) {
+        if (!(temp_slot_map[cpu] & (1U << slot))) {
+            temp_slot_map[cpu] |= (1U << slot);
+            task_migrate_disable();
+            spinlock_irq_restore(&temp_lock, flags);
+            
+            uint32_t virt = VMM_TEMP_BASE + (cpu * VMM_TEMP_SLOTS + slot) * PAGE_SIZE;
+            vmm_map_page(virt, phys & ~0xFFF, PAGE_KERNEL);
+            return (void *)virt;
+        }
+    }
+    
+    spinlock_irq_restore(&temp_lock, flags);
+    return NULL;
+}
+
+void vmm_temp_unmap(void *virt)
+{
+    uint32_t addr = (uint32_t)virt & ~0xFFF;
+    if (addr < VMM_TEMP_BASE ||
+        addr >= VMM_TEMP_BASE + SMP_MAX_CPUS * VMM_TEMP_SLOTS * PAGE_SIZE) {
+        return;
+    }
+    
+    /* Only this CPU ever used the slot, so no shootdown */
+    uint32_t index = (addr - VMM_TEMP_BASE) / PAGE_SIZE;
+    GET_PT((addr >> 22) & 0x3FF)[(addr >> 12) & 0x3FF] = 0;
+    vmm_invlpg(addr);
+    
+    uint32_t flags;
+    spinlock_irq_save(&temp_lock, &flags);
+    temp_slot_map[index / VMM_TEMP_SLOTS] &= ~(1U << (index % VMM_TEMP_SLOTS));
+    task_migrate_enable();
+    spinlock_irq_restore(&temp_lock, flags);
+}
+
+/* New address space with an empty user half and the shared kernel half.
+ * Returns the physical address of the directory, or 0.
+ */
+uint32_t vmm_create_directory(void)
+{
+    uint32_t pd_phys = pmm_alloc_frame();
+    if (!pd_phys) return 0;
+    
+    uint32_t *new_pd = (uint32_t *)vmm_temp_map(pd_phys);
+    if (!new_pd) {
+        pmm_free_frame(pd_phys);
+        return 0;
+    }
+    
+    for (int i = 0; i < USER_PD_ENTRIES; i++) {
+        new_pd[i] = 0;
+    }
+    for (int i = USER_PD_ENTRIES; i < RECURSIVE_PD_INDEX; i++) {
+        new_pd[i] = kernel_pd[i];
+    }
+    new_pd[RECURSIVE_PD_INDEX] = pd_phys | PAGE_PRESENT | PAGE_WRITE;
+    
+    vmm_temp_unmap(new_pd);
+    return pd_phys;
+}
+
+/* Load an address space. Switching to the one already in CR3 is free,
+ * so tasks sharing an address space never pay for a TLB flush.
+ */
+void vmm_switch_directory(uint32_t pd_phys)
+{
+    uint32_t cpu = smp_cpu_id();
+    if (!pd_phys || pd_phys == current_cr3[cpu]) {
+        return;
+    }
+    
+    current_cr3[cpu] = pd_phys;
+    cr3_switches++;
+    __asm__ volatile("mov %0, %%cr3" : : "r"(pd_phys) : "memory");
+}
+
+uint32_t vmm_get_directory(void)
+{
+    return current_cr3[smp_cpu_id()];
+}
+
+/* Whether any CPU has pd_phys loaded */
+static int vmm_directory_in_use(uint32_t pd_phys)
+{
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (current_cr3[cpu] == pd_phys) return 1;
+    }
+    return 0;
+}
+
+uint32_t vmm_get_kernel_directory(void)
+{
+    return kernel_page_dir;
+}
+
+uint32_t vmm_get_cr3_switches(void)
+{
+    return cr3_switches;
+}
+
+/* Copy the current address space for fork. Kernel page tables are shared
+ * by reference; user page tables are copied, with private writable pages
+ * made read-only + PAGE_COW in both directories and their frames given an
+ * extra reference. Returns the physical address of the new directory.
+ */
+uint32_t vmm_clone_directory(void)
+{
+    uint32_t pd_phys = pmm_alloc_frame();
+    if (!pd_phys) return 0;
+    
+    uint32_t *new_pd = (uint32_t *)vmm_temp_map(pd_phys);
+    if (!new_pd) {
+        pmm_free_frame(pd_phys);
+        return 0;
+    }
+    
+    uint32_t *pd = GET_PD();
+    for (int i = USER_PD_ENTRIES; i < RECURSIVE_PD_INDEX; i++) {
+        new_pd[i] = kernel_pd[i];
+    }
+    new_pd[RECURSIVE_PD_INDEX] = pd_phys | PAGE_PRESENT | PAGE_WRITE;
+    
+    for (int i = 0; i < USER_PD_ENTRIES; i++) {
+        new_pd[i] = 0;
+    }
+    
+    for (int i = 0; i < USER_PD_ENTRIES; i++) {
+        if (!(pd[i] & PAGE_PRESENT)) continue;
+        
+        uint32_t pt_phys = pmm_alloc_frame();
+        uint32_t *new_pt = pt_phys ? (uint32_t *)vmm_temp_map(pt_phys) : NULL;
+        if (!new_pt) {
+            if (pt_phys) pmm_free_frame(pt_phys);
+            vmm_temp_unmap(new_pd);
+            vmm_flush_tlb();
+            vmm_destroy_directory(pd_phys);
+            return 0;
+        }
+        
+        uint32_t *pt = GET_PT(i);
+        for (int j = 0; j < 1024; j++) {
+            uint32_t pte = pt[j];
+            if ((pte & PAGE_PRESENT) && (pte & PAGE_USER) && !(pte & PAGE_SHARED)) {
+                if ((pte & PAGE_WRITE) && !(pte & PAGE_SHARED_ANON)) {
+                    pte = (pte & ~PAGE_WRITE) | PAGE_COW;
+                    pt[j] = pte;
+                }
+                pmm_frame_ref(pte & 0xFFFFF000);
+            } else if (pte & PAGE_SWAPPED) {
+                swap_entry_dup(pte);
+            }
+            new_pt[j] = pte;
+        }
+        
+        vmm_temp_unmap(new_pt);
+        new_pd[i] = pt_phys | (pd[i] & 0xFFF);
+    }
+    
+    vmm_temp_unmap(new_pd);
+    
+    /* Parent PTEs lost PAGE_WRITE */
+    vmm_flush_tlb();
+    return pd_phys;
+}
+
+/* Release the user half of an address space that is not currently
+ * loaded, dropping one reference on every private frame.
+ */
+void vmm_destroy_directory(uint32_t pd_phys)
+{
+    if (!pd_phys || pd_phys == kernel_page_dir || vmm_directory_in_use(pd_phys)) {
+        return;
+    }
+    
+    uint32_t *pd = (uint32_t *)vmm_temp_map(pd_phys);
+    if (!pd) return;
+    
+    for (int i = 0; i < USER_PD_ENTRIES; i++) {
+        if (!(pd[i] & PAGE_PRESENT)) continue;
+        
+        uint32_t pt_phys = pd[i] & 0xFFFFF000;
+        uint32_t *pt = (uint32_t *)vmm_temp_map(pt_phys);
+        if (!pt) continue;
+        
+        for (int j = 0; j < 1024; j++) {
+            uint32_t pte = pt[j];
+            if ((pte & PAGE_PRESENT) && (pte & PAGE_USER) && !(pte & PAGE_SHARED)) {
+                pmm_free_frame(pte & 0xFFFFF000);
+            } else if (pte & PAGE_SWAPPED) {
+                swap_entry_free(pte);
+            }
+        }
+        
+        vmm_temp_unmap(pt);
+        pmm_free_frame(pt_phys);
+    }
+    
+    vmm_temp_unmap(pd);
+    pmm_free_frame(pd_phys);
+}
+
+/* Read a PTE from an address space that need not be the current one */
+uint32_t vmm_lookup_pte(uint32_t pd_phys, uint32_t virt)
+{
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+    
+    uint32_t *pd = (uint32_t *)vmm_temp_map(pd_phys);
+    if (!pd) return 0;
+    uint32_t pde = pd[pd_index];
+    vmm_temp_unmap(pd);
+    
+    if (!(pde & PAGE_PRESENT)) return 0;
+    if (pde & PAGE_SIZE_4M) {
+        return ((pde & ~LARGE_PAGE_MASK) + (pt_index << 12)) | (pde & 0xFFF & ~PAGE_SIZE_4M);
+    }
+    
+    uint32_t *pt = (uint32_t *)vmm_temp_map(pde & 0xFFFFF000);
+    if (!pt) return 0;
+    uint32_t pte = pt[pt_index];
+    vmm_temp_unmap(pt);
+    
+    return pte;
+}
+
+/* Overwrite a PTE in any address space with an existing page table */
+int vmm_set_pte(uint32_t pd_phys, uint32_t virt, uint32_t pte)
+{
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+    
+    uint32_t *pd = (uint32_t *)vmm_temp_map(pd_phys);
+    if (!pd) return -12;
+    uint32_t pde = pd[pd_index];
+    vmm_temp_unmap(pd);
+    
+    if (!(pde & PAGE_PRESENT) || (pde & PAGE_SIZE_4M)) return -22;
+    
+    uint32_t *pt = (uint32_t *)vmm_temp_map(pde & 0xFFFFF000);
+    if (!pt) return -12;
+    pt[pt_index] = pte;
+    vmm_temp_unmap(pt);
+    
+    if (pd_phys == vmm_get_directory()) {
+        vmm_invlpg(virt);
+    }
+    return 0;
+}
+
+/* Raw PTE of the current address space, present or not; 0 if the page
+ * table does not exist
+ */
+uint32_t vmm_get_pte(uint32_t virt)
+{
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+    
+    if (!vmm_pde_present(pd_index)) {
+        return 0;
+    }
+    
+    uint32_t pde = GET_PD()[pd_index];
+    if (pde & PAGE_SIZE_4M) {
+        return ((pde & ~LARGE_PAGE_MASK) + (pt_index << 12)) | (pde & 0xFFF & ~PAGE_SIZE_4M);
+    }
+    
+    return GET_PT(pd_index)[pt_index];
+}
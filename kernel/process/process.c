@@ -6,9 +6,12 @@
 #include <kernel/signal.h>
 #include <kernel/elf.h>
 #include <kernel/kernel.h>
+#include <kernel/scheduler.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/heap.h>
+#include <mm/kstack.h>
+#include <mm/mmap.h>
 #include <drivers/pit.h>
 #include <drivers/serial.h>
 #include <string.h>
@@ -79,6 +82,16 @@ void process_init(void)
     current_pid = 1;
 }
 
+/* Tear down a forked address space once nothing can run in it */
+static void process_release_mm(process_t *proc)
+{
+    vma_release_process(proc);
+    if (!proc->page_directory) return;
+    
+    vmm_destroy_directory(proc->page_directory);
+    proc->page_directory = 0;
+}
+
 process_t *process_get(uint32_t pid)
 {
     for (int i = 0; i < MAX_PROCESSES; i++) {
@@ -137,8 +150,13 @@ uint32_t process_create(const char *name, uint32_t ppid)
     process_table[slot].priority = 10;
     process_table[slot].exit_code = 0;
     process_table[slot].waiting_for_pid = 0;
+    process_table[slot].rss_pages = 0;
+    process_table[slot].brk_start = 0;
+    process_table[slot].brk = 0;
+    process_table[slot].page_directory = 0;
     init_process_fd_table(&process_table[slot]);
     init_process_signals(&process_table[slot]);
+    vma_init_process(&process_table[slot]);
     
     return process_table[slot].pid;
 }
@@ -158,6 +176,7 @@ int process_kill(uint32_t pid)
     }
     
     proc->state = PROC_STATE_ZOMBIE;
+    process_release_mm(proc);
     proc->state = PROC_STATE_UNUSED;
     
     return 0;
@@ -206,6 +225,21 @@ int32_t process_fork(void)
         child->signal_handlers[i] = parent->signal_handlers[i];
     }
     
+    /* Share every user frame copy-on-write; only page tables are copied */
+    child->page_directory = vmm_clone_directory();
+    if (!child->page_directory) {
+        child->state = PROC_STATE_UNUSED;
+        return -12;
+    }
+    if (vma_fork_process(parent, child) != 0) {
+        process_release_mm(child);
+        child->state = PROC_STATE_UNUSED;
+        return -12;
+    }
+    child->rss_pages = parent->rss_pages;
+    child->brk_start = parent->brk_start;
+    child->brk = parent->brk;
+    
     serial_puts("[FORK] Created child PID ");
     char buf[12];
     int idx = 0;
@@ -233,11 +267,14 @@ int32_t process_exec(const char *path, char *const argv[])
         return -2;  
     }
     
+    /* The loader has already switched to the new image's directory */
     if (proc->elf_proc) {
         elf_free_process((user_process_t *)proc->elf_proc);
+        proc->elf_proc = NULL;
     }
+    process_release_mm(proc);
     if (proc->kernel_stack) {
-        kfree((void *)proc->kernel_stack);
+        task_stack_free((void *)proc->kernel_stack, KSTACK_DEFAULT_SIZE);
     }
     
     const char *name = path;
@@ -292,6 +329,7 @@ int32_t process_waitpid(int32_t pid, int32_t *status, int options)
                 *status = child->exit_code;
             }
             
+            process_release_mm(child);
             child->state = PROC_STATE_UNUSED;
             
             serial_puts("[WAIT] Reaped child PID ");
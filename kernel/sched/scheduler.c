@@ -1,5 +1,14 @@
 /* Scheduler 
- * Preemptive round-robin scheduler with context switching
+ * Preemptive priority scheduler with context switching
+ *
+ * Every CPU runs tasks from its own queue. A CPU about to go idle
+ * steals a task from the busiest queue, and a periodic rebalance tick
+ * evens out queues that drift apart.
+ *
+ * A queue keeps one FIFO per priority level, 0 being the most urgent,
+ * and a bitmap of the levels that are not empty, so the next task is
+ * found with two bsf instructions whatever the number of tasks. Tasks
+ * of equal priority take turns.
  */
 
 #include <kernel/scheduler.h>
@@ -7,154 +16,512 @@
 #include <arch/x86/gdt.h>
 #include <mm/pmm.h>
 #include <mm/heap.h>
+#include <mm/vmm.h>
+#include <mm/kstack.h>
 #include <drivers/serial.h>
-#include <drivers/pit.h>
-#include <apic/lapic.h>
-#include <arch/x86/idt.h>
+#include <arch/x86/smp.h>
+#include <sync/spinlock.h>
+#include <kernel/timer.h>
 #include <string.h>
 
 #define MAX_TASKS 64
 static task_t tasks[MAX_TASKS];
 static uint32_t next_tid = 1;
+static spinlock_t task_table_lock = SPINLOCK_INIT;
 
-static task_t *current_task = NULL;
-static task_t *idle_task = NULL;
-static task_t *ready_queue_head = NULL;
-static task_t *ready_queue_tail = NULL;
+/* Rebalance every 100ms at the usual 100 Hz tick */
+#define SCHED_BALANCE_TICKS 10
 
-static volatile int scheduler_lock = 0;
+/* One level per value of the 8-bit priority */
+#define SCHED_LEVELS        256
+#define SCHED_LEVEL_WORDS   (SCHED_LEVELS / 32)
+
+typedef struct prio_level {
+    task_t *head;
+    task_t *tail;
+} prio_level_t;
+
+/* One run queue per CPU, each with its own lock and idle task. A CPU
+ * never holds two queue locks at once: stealing takes the victim's lock
+ * to unlink a task, drops it and then queues the task locally.
+ */
+typedef struct run_queue {
+    spinlock_t lock;
+    prio_level_t levels[SCHED_LEVELS];
+    uint32_t level_map[SCHED_LEVEL_WORDS];  /* bit set per non-empty level */
+    uint32_t level_summary;                 /* bit set per non-zero map word */
+    uint32_t length;
+    uint32_t cpu;
+    task_t *current;
+    task_t *idle;
+    task_t *prev;               /* switched away from, until finish_switch */
+    uint32_t switch_flags;      /* EFLAGS at the switch, for fresh tasks */
+    uint32_t balance_ticks;
+    uint32_t switches;
+    uint32_t steals;            /* tasks pulled from other queues */
+    uint32_t stolen;            /* tasks other CPUs pulled from here */
+    uint32_t balance_runs;
+} run_queue_t;
+
+static run_queue_t run_queues[SMP_MAX_CPUS];
+
+static volatile int scheduler_ready = 0;
 static volatile int scheduler_enabled = 0;
 
-#define DEFAULT_STACK_SIZE  4096
+static inline run_queue_t *this_rq(void)
+{
+    return &run_queues[smp_cpu_id()];
+}
 
-static void idle_task_func(void)
+static inline uint32_t irq_save(void)
 {
-    while (1) {
-        __asm__ volatile("hlt");
+    uint32_t flags;
+    __asm__ volatile("pushfl\n popl %0\n cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+    __asm__ volatile("pushl %0\n popfl" : : "r"(flags) : "memory", "cc");
+}
+
+#define DEFAULT_STACK_SIZE  KSTACK_DEFAULT_SIZE
+
+/* Kernel stacks live in the guarded stack region (mm/kstack.c). The
+ * size is kept for callers; the region remembers it per stack.
+ */
+void *task_stack_alloc(uint32_t size)
+{
+    return kstack_alloc(size);
+}
+
+void task_stack_free(void *stack, uint32_t size)
+{
+    (void)size;
+    kstack_free(stack);
+}
+
+static inline uint32_t level_first_set(uint32_t map)
+{
+    uint32_t index;
+    __asm__ volatile("bsf %1, %0" : "=r"(index) : "rm"(map));
+    return index;
+}
+
+static void level_mark(run_queue_t *rq, uint32_t level)
+{
+    rq->level_map[level / 32] |= 1U << (level % 32);
+    rq->level_summary |= 1U << (level / 32);
+}
+
+static void level_clear(run_queue_t *rq, uint32_t level)
+{
+    rq->level_map[level / 32] &= ~(1U << (level % 32));
+    if (!rq->level_map[level / 32]) {
+        rq->level_summary &= ~(1U << (level / 32));
     }
 }
 
-static void ready_queue_add(task_t *task)
+/* Most urgent non-empty level; the queue must not be empty */
+static uint32_t rq_best_level(run_queue_t *rq)
+{
+    uint32_t word = level_first_set(rq->level_summary);
+    return word * 32 + level_first_set(rq->level_map[word]);
+}
+
+/* Queued at the level of its current priority. Anything that changes
+ * the priority of a queued task moves it, see task_change_priority.
+ */
+static void rq_push_locked(run_queue_t *rq, task_t *task)
 {
+    prio_level_t *level = &rq->levels[task->priority];
     task->next = NULL;
     task->state = TASK_STATE_READY;
     
-    if (ready_queue_tail) {
-        ready_queue_tail->next = task;
-        ready_queue_tail = task;
+    if (level->tail) {
+        level->tail->next = task;
+        level->tail = task;
     } else {
-        ready_queue_head = ready_queue_tail = task;
+        level->head = level->tail = task;
+        level_mark(rq, task->priority);
     }
+    rq->length++;
 }
 
-static task_t *ready_queue_pop(void)
+static task_t *rq_pop_locked(run_queue_t *rq)
 {
-    if (!ready_queue_head) {
+    if (!rq->level_summary) {
         return NULL;
     }
     
-    task_t *task = ready_queue_head;
-    ready_queue_head = task->next;
+    uint32_t index = rq_best_level(rq);
+    prio_level_t *level = &rq->levels[index];
+    task_t *task = level->head;
     
-    if (!ready_queue_head) {
-        ready_queue_tail = NULL;
+    level->head = task->next;
+    if (!level->head) {
+        level->tail = NULL;
+        level_clear(rq, index);
     }
+    rq->length--;
     
     task->next = NULL;
     return task;
 }
 
-static task_t *alloc_task_slot(void)
+/* Take a task out of its level wherever it stands. Returns 0 if it was
+ * not queued here.
+ */
+static int rq_unlink_locked(run_queue_t *rq, task_t *task)
 {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_STATE_UNUSED) {
-            return &tasks[i];
+    prio_level_t *level = &rq->levels[task->priority];
+    task_t *prev = NULL;
+    task_t *cur = level->head;
+    while (cur && cur != task) {
+        prev = cur;
+        cur = cur->next;
+    }
+    if (!cur) return 0;
+    
+    if (prev) {
+        prev->next = task->next;
+    } else {
+        level->head = task->next;
+    }
+    if (level->tail == task) {
+        level->tail = prev;
+    }
+    if (!level->head) {
+        level_clear(rq, task->priority);
+    }
+    rq->length--;
+    
+    task->next = NULL;
+    return 1;
+}
+
+/* An idle CPU without a tick only notices new work when interrupted */
+static void rq_kick(run_queue_t *rq)
+{
+    if (rq != this_rq() && rq->current == rq->idle) {
+        smp_wake_cpu(rq->cpu);
+    }
+}
+
+/* Queue a task on the CPU it belongs to */
+static void ready_queue_add(task_t *task)
+{
+    run_queue_t *rq = &run_queues[task->cpu];
+    uint32_t flags;
+    spinlock_irq_save(&rq->lock, &flags);
+    rq_push_locked(rq, task);
+    spinlock_irq_restore(&rq->lock, flags);
+    rq_kick(rq);
+}
+
+static uint32_t rq_load(run_queue_t *rq)
+{
+    task_t *current = rq->current;
+    return rq->length + (current && current != rq->idle ? 1 : 0);
+}
+
+/* Only kernel-only tasks move between CPUs. A task with an address
+ * space of its own depends on state that still lives on the BSP alone
+ * (the TSS esp0, the current process, the CR3 cache). A task is also
+ * left alone until the CPU that ran it has finished switching away, and
+ * while it has pinned itself with task_migrate_disable.
+ */
+static int task_can_migrate(task_t *task)
+{
+    return task->tid != 0 && !task->page_directory && !task->on_cpu &&
+           !task->migrate_disabled;
+}
+
+/* First migratable task, most urgent level first */
+static task_t *rq_find_migratable(run_queue_t *rq)
+{
+    for (uint32_t word = 0; word < SCHED_LEVEL_WORDS; word++) {
+        uint32_t map = rq->level_map[word];
+        while (map) {
+            uint32_t bit = level_first_set(map);
+            map &= ~(1U << bit);
+            
+            task_t *task = rq->levels[word * 32 + bit].head;
+            for (; task; task = task->next) {
+                if (task_can_migrate(task)) return task;
+            }
         }
     }
     return NULL;
 }
 
-void scheduler_init(void)
+/* The CPU with the most work queued behind its current task */
+static run_queue_t *find_busiest(run_queue_t *rq)
 {
-    serial_puts("[SCHED] Initializing scheduler\n");
+    run_queue_t *busiest = NULL;
+    uint32_t busiest_load = 0;
+    
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        run_queue_t *other = &run_queues[i];
+        if (other == rq || !other->idle || !other->length) continue;
+        
+        uint32_t load = rq_load(other);
+        if (load > busiest_load) {
+            busiest = other;
+            busiest_load = load;
+        }
+    }
+    return busiest;
+}
+
+static int steal_task(run_queue_t *rq, run_queue_t *busiest)
+{
+    uint32_t flags;
+    spinlock_irq_save(&busiest->lock, &flags);
     
-    memset(tasks, 0, sizeof(tasks));
+    task_t *task = rq_find_migratable(busiest);
+    if (task && !rq_unlink_locked(busiest, task)) {
+        task = NULL;
+    }
+    if (task) {
+        /* Moved under the old queue's lock, so anyone who locks the
+         * queue task->cpu names and finds it unchanged has the right one
+         */
+        task->cpu = rq->cpu;
+        busiest->stolen++;
+    }
     
-    task_t *kernel_task = &tasks[0];
-    kernel_task->tid = 0;
-    kernel_task->pid = 0;
-    strcpy(kernel_task->name, "kernel");
-    kernel_task->state = TASK_STATE_RUNNING;
-    kernel_task->priority = 0;
-    kernel_task->base_priority = 0;
-    kernel_task->inherited_priority = 0;
-    kernel_task->waiting_on = NULL;
-    kernel_task->kernel_stack = NULL;
-    kernel_task->kernel_stack_size = 0;
-    kernel_task->esp = 0;
-    kernel_task->page_directory = NULL;
-    kernel_task->cpu_time = 0;
-    kernel_task->next = NULL;
-    
-    current_task = kernel_task;
-    
-    idle_task = task_create("idle", idle_task_func, DEFAULT_STACK_SIZE);
-    if (idle_task) {
-        if (ready_queue_head == idle_task) {
-            ready_queue_pop();
-        }
-        idle_task->state = TASK_STATE_READY;
-        idle_task->priority = 255;
+    spinlock_irq_restore(&busiest->lock, flags);
+    if (!task) return 0;
+    
+    ready_queue_add(task);
+    rq->steals++;
+    return 1;
+}
+
+static int steal_from_busiest(run_queue_t *rq)
+{
+    run_queue_t *busiest = find_busiest(rq);
+    return busiest && steal_task(rq, busiest);
+}
+
+/* Pull tasks until this CPU carries about half the difference */
+static void rebalance(run_queue_t *rq)
+{
+    rq->balance_runs++;
+    
+    run_queue_t *busiest = find_busiest(rq);
+    if (!busiest) return;
+    
+    uint32_t mine = rq_load(rq);
+    uint32_t theirs = rq_load(busiest);
+    if (theirs < mine + 2) return;
+    
+    for (uint32_t n = (theirs - mine) / 2; n > 0; n--) {
+        if (!steal_task(rq, busiest)) break;
     }
+}
+
+/* Runs on the new task's stack right after a switch. The task switched
+ * away from may be picked up by another CPU from now on; if it exited,
+ * its stack is no longer in use and can go.
+ */
+static void finish_switch(void)
+{
+    run_queue_t *rq = this_rq();
+    task_t *prev = rq->prev;
+    if (!prev) return;
+    
+    rq->prev = NULL;
+    if (prev->state == TASK_STATE_ZOMBIE && prev->kernel_stack) {
+        task_stack_free(prev->kernel_stack, prev->kernel_stack_size);
+        prev->kernel_stack = NULL;
+    }
+    prev->on_cpu = 0;
+}
+
+/* First code a new task runs, entered through context_switch's ret */
+static void task_start(void)
+{
+    uint32_t flags = this_rq()->switch_flags;
+    finish_switch();
+    irq_restore(flags);
     
-    serial_puts("[SCHED] Scheduler initialized\n");
+    task_current()->entry();
+    task_exit(0);
 }
 
-task_t *task_create(const char *name, void (*entry)(void), uint32_t stack_size)
+/* With nothing else to run, take work from a busier CPU if there is any,
+ * otherwise zero frames for the pre-zeroed pool a batch at a time; halt
+ * only once the pool is full, with the tick stopped.
+ */
+static void idle_task_func(void)
+{
+    run_queue_t *rq = this_rq();
+    
+    while (1) {
+        if (rq->length || steal_from_busiest(rq)) {
+            schedule_force();
+            continue;
+        }
+        if (pmm_zero_pool_refill(PMM_ZERO_POOL_BATCH) != 0) {
+            continue;
+        }
+        
+        cli();
+        if (rq->length) {
+            sti();
+            continue;
+        }
+        timer_idle_halt();
+    }
+}
+
+static task_t *alloc_task_slot(void)
+{
+    for (int i = 0; i < MAX_TASKS; i++) {
+        if (tasks[i].state == TASK_STATE_UNUSED) {
+            return &tasks[i];
+        }
+    }
+    return NULL;
+}
+
+/* Claim a slot and give it a tid; the caller fills in the rest */
+static task_t *task_slot_claim(const char *name)
 {
+    uint32_t flags;
+    spinlock_irq_save(&task_table_lock, &flags);
+    
     task_t *task = alloc_task_slot();
-    if (!task) {
-        serial_puts("[SCHED] No free task slots\n");
-        return NULL;
+    if (task) {
+        memset(task, 0, sizeof(task_t));
+        task->tid = next_tid++;
+        task->state = TASK_STATE_BLOCKED;   /* not UNUSED, not runnable yet */
     }
     
+    spinlock_irq_restore(&task_table_lock, flags);
+    
+    if (task) {
+        strncpy(task->name, name, 31);
+        task->name[31] = '\0';
+    }
+    return task;
+}
+
+/* Build a task without queueing it */
+static task_t *task_alloc(const char *name, void (*entry)(void), uint32_t stack_size)
+{
     if (stack_size == 0) {
         stack_size = DEFAULT_STACK_SIZE;
     }
     
-    uint32_t *stack = (uint32_t *)kmalloc(stack_size);
+    uint32_t *stack = (uint32_t *)task_stack_alloc(stack_size);
     if (!stack) {
         serial_puts("[SCHED] Failed to allocate stack\n");
         return NULL;
     }
     
-    task->tid = next_tid++;
-    task->pid = current_task ? current_task->pid : 0;
-    strncpy(task->name, name, 31);
-    task->name[31] = '\0';
-    task->state = TASK_STATE_READY;
+    task_t *task = task_slot_claim(name);
+    if (!task) {
+        task_stack_free(stack, stack_size);
+        serial_puts("[SCHED] No free task slots\n");
+        return NULL;
+    }
+    
+    task_t *creator = task_current();
+    task->pid = creator ? creator->pid : 0;
     task->priority = 10;
     task->base_priority = 10;
-    task->inherited_priority = 0;
-    task->waiting_on = NULL;
     task->kernel_stack = stack;
     task->kernel_stack_size = stack_size;
-    task->page_directory = NULL;
-    task->cpu_time = 0;
-    task->wake_time = 0;
-    task->next = NULL;
+    task->entry = entry;
+    task->cpu = this_rq()->cpu;
     
     uint32_t *sp = (uint32_t *)((uint32_t)stack + stack_size);
     
-    *(--sp) = (uint32_t)task_exit;
+    *(--sp) = 0;  /* task_start never returns */
     
-    *(--sp) = (uint32_t)entry;
+    *(--sp) = (uint32_t)task_start;
     *(--sp) = 0;  /* EBP */
     *(--sp) = 0;  /* EBX */
     *(--sp) = 0;  /* ESI */
     *(--sp) = 0;  /* EDI */
     
     task->esp = (uint32_t)sp;
+    return task;
+}
+
+void scheduler_init(void)
+{
+    serial_puts("[SCHED] Initializing scheduler\n");
+    
+    memset(tasks, 0, sizeof(tasks));
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        spinlock_init(&run_queues[i].lock);
+        run_queues[i].cpu = i;
+    }
+    
+    task_t *kernel_task = &tasks[0];
+    kernel_task->tid = 0;
+    kernel_task->pid = 0;
+    strcpy(kernel_task->name, "kernel");
+    kernel_task->state = TASK_STATE_RUNNING;
+    kernel_task->on_cpu = 1;
+    
+    run_queue_t *rq = &run_queues[0];
+    rq->current = kernel_task;
+    
+    rq->idle = task_alloc("idle", idle_task_func, DEFAULT_STACK_SIZE);
+    if (rq->idle) {
+        rq->idle->state = TASK_STATE_READY;
+        rq->idle->priority = 255;
+    }
+    
+    scheduler_ready = 1;
+    serial_puts("[SCHED] Scheduler initialized\n");
+}
+
+/* Entered by each application processor once it is online. Its boot
+ * context becomes the CPU's idle task, on the stack smp_init gave it.
+ */
+void scheduler_ap_start(void)
+{
+    while (!scheduler_ready) {
+        __asm__ volatile("sti; hlt");
+    }
+    
+    task_t *idle = task_slot_claim("idle");
+    if (!idle) {
+        serial_puts("[SCHED] No task slot for AP idle task\n");
+        while (1) {
+            __asm__ volatile("sti; hlt");
+        }
+    }
+    
+    run_queue_t *rq = this_rq();
+    idle->priority = 255;
+    idle->base_priority = 255;
+    idle->cpu = rq->cpu;
+    idle->on_cpu = 1;
+    idle->state = TASK_STATE_RUNNING;
+    
+    uint32_t flags;
+    spinlock_irq_save(&rq->lock, &flags);
+    rq->current = idle;
+    rq->idle = idle;
+    spinlock_irq_restore(&rq->lock, flags);
+    
+    sti();
+    idle_task_func();
+}
+
+task_t *task_create(const char *name, void (*entry)(void), uint32_t stack_size)
+{
+    task_t *task = task_alloc(name, entry, stack_size);
+    if (!task) {
+        return NULL;
+    }
     
     ready_queue_add(task);
     
@@ -165,14 +532,40 @@ task_t *task_create(const char *name, void (*entry)(void), uint32_t stack_size)
     return task;
 }
 
+/* Interrupts stay off across the read so the task cannot be moved
+ * between looking up this CPU and reading its current task.
+ */
 task_t *task_current(void)
 {
-    return current_task;
+    uint32_t flags = irq_save();
+    task_t *task = this_rq()->current;
+    irq_restore(flags);
+    return task;
+}
+
+/* Keep the current task on this CPU until the matching enable, e.g.
+ * while it holds a per-CPU temp mapping. From an interrupt handler this
+ * pins the interrupted task, which cannot move meanwhile anyway.
+ */
+void task_migrate_disable(void)
+{
+    uint32_t flags = irq_save();
+    task_t *task = this_rq()->current;
+    if (task) task->migrate_disabled++;
+    irq_restore(flags);
+}
+
+void task_migrate_enable(void)
+{
+    uint32_t flags = irq_save();
+    task_t *task = this_rq()->current;
+    if (task && task->migrate_disabled) task->migrate_disabled--;
+    irq_restore(flags);
 }
 
 void schedule(void)
 {
-    if (!scheduler_enabled || scheduler_lock) {
+    if (!scheduler_enabled) {
         return;
     }
     
@@ -181,98 +574,169 @@ void schedule(void)
 
 void schedule_force(void)
 {
-    if (scheduler_lock) {
+    uint32_t flags = irq_save();
+    run_queue_t *rq = this_rq();
+    if (!rq->current) {
+        irq_restore(flags);
         return;
     }
     
-    task_t *next = ready_queue_pop();
+    task_t *prev = rq->current;
     
-    if (!next) {
-        return;
+    /* A CPU about to idle looks for work elsewhere first */
+    int runnable = prev->state == TASK_STATE_RUNNING && prev != rq->idle;
+    if (!rq->length && !runnable) {
+        steal_from_busiest(rq);
     }
     
-    if (next == current_task) {
-        return;  
+    spinlock_acquire(&rq->lock);
+    
+    task_t *next = rq_pop_locked(rq);
+    if (!next) {
+        /* Without an idle task a blocked task simply keeps running */
+        if (runnable || prev == rq->idle || !rq->idle) {
+            spinlock_release(&rq->lock);
+            irq_restore(flags);
+            return;
+        }
+        next = rq->idle;
     }
     
-    task_t *prev = current_task;
+    if (next == prev) {
+        /* Woken up again before it got switched out */
+        prev->state = TASK_STATE_RUNNING;
+        spinlock_release(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
     
-    if (prev && prev->state == TASK_STATE_RUNNING && prev != idle_task) {
-        ready_queue_add(prev);
+    if (runnable) {
+        rq_push_locked(rq, prev);
     }
     
-    current_task = next;
     next->state = TASK_STATE_RUNNING;
+    next->on_cpu = 1;
+    next->cpu = rq->cpu;
+    rq->current = next;
+    rq->prev = prev;
+    rq->switch_flags = flags;
+    rq->switches++;
     
-    if (next->kernel_stack) {
+    spinlock_release(&rq->lock);
+    
+    /* Only the BSP returns to user mode, so only its TSS follows along */
+    if (next->kernel_stack && rq->cpu == 0) {
         uint32_t stack_top = (uint32_t)next->kernel_stack + next->kernel_stack_size;
         gdt_set_kernel_stack(stack_top);
     }
     
-    if (prev) {
-        context_switch(&prev->esp, next->esp);
+    /* Kernel-only tasks borrow whatever address space is loaded, and
+     * vmm_switch_directory skips the reload when next already owns it.
+     */
+    if (next->page_directory) {
+        vmm_switch_directory(next->page_directory);
     }
+    
+    context_switch(&prev->esp, next->esp);
+    
+    /* Back in prev, possibly on another CPU */
+    finish_switch();
+    irq_restore(flags);
 }
 
-void scheduler_tick(void)
+/* ticks is how many tick periods passed since the last call; 0 for a
+ * timer interrupt that came early, which neither charges time nor ends
+ * the current task's time slice.
+ */
+void scheduler_tick(uint32_t ticks)
 {
-    if (!scheduler_enabled || !current_task) {
+    run_queue_t *rq = this_rq();
+    task_t *current = rq->current;
+    if (!scheduler_enabled || !current || !ticks) {
         return;
     }
     
-    current_task->cpu_time++;
+    current->cpu_time += ticks;
     
-    uint64_t now;
-    if (idt_is_apic_mode()) {
-        now = lapic_get_uptime_ms();
-    } else {
-        now = pit_get_uptime_ms();
+    rq->balance_ticks += ticks;
+    if (rq->balance_ticks >= SCHED_BALANCE_TICKS) {
+        rq->balance_ticks = 0;
+        rebalance(rq);
     }
     
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_STATE_SLEEPING) {
-            if (now >= tasks[i].wake_time) {
-                ready_queue_add(&tasks[i]);
-            }
-        }
-    }
+    /* Preempt for an equal or more urgent task only. An explicit
+     * schedule_force still yields to whatever else is queued.
+     */
+    spinlock_acquire(&rq->lock);
+    int preempt = rq->length && rq_best_level(rq) <= current->priority;
+    spinlock_release(&rq->lock);
     
-    if (ready_queue_head && current_task->tid != 0) {
+    if (preempt && current->tid != 0) {
         schedule();
     }
 }
 
 void task_block(uint8_t reason)
 {
-    if (!current_task) return;
+    task_t *current = task_current();
+    if (!current) return;
     
-    current_task->state = TASK_STATE_BLOCKED;
-    current_task->block_reason = reason;
+    current->state = TASK_STATE_BLOCKED;
+    current->block_reason = reason;
     schedule_force(); 
 }
 
 void task_unblock(task_t *task)
 {
-    if (!task || task->state != TASK_STATE_BLOCKED) return;
+    if (!task) return;
     
-    task->block_reason = BLOCK_REASON_NONE;
-    ready_queue_add(task);
+    run_queue_t *rq = &run_queues[task->cpu];
+    uint32_t flags;
+    spinlock_irq_save(&rq->lock, &flags);
+    int woken = task->state == TASK_STATE_BLOCKED;
+    if (woken) {
+        task->block_reason = BLOCK_REASON_NONE;
+        rq_push_locked(rq, task);
+    }
+    spinlock_irq_restore(&rq->lock, flags);
+    
+    if (woken) {
+        rq_kick(rq);
+    }
 }
 
-void task_sleep(uint32_t ms)
+/* Sleep timer callback, from the BSP's tick */
+static void task_sleep_expired(void *arg)
 {
-    if (!current_task) return;
+    task_t *task = (task_t *)arg;
+    run_queue_t *rq = &run_queues[task->cpu];
+    uint32_t flags;
+    spinlock_irq_save(&rq->lock, &flags);
+    int woken = task->state == TASK_STATE_SLEEPING;
+    if (woken) {
+        rq_push_locked(rq, task);
+    }
+    spinlock_irq_restore(&rq->lock, flags);
     
-    uint64_t now;
-    if (idt_is_apic_mode()) {
-        now = lapic_get_uptime_ms();
-    } else {
-        now = pit_get_uptime_ms();
+    if (woken) {
+        rq_kick(rq);
     }
+}
+
+/* A timer that fires before the switch finds the task still current;
+ * schedule_force then picks it straight back up.
+ */
+void task_sleep(uint32_t ms)
+{
+    task_t *current = task_current();
+    if (!current) return;
     
-    current_task->wake_time = now + ms;
-    current_task->state = TASK_STATE_SLEEPING;
-    schedule();
+    current->state = TASK_STATE_SLEEPING;
+    if (timer_start(&current->sleep_timer, ms, task_sleep_expired, current) < 0) {
+        current->state = TASK_STATE_RUNNING;
+        return;
+    }
+    schedule_force();
 }
 
 void scheduler_enable(void)
@@ -286,21 +750,19 @@ void scheduler_disable(void)
     scheduler_enabled = 0;
 }
 
+/* The stack is released by finish_switch once another task runs */
 void task_exit(int status)
 {
     (void)status;
     
-    if (!current_task) return;
+    task_t *current = task_current();
+    if (!current) return;
     
     serial_puts("[SCHED] Task exiting: ");
-    serial_puts(current_task->name);
+    serial_puts(current->name);
     serial_puts("\n");
     
-    if (current_task->kernel_stack) {
-        kfree(current_task->kernel_stack);
-    }
-    
-    current_task->state = TASK_STATE_ZOMBIE;
+    current->state = TASK_STATE_ZOMBIE;
     schedule_force();
     
     while (1) {
@@ -308,12 +770,41 @@ void task_exit(int status)
     }
 }
 
+/* Set the effective priority, moving the task to its new level if it
+ * is queued. One that is being stolen is in no queue for a moment and
+ * gets queued at the new level by the thief.
+ */
+static void task_change_priority(task_t *task, uint8_t priority)
+{
+    run_queue_t *rq;
+    uint32_t flags;
+    
+    /* The task may be stolen before the lock is ours; follow it */
+    while (1) {
+        rq = &run_queues[task->cpu];
+        spinlock_irq_save(&rq->lock, &flags);
+        if (rq->cpu == task->cpu) break;
+        spinlock_irq_restore(&rq->lock, flags);
+    }
+    
+    if (task->priority != priority) {
+        if (task->state == TASK_STATE_READY && rq_unlink_locked(rq, task)) {
+            task->priority = priority;
+            rq_push_locked(rq, task);
+        } else {
+            task->priority = priority;
+        }
+    }
+    
+    spinlock_irq_restore(&rq->lock, flags);
+}
+
 void task_set_priority(task_t *task, uint8_t priority)
 {
     if (!task) return;
     task->base_priority = priority;
-    task->priority = (task->inherited_priority > 0 && task->inherited_priority < priority) 
-                     ? task->inherited_priority : priority;
+    task_change_priority(task, (task->inherited_priority > 0 && task->inherited_priority < priority) 
+                         ? task->inherited_priority : priority);
 }
 
 uint8_t task_get_effective_priority(task_t *task)
@@ -331,7 +822,7 @@ void task_boost_priority(task_t *task, uint8_t priority)
     }
     
     if (priority < task->priority) {
-        task->priority = priority;
+        task_change_priority(task, priority);
     }
 }
 
@@ -340,7 +831,7 @@ void task_restore_priority(task_t *task)
     if (!task) return;
     
     task->inherited_priority = 0;
-    task->priority = task->base_priority;
+    task_change_priority(task, task->base_priority);
 }
 
 int scheduler_get_task_count(void)
@@ -353,3 +844,21 @@ int scheduler_get_task_count(void)
     }
     return count;
 }
+
+int scheduler_get_cpu_stats(uint32_t cpu, sched_cpu_stats_t *stats)
+{
+    if (cpu >= SMP_MAX_CPUS || !stats) return -22;
+    
+    run_queue_t *rq = &run_queues[cpu];
+    if (!rq->current) return -22;
+    
+    task_t *current = rq->current;
+    stats->queued = rq->length;
+    stats->current_tid = current->tid;
+    stats->idle = current == rq->idle;
+    stats->switches = rq->switches;
+    stats->steals = rq->steals;
+    stats->stolen = rq->stolen;
+    stats->balance_runs = rq->balance_runs;
+    return 0;
+}
@@ -0,0 +1,351 @@
+/* Kernel Timers
+ * One-shot callbacks after a delay, kept in a binary min-heap by expiry
+ *
+ * The BSP's timer interrupt calls timer_tick, which only has to look at
+ * the root of the heap: nothing expired costs one comparison, however
+ * many timers are pending. Starting and stopping a timer is O(log n).
+ *
+ * Callbacks run in interrupt context on the BSP with the timer lock
+ * dropped, so they may start or stop timers, but must not block.
+ *
+ * Once the LAPIC timers run one-shot, each CPU re-arms its own after
+ * every interrupt: the BSP for whichever comes first of the next tick
+ * and the earliest timer, so expiries are not rounded to ticks. A CPU
+ * halting in timer_idle_halt skips the ticks and only wakes for the
+ * earliest timer (BSP), a poll for work to steal, or an interrupt.
+ */
+
+#include <kernel/timer.h>
+#include <kernel/kernel.h>
+#include <drivers/pit.h>
+#include <apic/lapic.h>
+#include <arch/x86/idt.h>
+#include <arch/x86/tsc.h>
+#include <arch/x86/smp.h>
+#include <sync/spinlock.h>
+
+#define NS_PER_MS           1000000ULL
+
+/* Longest an idle CPU stays halted without an interrupt. With other
+ * CPUs around it has to look for work to steal now and then.
+ */
+#define TIMER_IDLE_MAX_NS   (1000 * NS_PER_MS)
+#define TIMER_IDLE_POLL_NS  (100 * NS_PER_MS)
+
+static ktimer_t *timer_heap[TIMER_HEAP_SIZE];
+static uint32_t timer_count = 0;
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+/* timer_add ids are the pool slot in the low byte and the slot's
+ * generation above it, so a stale id cannot cancel a reused slot.
+ */
+#define TIMER_ID_SLOT_BITS  8
+
+static struct {
+    ktimer_t timer;
+    uint32_t generation;
+    uint8_t used;
+} timer_pool[TIMER_POOL_SIZE];
+
+static volatile uint8_t tick_stopped[SMP_MAX_CPUS];
+static uint64_t timer_armed[SMP_MAX_CPUS];      /* ktime of the next interrupt */
+static uint64_t tick_counted[SMP_MAX_CPUS];     /* ktime ticks are counted up to */
+
+/* Monotonic nanoseconds since boot; tick resolution without a TSC */
+uint64_t ktime_ns(void)
+{
+    if (tsc_is_calibrated()) {
+        return tsc_ns();
+    }
+    if (idt_is_apic_mode()) {
+        return lapic_get_uptime_ms() * NS_PER_MS;
+    }
+    return pit_get_uptime_ms() * NS_PER_MS;
+}
+
+static void heap_place(uint32_t index, ktimer_t *timer)
+{
+    timer_heap[index] = timer;
+    timer->heap_slot = index + 1;
+}
+
+static void heap_sift_up(uint32_t index)
+{
+    ktimer_t *timer = timer_heap[index];
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (timer_heap[parent]->expires <= timer->expires) break;
+        heap_place(index, timer_heap[parent]);
+        index = parent;
+    }
+    heap_place(index, timer);
+}
+
+static void heap_sift_down(uint32_t index)
+{
+    ktimer_t *timer = timer_heap[index];
+    while (1) {
+        uint32_t child = index * 2 + 1;
+        if (child >= timer_count) break;
+        if (child + 1 < timer_count && timer_heap[child + 1]->expires < timer_heap[child]->expires) {
+            child++;
+        }
+        if (timer->expires <= timer_heap[child]->expires) break;
+        heap_place(index, timer_heap[child]);
+        index = child;
+    }
+    heap_place(index, timer);
+}
+
+static void heap_remove_locked(ktimer_t *timer)
+{
+    uint32_t index = timer->heap_slot - 1;
+    timer->heap_slot = 0;
+    
+    ktimer_t *last = timer_heap[--timer_count];
+    if (last == timer) return;
+    
+    heap_place(index, last);
+    if (index > 0 && timer_heap[(index - 1) / 2]->expires > last->expires) {
+        heap_sift_up(index);
+    } else {
+        heap_sift_down(index);
+    }
+}
+
+/* Program this CPU's one-shot timer for its next event */
+void timer_rearm(void)
+{
+    if (!lapic_timer_is_oneshot()) return;
+    
+    uint32_t cpu = smp_cpu_id();
+    uint32_t flags;
+    spinlock_irq_save(&timer_lock, &flags);
+    
+    uint64_t now = ktime_ns();
+    uint64_t delta;
+    if (tick_stopped[cpu]) {
+        delta = smp_cpu_count() > 1 ? TIMER_IDLE_POLL_NS : TIMER_IDLE_MAX_NS;
+    } else {
+        delta = 1000 * NS_PER_MS / lapic_get_frequency();
+    }
+    
+    if (cpu == 0 && timer_count) {
+        uint64_t expires = timer_heap[0]->expires;
+        if (expires <= now) {
+            delta = 0;
+        } else if (expires - now < delta) {
+            delta = expires - now;
+        }
+    }
+    
+    timer_armed[cpu] = now + delta;
+    lapic_timer_arm(delta);
+    
+    spinlock_irq_restore(&timer_lock, flags);
+}
+
+/* Whole tick periods since this CPU last asked. A periodic timer
+ * interrupts once per tick; a one-shot one also comes early for timers,
+ * idle polls and wakeups, and not at all for the ticks an idle CPU
+ * skipped, so the count follows ktime instead.
+ */
+uint32_t timer_ticks_elapsed(void)
+{
+    if (!lapic_timer_is_oneshot()) return 1;
+    
+    uint32_t cpu = smp_cpu_id();
+    uint64_t period = 1000 * NS_PER_MS / lapic_get_frequency();
+    uint64_t now = ktime_ns();
+    if (!tick_counted[cpu]) {
+        tick_counted[cpu] = now;
+        return 1;
+    }
+    if (now < tick_counted[cpu] + period) return 0;
+    
+    uint64_t ticks = (now - tick_counted[cpu]) / period;
+    tick_counted[cpu] += ticks * period;
+    return (uint32_t)ticks;
+}
+
+/* Arm a timer to call callback(arg) in ms milliseconds, rearming it if
+ * it was already pending. Returns -12 when too many timers are pending.
+ */
+int timer_start(ktimer_t *timer, uint32_t ms, timer_callback_t callback, void *arg)
+{
+    if (!timer || !callback) return -22;
+    
+    uint32_t flags;
+    spinlock_irq_save(&timer_lock, &flags);
+    
+    if (timer->heap_slot) {
+        heap_remove_locked(timer);
+    }
+    if (timer_count >= TIMER_HEAP_SIZE) {
+        spinlock_irq_restore(&timer_lock, flags);
+        return -12;
+    }
+    
+    timer->expires = ktime_ns() + ms * NS_PER_MS;
+    timer->callback = callback;
+    timer->arg = arg;
+    
+    timer_heap[timer_count] = timer;
+    heap_sift_up(timer_count++);
+    
+    /* The BSP's timer may be armed for later than this one */
+    int sooner = timer_heap[0] == timer && timer->expires < timer_armed[0];
+    
+    spinlock_irq_restore(&timer_lock, flags);
+    
+    if (sooner) {
+        if (smp_is_bsp()) {
+            timer_rearm();
+        } else {
+            smp_wake_cpu(0);
+        }
+    }
+    return 0;
+}
+
+/* Returns 1 if the timer was pending, 0 if it already fired or was
+ * never started.
+ */
+int timer_stop(ktimer_t *timer)
+{
+    if (!timer) return 0;
+    
+    uint32_t flags;
+    spinlock_irq_save(&timer_lock, &flags);
+    
+    int pending = timer->heap_slot != 0;
+    if (pending) {
+        heap_remove_locked(timer);
+    }
+    
+    spinlock_irq_restore(&timer_lock, flags);
+    return pending;
+}
+
+static int timer_is_pooled(ktimer_t *timer)
+{
+    return (void *)timer >= (void *)&timer_pool[0] &&
+           (void *)timer < (void *)&timer_pool[TIMER_POOL_SIZE];
+}
+
+static void timer_pool_release(ktimer_t *timer)
+{
+    uint32_t slot = ((uint32_t)timer - (uint32_t)&timer_pool[0]) / sizeof(timer_pool[0]);
+    timer_pool[slot].used = 0;
+}
+
+/* Fire-and-forget timer for code that has nowhere to keep a ktimer_t.
+ * Returns an id for timer_cancel, or -12 when none is free.
+ */
+int timer_add(uint32_t ms, timer_callback_t callback, void *arg)
+{
+    if (!callback) return -22;
+    
+    uint32_t flags;
+    spinlock_irq_save(&timer_lock, &flags);
+    
+    uint32_t slot = 0;
+    while (slot < TIMER_POOL_SIZE && timer_pool[slot].used) {
+        slot++;
+    }
+    if (slot == TIMER_POOL_SIZE) {
+        spinlock_irq_restore(&timer_lock, flags);
+        return -12;
+    }
+    
+    timer_pool[slot].used = 1;
+    timer_pool[slot].generation = (timer_pool[slot].generation + 1) & 0x7FFFFF;
+    if (timer_pool[slot].generation == 0) {
+        timer_pool[slot].generation = 1;
+    }
+    int id = (int)((timer_pool[slot].generation << TIMER_ID_SLOT_BITS) | slot);
+    
+    spinlock_irq_restore(&timer_lock, flags);
+    
+    if (timer_start(&timer_pool[slot].timer, ms, callback, arg) < 0) {
+        timer_pool[slot].used = 0;
+        return -12;
+    }
+    return id;
+}
+
+/* Returns 0 if the timer was cancelled before it fired */
+int timer_cancel(int id)
+{
+    if (id <= 0) return -22;
+    
+    uint32_t slot = (uint32_t)id & ((1U << TIMER_ID_SLOT_BITS) - 1);
+    uint32_t generation = (uint32_t)id >> TIMER_ID_SLOT_BITS;
+    if (slot >= TIMER_POOL_SIZE) return -22;
+    
+    uint32_t flags;
+    spinlock_irq_save(&timer_lock, &flags);
+    
+    int result = -2;
+    ktimer_t *timer = &timer_pool[slot].timer;
+    if (timer_pool[slot].used && timer_pool[slot].generation == generation && timer->heap_slot) {
+        heap_remove_locked(timer);
+        timer_pool[slot].used = 0;
+        result = 0;
+    }
+    
+    spinlock_irq_restore(&timer_lock, flags);
+    return result;
+}
+
+/* Run everything that has expired, earliest first */
+void timer_tick(void)
+{
+    uint64_t now = ktime_ns();
+    
+    while (1) {
+        uint32_t flags;
+        spinlock_irq_save(&timer_lock, &flags);
+        
+        if (!timer_count || timer_heap[0]->expires > now) {
+            spinlock_irq_restore(&timer_lock, flags);
+            return;
+        }
+        
+        ktimer_t *timer = timer_heap[0];
+        heap_remove_locked(timer);
+        
+        timer_callback_t callback = timer->callback;
+        void *arg = timer->arg;
+        if (timer_is_pooled(timer)) {
+            timer_pool_release(timer);
+        }
+        
+        spinlock_irq_restore(&timer_lock, flags);
+        callback(arg);
+    }
+}
+
+/* Halt until the next interrupt without the periodic tick. Entered
+ * with interrupts disabled once the caller found nothing to do, so a
+ * wakeup cannot slip in between its check and the hlt; returns with
+ * interrupts enabled and the tick running again.
+ */
+void timer_idle_halt(void)
+{
+    uint32_t cpu = smp_cpu_id();
+    
+    tick_stopped[cpu] = 1;
+    timer_rearm();
+    __asm__ volatile("sti; hlt");
+    
+    cli();
+    tick_stopped[cpu] = 0;
+    timer_rearm();
+    sti();
+}
+
+uint32_t timer_pending_count(void)
+{
+    return timer_count;
+}
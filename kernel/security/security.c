@@ -5,6 +5,7 @@
 #include <security/security.h>
 #include <kernel/kernel.h>
 #include <drivers/serial.h>
+#include <mm/vmm.h>
 #include <fs/vfs.h>
 #include <fs/ramfs.h>
 #include <string.h>
@@ -35,6 +36,9 @@ static void detect_cpu_features(void)
     if (edx & (1 << 6)) {
         cpu_features |= CPU_FEATURE_PAE;
     }
+    if (edx & (1 << 13)) {
+        cpu_features |= CPU_FEATURE_PGE;
+    }
     
     __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001));
     
@@ -408,6 +412,10 @@ void security_init(void)
     if (cpu_features & CPU_FEATURE_SMAP) {
         serial_puts("[SECURITY] SMAP supported\n");
     }
+    if (cpu_features & CPU_FEATURE_PGE) {
+        vmm_enable_global_pages();
+        serial_puts("[SECURITY] Global kernel pages enabled\n");
+    }
     
     security_init_stack_canary();
     
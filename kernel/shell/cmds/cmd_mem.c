@@ -1,14 +1,21 @@
 /* Shell Commands - Memory Category
- * mem, hexdump, peek, poke, alloc, memtest
+ * mem, hexdump, peek, poke, alloc, memtest, heapbench, ctxbench, faultaround, swapon
  */
 
 #include <shell/builtins.h>
 #include <kernel/shell.h>
 #include <kernel/kernel.h>
+#include <kernel/scheduler.h>
 #include <drivers/vga.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/heap.h>
+#include <mm/vmalloc.h>
+#include <mm/kstack.h>
+#include <mm/mmap.h>
+#include <mm/swap.h>
+#include <mm/reclaim.h>
+#include <arch/x86/tsc.h>
 #include <string.h>
 
 extern uint32_t _kernel_start;
@@ -259,7 +266,27 @@ void cmd_memtest(int argc, char **argv)
         vga_put_dec((free_before - free_after_free) / 1024);
         vga_puts(" KB leak)\n");
     }
-    
+
+    vga_puts("\nTest 1b: Buddy Order-3 Block\n");
+    vga_puts("----------------------------\n");
+
+    uint32_t block = pmm_alloc_frames(3);
+    if (block == 0) {
+        vga_puts("Result: FAIL (no 32 KB block available)\n");
+    } else {
+        vga_puts("Block at 0x");
+        vga_put_hex(block);
+        vga_puts("\n");
+        pmm_free_frames(block, 3);
+        if (block & ((PAGE_SIZE << 3) - 1)) {
+            vga_puts("Result: FAIL (block not naturally aligned)\n");
+        } else if (pmm_get_free_memory() != free_before) {
+            vga_puts("Result: WARN (block not fully returned)\n");
+        } else {
+            vga_puts("Result: PASS (aligned, coalesced on free)\n");
+        }
+    }
+
     vga_puts("\nTest 2: VMM Virtual Mapping\n");
     vga_puts("---------------------------\n");
     
@@ -389,9 +416,39 @@ void cmd_memtest(int argc, char **argv)
     vga_puts("\n=== All tests complete ===\n");
 }
 
+static void print_dec_padded(uint32_t value, int width)
+{
+    int digits = 1;
+    for (uint32_t v = value; v >= 10; v /= 10) digits++;
+    for (int i = digits; i < width; i++) vga_putchar(' ');
+    vga_put_dec(value);
+}
+
+/* heapstats -t: outstanding heap memory per allocating source file */
+static void heapstats_tags(void)
+{
+    static heap_tag_stats_t tags[HEAP_MAX_TAGS];
+    int count = heap_get_tag_stats(tags, HEAP_MAX_TAGS);
+    
+    vga_puts("Heap usage by tag:\n");
+    vga_puts("  Tag                          Live      Bytes       Peak\n");
+    for (int i = 0; i < count; i++) {
+        vga_puts("  ");
+        vga_puts(tags[i].name);
+        for (int len = (int)strlen(tags[i].name); len < 28; len++) vga_putchar(' ');
+        print_dec_padded(tags[i].live, 6);
+        print_dec_padded(tags[i].bytes, 11);
+        print_dec_padded(tags[i].peak_bytes, 11);
+        vga_puts("\n");
+    }
+}
+
 void cmd_heapstats(int argc, char **argv)
 {
-    (void)argc; (void)argv;
+    if (argc >= 2 && strcmp(argv[1], "-t") == 0) {
+        heapstats_tags();
+        return;
+    }
     
     uint32_t allocs, frees, current, bytes, peak_allocs, peak_bytes;
     heap_get_stats(&allocs, &frees, &current, &bytes, &peak_allocs, &peak_bytes);
@@ -423,6 +480,22 @@ void cmd_heapstats(int argc, char **argv)
     vga_put_dec(peak_bytes);
     vga_puts("\n");
     
+    uint32_t vm_areas, vm_bytes;
+    vmalloc_get_stats(&vm_areas, &vm_bytes);
+    vga_puts("  Vmalloc areas:       ");
+    vga_put_dec(vm_areas);
+    vga_puts(" (");
+    vga_put_dec(vm_bytes / 1024);
+    vga_puts(" KB mapped)\n");
+    
+    uint32_t ks_used, ks_cached;
+    kstack_get_stats(&ks_used, &ks_cached);
+    vga_puts("  Kernel stacks:       ");
+    vga_put_dec(ks_used);
+    vga_puts(" (");
+    vga_put_dec(ks_cached);
+    vga_puts(" cached)\n");
+    
     int leaks = heap_check_leaks();
     if (leaks > 0) {
         vga_puts("\n  WARNING: ");
@@ -433,6 +506,261 @@ void cmd_heapstats(int argc, char **argv)
     }
 }
 
+#define BENCH_OPS       20000
+#define BENCH_SLOTS     256
+#define BENCH_LONG      1024
+
+static void *bench_slots[BENCH_SLOTS];
+static void *bench_long[BENCH_LONG];
+static uint32_t bench_seed;
+
+static uint32_t bench_rand(void)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return bench_seed >> 8;
+}
+
+/* TSC cycles per microsecond as calibrated at boot, 0 without a TSC */
+static uint32_t bench_tsc_per_us(void)
+{
+    return (uint32_t)(tsc_get_hz() / 1000000);
+}
+
+static void bench_report(const char *name, uint64_t cycles, uint32_t ops, uint32_t tsc_per_us)
+{
+    uint32_t ns = (uint32_t)((cycles * 1000) / ((uint64_t)ops * tsc_per_us));
+    vga_puts(name);
+    vga_put_dec(ns);
+    vga_puts(" ns/op\n");
+}
+
+/* Random alloc/free churn over a fixed set of slots */
+static uint64_t bench_churn(uint32_t max_size)
+{
+    uint64_t t0 = tsc_read();
+    for (uint32_t i = 0; i < BENCH_OPS; i++) {
+        uint32_t j = bench_rand() % BENCH_SLOTS;
+        if (bench_slots[j]) {
+            kfree(bench_slots[j]);
+            bench_slots[j] = NULL;
+        } else {
+            bench_slots[j] = kmalloc(16 + bench_rand() % max_size);
+        }
+    }
+    uint64_t t1 = tsc_read();
+    
+    for (int j = 0; j < BENCH_SLOTS; j++) {
+        if (bench_slots[j]) {
+            kfree(bench_slots[j]);
+            bench_slots[j] = NULL;
+        }
+    }
+    return t1 - t0;
+}
+
+void cmd_heapbench(int argc, char **argv)
+{
+    (void)argc; (void)argv;
+    
+    vga_puts("Heap Microbenchmark\n");
+    vga_puts("===================\n\n");
+    
+    uint32_t tsc_per_us = bench_tsc_per_us();
+    if (!tsc_per_us) {
+        vga_puts("Error: no calibrated TSC\n");
+        return;
+    }
+    vga_puts("TSC: ");
+    vga_put_dec(tsc_per_us);
+    vga_puts(" MHz, ");
+    vga_put_dec(BENCH_OPS);
+    vga_puts(" ops per pattern\n\n");
+    
+    bench_seed = 12345;
+    
+    uint64_t t0 = tsc_read();
+    for (uint32_t i = 0; i < BENCH_OPS / 2; i++) {
+        void *p = kmalloc(64);
+        kfree(p);
+    }
+    uint64_t t1 = tsc_read();
+    bench_report("  alloc/free 64B:            ", t1 - t0, BENCH_OPS, tsc_per_us);
+    
+    bench_report("  mixed 16-256B churn:       ", bench_churn(240), BENCH_OPS, tsc_per_us);
+    bench_report("  mixed 16-2KB churn:        ", bench_churn(2032), BENCH_OPS, tsc_per_us);
+    
+    /* Interleave long-lived and short-lived blocks to leave holes, then
+     * churn on top of the fragmented heap.
+     */
+    for (int i = 0; i < BENCH_LONG; i++) {
+        bench_long[i] = kmalloc(16 + bench_rand() % 512);
+        void *tmp = kmalloc(16 + bench_rand() % 512);
+        kfree(tmp);
+    }
+    bench_report("  churn w/ 1024 live blocks: ", bench_churn(2032), BENCH_OPS, tsc_per_us);
+    for (int i = 0; i < BENCH_LONG; i++) {
+        kfree(bench_long[i]);
+        bench_long[i] = NULL;
+    }
+}
+
+#define CTX_BENCH_ROUNDS    5000
+
+static volatile int ctx_bench_active;
+
+static void ctx_bench_partner(void)
+{
+    while (ctx_bench_active) {
+        schedule_force();
+    }
+}
+
+/* Ping-pong with a partner task; each round is two context switches.
+ * A nonzero page directory pins a task to that address space.
+ */
+static uint64_t ctx_bench_run(uint32_t self_pd, uint32_t partner_pd)
+{
+    task_t *self = task_current();
+    if (!self) return 0;
+    
+    ctx_bench_active = 1;
+    task_t *partner = task_create("ctxbench", ctx_bench_partner, 0);
+    if (!partner) return 0;
+    
+    uint32_t saved_pd = self->page_directory;
+    self->page_directory = self_pd;
+    partner->page_directory = partner_pd;
+    
+    schedule_force();
+    
+    uint64_t t0 = tsc_read();
+    for (uint32_t i = 0; i < CTX_BENCH_ROUNDS; i++) {
+        schedule_force();
+    }
+    uint64_t t1 = tsc_read();
+    
+    /* Let the partner see the flag and exit */
+    ctx_bench_active = 0;
+    schedule_force();
+    
+    self->page_directory = saved_pd;
+    return t1 - t0;
+}
+
+void cmd_ctxbench(int argc, char **argv)
+{
+    (void)argc; (void)argv;
+    
+    vga_puts("Context Switch Benchmark\n");
+    vga_puts("========================\n\n");
+    
+    uint32_t tsc_per_us = bench_tsc_per_us();
+    if (!tsc_per_us) {
+        vga_puts("Error: no calibrated TSC\n");
+        return;
+    }
+    vga_puts("TSC: ");
+    vga_put_dec(tsc_per_us);
+    vga_puts(" MHz, ");
+    vga_put_dec(CTX_BENCH_ROUNDS * 2);
+    vga_puts(" switches per run\n\n");
+    
+    uint32_t kernel_pd = vmm_get_kernel_directory();
+    uint32_t other_pd = vmm_create_directory();
+    if (!other_pd) {
+        vga_puts("Error: out of memory\n");
+        return;
+    }
+    
+    vmm_switch_directory(kernel_pd);
+    uint32_t reloads = vmm_get_cr3_switches();
+    uint64_t same = ctx_bench_run(kernel_pd, kernel_pd);
+    uint32_t same_reloads = vmm_get_cr3_switches() - reloads;
+    
+    reloads = vmm_get_cr3_switches();
+    uint64_t cross = ctx_bench_run(kernel_pd, other_pd);
+    uint32_t cross_reloads = vmm_get_cr3_switches() - reloads;
+    
+    vmm_switch_directory(kernel_pd);
+    vmm_destroy_directory(other_pd);
+    
+    bench_report("  same address space:  ", same, CTX_BENCH_ROUNDS * 2, tsc_per_us);
+    vga_puts("    CR3 reloads: ");
+    vga_put_dec(same_reloads);
+    vga_puts("\n");
+    bench_report("  cross address space: ", cross, CTX_BENCH_ROUNDS * 2, tsc_per_us);
+    vga_puts("    CR3 reloads: ");
+    vga_put_dec(cross_reloads);
+    vga_puts("\n");
+}
+
+void cmd_faultaround(int argc, char **argv)
+{
+    if (argc >= 2) {
+        uint32_t pages = shell_parse_dec(argv[1]);
+        if (pages == 0 || pages > FAULT_AROUND_MAX) {
+            vga_puts("Error: window must be 1 - ");
+            vga_put_dec(FAULT_AROUND_MAX);
+            vga_puts(" pages\n");
+            return;
+        }
+        mmap_set_fault_around(pages);
+    }
+    
+    vga_puts("Fault-around window: ");
+    vga_put_dec(mmap_get_fault_around());
+    vga_puts(" page(s)\n");
+}
+
+void cmd_swapon(int argc, char **argv)
+{
+    if (argc >= 4) {
+        int result = swap_enable(shell_parse_dec(argv[1]), shell_parse_dec(argv[2]),
+                                 shell_parse_dec(argv[3]));
+        if (result == -16) {
+            vga_puts("Error: swap is already enabled\n");
+            return;
+        }
+        if (result < 0) {
+            vga_puts("Error: no such ATA disk or range out of bounds\n");
+            return;
+        }
+    } else if (argc != 1) {
+        vga_puts("Usage: swapon <drive> <start_lba> <sectors>\n");
+        return;
+    }
+    
+    int drive;
+    uint32_t start_lba;
+    if (swap_get_device(&drive, &start_lba) != 0) {
+        vga_puts("Swap: disabled\n");
+        return;
+    }
+    
+    uint32_t total, free, ins, outs;
+    swap_get_stats(&total, &free, &ins, &outs);
+    uint32_t runs, cache_freed, swapped;
+    reclaim_get_stats(&runs, &cache_freed, &swapped);
+    
+    vga_puts("Swap: ATA drive ");
+    vga_put_dec(drive);
+    vga_puts(" from LBA ");
+    vga_put_dec(start_lba);
+    vga_puts("\n  Size:       ");
+    vga_put_dec(total * 4);
+    vga_puts(" KB (");
+    vga_put_dec(free * 4);
+    vga_puts(" KB free)\n  Swap in:    ");
+    vga_put_dec(ins);
+    vga_puts(" pages\n  Swap out:   ");
+    vga_put_dec(outs);
+    vga_puts(" pages\n  Reclaims:   ");
+    vga_put_dec(runs);
+    vga_puts(" (");
+    vga_put_dec(cache_freed);
+    vga_puts(" cache pages dropped)\n");
+}
+
 void cmd_leaktest(int argc, char **argv)
 {
     (void)argc; (void)argv;
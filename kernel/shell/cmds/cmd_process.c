@@ -16,8 +16,8 @@ void cmd_ps(int argc, char **argv)
 {
     (void)argc; (void)argv;
     
-    vga_puts("  PID  PPID  STATE     NAME\n");
-    vga_puts("  ---  ----  -------   ----\n");
+    vga_puts("  PID  PPID  STATE     RSS     NAME\n");
+    vga_puts("  ---  ----  -------   ---     ----\n");
     
     uint32_t index = 0;
     process_t *proc;
@@ -38,6 +38,17 @@ void cmd_ps(int argc, char **argv)
             vga_putchar(' ');
         }
         
+        uint32_t rss_kb = proc->rss_pages * 4;
+        vga_put_dec(rss_kb);
+        vga_putchar('K');
+        int digits = 1;
+        for (uint32_t n = rss_kb; n >= 10; n /= 10) {
+            digits++;
+        }
+        for (int i = digits + 1; i < 8; i++) {
+            vga_putchar(' ');
+        }
+        
         vga_puts(proc->name);
         vga_puts("\n");
     }
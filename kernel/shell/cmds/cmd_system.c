@@ -13,6 +13,7 @@
 #include <arch/x86/idt.h>
 #include <apic/lapic.h>
 #include <apic/ioapic.h>
+#include <arch/x86/smp.h>
 #include <string.h>
 
 extern uint32_t _kernel_start;
@@ -213,6 +214,9 @@ void cmd_apic(int argc, char **argv)
         vga_put_dec(lapic_get_id());
         vga_puts("\n");
         vga_puts("LAPIC:       Enabled\n");
+        vga_puts("CPUs:        ");
+        vga_put_dec(smp_cpu_count());
+        vga_puts(" online\n");
         
         if (lapic_is_enabled()) {
             vga_puts("Timer:       LAPIC @ ");
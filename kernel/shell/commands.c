@@ -69,7 +69,11 @@ static shell_command_t mem_commands[] = {
     {"poke",      "Write memory: poke <addr> <val>",   cmd_poke},
     {"alloc",     "Allocate memory: alloc <size>",     cmd_alloc},
     {"memtest",   "Test memory allocation/mapping",    cmd_memtest},
-    {"heapstats", "Show heap allocation statistics",   cmd_heapstats},
+    {"heapstats", "Heap statistics (-t: per tag)",     cmd_heapstats},
+    {"heapbench", "Benchmark kmalloc/kfree (ns/op)",   cmd_heapbench},
+    {"ctxbench",  "Benchmark context switch cost",     cmd_ctxbench},
+    {"faultaround", "Get/set mmap fault-around pages", cmd_faultaround},
+    {"swapon",    "Swap area: swapon <drv> <lba> <n>", cmd_swapon},
     {"leaktest",  "Test memory leak detection",        cmd_leaktest},
     {NULL, NULL, NULL}
 };
@@ -214,7 +218,7 @@ shell_command_t shell_commands[] = {
     {"poke",      "Write memory: poke <addr> <val>",   cmd_poke},
     {"alloc",     "Allocate memory: alloc <size>",     cmd_alloc},
     {"memtest",   "Test memory allocation/mapping",    cmd_memtest},
-    {"heapstats", "Show heap allocation statistics",   cmd_heapstats},
+    {"heapstats", "Heap statistics (-t: per tag)",     cmd_heapstats},
     {"leaktest",  "Test memory leak detection",        cmd_leaktest},
     /* Disk */
     {"lsblk",    "List block devices (disks)",        cmd_lsblk},
@@ -11,6 +11,7 @@
 #include <drivers/keyboard.h>
 #include <drivers/mouse.h>
 #include <drivers/serial.h>
+#include <kernel/timer.h>
 #include <fs/vfs.h>
 #include <string.h>
 
@@ -837,6 +838,13 @@ void shell_run(void)
         keyboard_process_events();
         mouse_process_events();
         fb_flush();
-        __asm__ volatile("sti; hlt");
+        
+        /* Input is queued by interrupts; check again with them off */
+        cli();
+        if (keyboard_has_event() || mouse_has_event()) {
+            sti();
+            continue;
+        }
+        timer_idle_halt();
     }
 }
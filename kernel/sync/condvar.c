@@ -7,7 +7,6 @@
 #include <sync/mutex.h>
 #include <sync/waitqueue.h>
 #include <kernel/scheduler.h>
-#include <mm/heap.h>
 
 void condvar_init(condvar_t *cv)
 {
@@ -20,7 +19,7 @@ void condvar_wait(condvar_t *cv, mutex_t *mutex)
     task_t *current = task_current();
     if (!current) return;
     
-    wait_queue_entry_t *entry = (wait_queue_entry_t *)kmalloc(sizeof(wait_queue_entry_t));
+    wait_queue_entry_t *entry = waitqueue_entry_alloc();
     if (!entry) return;
     
     entry->task = current;
@@ -59,7 +58,7 @@ void condvar_signal(condvar_t *cv)
         }
         
         task_t *task = entry->task;
-        kfree(entry);
+        waitqueue_entry_free(entry);
         
         spinlock_irq_restore(&cv->lock, flags);
         
@@ -81,7 +80,7 @@ void condvar_broadcast(condvar_t *cv)
         cv->waiters.head = entry->next;
         
         task_t *task = entry->task;
-        kfree(entry);
+        waitqueue_entry_free(entry);
         
         if (task) {
             task_unblock(task);
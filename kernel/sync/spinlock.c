@@ -4,15 +4,20 @@
 
 #include <kernel/kernel.h>
 #include <sync/spinlock.h>
+#include <arch/x86/smp.h>
 
 void spinlock_init(spinlock_t *lock)
 {
     lock->locked = 0;
 }
 
+/* While spinning, answer TLB shootdowns: the holder may be waiting for
+ * this CPU to flush, and interrupts may be off.
+ */
 void spinlock_acquire(spinlock_t *lock)
 {
     while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        smp_tlb_poll();
         __asm__ volatile("pause");
     }
 }
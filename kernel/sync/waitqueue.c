@@ -5,7 +5,31 @@
 #include <kernel/kernel.h>
 #include <sync/waitqueue.h>
 #include <kernel/scheduler.h>
-#include <mm/heap.h>
+#include <mm/slab.h>
+
+static kmem_cache_t *wq_entry_cache = NULL;
+static spinlock_t wq_cache_lock = SPINLOCK_INIT;
+
+wait_queue_entry_t *waitqueue_entry_alloc(void)
+{
+    if (!wq_entry_cache) {
+        /* First use may race on several CPUs; only one creates the cache */
+        uint32_t flags;
+        spinlock_irq_save(&wq_cache_lock, &flags);
+        if (!wq_entry_cache) {
+            wq_entry_cache = kmem_cache_create("wait_queue_entry", sizeof(wait_queue_entry_t), 0, NULL);
+        }
+        spinlock_irq_restore(&wq_cache_lock, flags);
+        if (!wq_entry_cache) return NULL;
+    }
+    
+    return (wait_queue_entry_t *)kmem_cache_alloc(wq_entry_cache);
+}
+
+void waitqueue_entry_free(wait_queue_entry_t *entry)
+{
+    kmem_cache_free(wq_entry_cache, entry);
+}
 
 void waitqueue_init(wait_queue_t *wq)
 {
@@ -19,7 +43,7 @@ void waitqueue_wait(wait_queue_t *wq)
     task_t *current = task_current();
     if (!current) return;
     
-    wait_queue_entry_t *entry = (wait_queue_entry_t *)kmalloc(sizeof(wait_queue_entry_t));
+    wait_queue_entry_t *entry = waitqueue_entry_alloc();
     if (!entry) return;
     
     entry->task = current;
@@ -35,8 +59,13 @@ void waitqueue_wait(wait_queue_t *wq)
         wq->head = wq->tail = entry;
     }
     
+    /* Blocked before the lock drops: a wake that gets in ahead of
+     * schedule_force then finds the task blocked and requeues it.
+     */
+    current->state = TASK_STATE_BLOCKED;
+    current->block_reason = BLOCK_REASON_WAITQUEUE;
     spinlock_irq_restore(&wq->lock, flags);
-    task_block(0);
+    schedule_force();
 }
 
 void waitqueue_wake_one(wait_queue_t *wq)
@@ -53,7 +82,7 @@ void waitqueue_wake_one(wait_queue_t *wq)
         }
         
         task_t *task = entry->task;
-        kfree(entry);
+        waitqueue_entry_free(entry);
         
         spinlock_irq_restore(&wq->lock, flags);
         
@@ -75,7 +104,7 @@ void waitqueue_wake_all(wait_queue_t *wq)
         wq->head = entry->next;
         
         task_t *task = entry->task;
-        kfree(entry);
+        waitqueue_entry_free(entry);
         
         if (task) {
             task_unblock(task);
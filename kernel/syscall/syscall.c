@@ -7,6 +7,7 @@
 #include <syscall/syscall.h>
 #include <syscall/syscall_internal.h>
 #include <arch/x86/idt.h>
+#include <arch/x86/smp.h>
 #include <mm/vmm.h>
 
 #define SYS_EXIT    0
@@ -180,6 +181,18 @@ static syscall_handler_t syscall_table[MAX_SYSCALL] = {
     [SYS_SELECT] = sys_select,
 };
 
+/* Frame of the syscall each CPU is running, see syscall_arg5 */
+static registers_t *syscall_frame[SMP_MAX_CPUS];
+
+/* The sixth argument, passed in ebp, for the few calls that take one.
+ * Read it on entry, before the handler can block and let another
+ * syscall run on this CPU.
+ */
+uint32_t syscall_arg5(void)
+{
+    return syscall_frame[smp_cpu_id()]->ebp;
+}
+
 static void syscall_handler(registers_t *regs)
 {
     uint32_t syscall_num = regs->eax;
@@ -194,6 +207,7 @@ static void syscall_handler(registers_t *regs)
     uint32_t arg2 = regs->edx;
     uint32_t arg3 = regs->esi;
     uint32_t arg4 = regs->edi;
+    syscall_frame[smp_cpu_id()] = regs;
     int32_t result = syscall_table[syscall_num](arg0, arg1, arg2, arg3, arg4);
 
     regs->eax = (uint32_t)result;
@@ -4,14 +4,17 @@
 
 #include <kernel/kernel.h>
 #include <kernel/process.h>
+#include <kernel/scheduler.h>
 #include <kernel/elf.h>
 #include <kernel/signal.h>
 #include <kernel/ipc.h>
 #include <mm/mmap.h>
+#include <mm/vmm.h>
 #include <syscall/syscall_internal.h>
 #include <drivers/vga.h>
 #include <drivers/serial.h>
 #include <mm/heap.h>
+#include <mm/kstack.h>
 
 extern void shell_run(void);
 
@@ -63,10 +66,17 @@ int32_t sys_exit(uint32_t status, uint32_t arg1, uint32_t arg2, uint32_t arg3, u
         }
     }
 
+    /* Back to the kernel's address space so the program's can be freed */
+    vmm_switch_directory(vmm_get_kernel_directory());
+    task_t *task = task_current();
+    if (task) {
+        task->page_directory = 0;
+    }
+
     process_t *current = process_current();
     if (current && current->pid > 1) {
         if (current->kernel_stack) {
-            kfree((void *)current->kernel_stack);
+            task_stack_free((void *)current->kernel_stack, KSTACK_DEFAULT_SIZE);
             current->kernel_stack = 0;
         }
         if (current->elf_proc) {
@@ -78,7 +88,6 @@ int32_t sys_exit(uint32_t status, uint32_t arg1, uint32_t arg2, uint32_t arg3, u
 
     process_set_current(1);
 
-    extern void *kmalloc(uint32_t size);
     uint32_t new_stack;
     if (shell_stack_top != 0) {
         new_stack = shell_stack_top;
@@ -240,9 +249,13 @@ int32_t sys_msgrcv(uint32_t msqid, uint32_t msgp, uint32_t msgsz, uint32_t mtype
     return msgq_receive((int)msqid, (void *)msgp, msgsz, (long)mtype);
 }
 
+/* The file offset is the sixth argument; sys_mmap rejects one that is
+ * not page aligned and ignores it for anonymous mappings.
+ */
 int32_t sys_mmap_handler(uint32_t addr, uint32_t length, uint32_t prot, uint32_t flags, uint32_t fd)
 {
-    void *result = sys_mmap((void *)addr, length, (int)prot, (int)flags, (int)fd, 0);
+    uint32_t offset = syscall_arg5();
+    void *result = sys_mmap((void *)addr, length, (int)prot, (int)flags, (int)fd, offset);
     return (int32_t)(uint32_t)result;
 }
 
@@ -261,5 +274,5 @@ int32_t sys_mprotect_handler(uint32_t addr, uint32_t length, uint32_t prot, uint
 int32_t sys_brk_handler(uint32_t addr, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
 {
     (void)arg1; (void)arg2; (void)arg3; (void)arg4;
-    return (int32_t)addr;
+    return (int32_t)sys_brk(addr);
 }
@@ -0,0 +1,216 @@
+/* User-space malloc
+ * Size-class allocator on top of the program break
+ *
+ * Small requests are rounded up to a power-of-two class between 16 and
+ * 2048 bytes, header included. Each class has its own free list, refilled
+ * by carving a fresh page from sbrk into equal blocks, so malloc and free
+ * are a list pop and push. Anything bigger gets its own anonymous mmap
+ * and is unmapped again on free.
+ */
+
+#include "stdlib.h"
+
+#define SYS_MMAP    24
+#define SYS_MUNMAP  25
+#define SYS_BRK     27
+
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define MAP_PRIVATE     0x02
+#define MAP_ANONYMOUS   0x20
+#define MAP_FAILED      ((void *)-1)
+
+#define PAGE_SIZE       4096
+#define MIN_SHIFT       4           /* 16-byte class */
+#define NUM_CLASSES     8           /* 16 .. 2048 */
+#define LARGE_CLASS     0xFF
+#define BLOCK_MAGIC     0xA110C000
+
+/* Keeps the payload 8-byte aligned */
+typedef struct block_header {
+    unsigned int magic;             /* BLOCK_MAGIC | class */
+    unsigned int size;              /* usable bytes */
+} block_header_t;
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block_t;
+
+static free_block_t *free_lists[NUM_CLASSES];
+static char *heap_end = 0;
+
+static inline int syscall1(int num, int arg1)
+{
+    int ret;
+    __asm__ volatile (
+        "int $0x80"
+        : "=a"(ret)
+        : "a"(num), "b"(arg1)
+        : "memory"
+    );
+    return ret;
+}
+
+static inline int syscall2(int num, int arg1, int arg2)
+{
+    int ret;
+    __asm__ volatile (
+        "int $0x80"
+        : "=a"(ret)
+        : "a"(num), "b"(arg1), "c"(arg2)
+        : "memory"
+    );
+    return ret;
+}
+
+static inline int syscall5(int num, int arg1, int arg2, int arg3, int arg4, int arg5)
+{
+    int ret;
+    __asm__ volatile (
+        "int $0x80"
+        : "=a"(ret)
+        : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3), "S"(arg4), "D"(arg5)
+        : "memory"
+    );
+    return ret;
+}
+
+int brk(void *addr)
+{
+    char *result = (char *)syscall1(SYS_BRK, (int)addr);
+    heap_end = result;
+    return result == (char *)addr ? 0 : -1;
+}
+
+void *sbrk(int increment)
+{
+    if (!heap_end) {
+        heap_end = (char *)syscall1(SYS_BRK, 0);
+        if (!heap_end) return (void *)-1;
+    }
+    
+    char *old_end = heap_end;
+    if (increment != 0 && brk(old_end + increment) != 0) {
+        return (void *)-1;
+    }
+    return old_end;
+}
+
+static void *memset_bytes(void *dst, int value, size_t n)
+{
+    unsigned char *d = (unsigned char *)dst;
+    while (n--) *d++ = (unsigned char)value;
+    return dst;
+}
+
+static void *memcpy_bytes(void *dst, const void *src, size_t n)
+{
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+    while (n--) *d++ = *s++;
+    return dst;
+}
+
+/* Smallest class whose blocks fit size bytes plus the header */
+static int size_class(size_t size)
+{
+    size_t total = size + sizeof(block_header_t);
+    int cls = 0;
+    while (cls < NUM_CLASSES && ((size_t)1 << (cls + MIN_SHIFT)) < total) {
+        cls++;
+    }
+    return cls;
+}
+
+/* Split a fresh page from the break into blocks of one class */
+static int refill(int cls)
+{
+    size_t block = (size_t)1 << (cls + MIN_SHIFT);
+    char *page = (char *)sbrk(PAGE_SIZE);
+    if (page == (char *)-1) return -1;
+    
+    for (size_t off = 0; off + block <= PAGE_SIZE; off += block) {
+        free_block_t *fb = (free_block_t *)(page + off);
+        fb->next = free_lists[cls];
+        free_lists[cls] = fb;
+    }
+    return 0;
+}
+
+void *malloc(size_t size)
+{
+    if (size == 0) return NULL;
+    /* Keeps size + header, rounded up to a page, from wrapping */
+    if (size > 0xFFFFFFFF - sizeof(block_header_t) - PAGE_SIZE) return NULL;
+    
+    int cls = size_class(size);
+    block_header_t *hdr;
+    
+    if (cls < NUM_CLASSES) {
+        if (!free_lists[cls] && refill(cls) != 0) return NULL;
+        
+        hdr = (block_header_t *)free_lists[cls];
+        free_lists[cls] = free_lists[cls]->next;
+        hdr->magic = BLOCK_MAGIC | cls;
+        hdr->size = ((size_t)1 << (cls + MIN_SHIFT)) - sizeof(block_header_t);
+    } else {
+        size_t length = (size + sizeof(block_header_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        void *mem = (void *)syscall5(SYS_MMAP, 0, (int)length, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1);
+        if (mem == MAP_FAILED) return NULL;
+        
+        hdr = (block_header_t *)mem;
+        hdr->magic = BLOCK_MAGIC | LARGE_CLASS;
+        hdr->size = length - sizeof(block_header_t);
+    }
+    
+    return hdr + 1;
+}
+
+void free(void *ptr)
+{
+    if (!ptr) return;
+    
+    block_header_t *hdr = (block_header_t *)ptr - 1;
+    if ((hdr->magic & ~0xFFu) != BLOCK_MAGIC) return;
+    
+    unsigned int cls = hdr->magic & 0xFF;
+    hdr->magic = 0;
+    
+    if (cls == LARGE_CLASS) {
+        syscall2(SYS_MUNMAP, (int)hdr, (int)(hdr->size + sizeof(block_header_t)));
+    } else if (cls < NUM_CLASSES) {
+        free_block_t *fb = (free_block_t *)hdr;
+        fb->next = free_lists[cls];
+        free_lists[cls] = fb;
+    }
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (size && count > 0xFFFFFFFF / size) return NULL;
+    
+    size_t total = count * size;
+    void *ptr = malloc(total);
+    if (ptr) memset_bytes(ptr, 0, total);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!ptr) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    
+    block_header_t *hdr = (block_header_t *)ptr - 1;
+    if ((hdr->magic & ~0xFFu) != BLOCK_MAGIC) return NULL;
+    if (size <= hdr->size) return ptr;
+    
+    void *new_ptr = malloc(size);
+    if (!new_ptr) return NULL;
+    memcpy_bytes(new_ptr, ptr, hdr->size);
+    free(ptr);
+    return new_ptr;
+}
@@ -0,0 +1,18 @@
+#ifndef _STDLIB_H
+#define _STDLIB_H
+
+typedef unsigned int size_t;
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+void *malloc(size_t size);
+void free(void *ptr);
+void *calloc(size_t count, size_t size);
+void *realloc(void *ptr, size_t size);
+
+int brk(void *addr);
+void *sbrk(int increment);
+
+#endif
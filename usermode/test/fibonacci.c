@@ -1,5 +1,7 @@
 /* Fibonacci program - prints first 15 Fibonacci numbers */
 
+#include <stdlib.h>
+
 #define SYS_EXIT   0
 #define SYS_WRITE  2
 
@@ -61,20 +63,28 @@ void _start(void)
 {
     print("Fibonacci sequence (first 15 numbers):\n");
     
-    int a = 0, b = 1;
+    int count = 15;
+    int *fib = (int *)malloc(count * sizeof(int));
+    if (!fib) {
+        print("malloc failed\n");
+        syscall1(SYS_EXIT, 1);
+    }
+    
+    fib[0] = 0;
+    fib[1] = 1;
+    for (int i = 2; i < count; i++) {
+        fib[i] = fib[i - 1] + fib[i - 2];
+    }
     
-    for (int i = 0; i < 15; i++) {
+    for (int i = 0; i < count; i++) {
         print("  fib(");
         print_num(i);
         print(") = ");
-        print_num(a);
+        print_num(fib[i]);
         print("\n");
-        
-        int next = a + b;
-        a = b;
-        b = next;
     }
     
+    free(fib);
     print("Done!\n");
     syscall1(SYS_EXIT, 0);
     
@@ -1,5 +1,7 @@
 /* Memory test program - tests user memory access */
 
+#include <stdlib.h>
+
 #define SYS_EXIT   0
 #define SYS_WRITE  2
 
@@ -47,11 +49,13 @@ static void print_hex(unsigned int n)
 
 void _start(void)
 {
+    int failures = 0;
+    
     print("Memory Test Program\n");
     print("===================\n\n");
     
     print("Testing stack memory...\n");
-    volatile int stack_var = 0x12345678;
+    volatile unsigned int stack_var = 0x12345678;
     print("  Stack variable at 0x");
     print_hex((unsigned int)&stack_var);
     print(" = 0x");
@@ -66,6 +70,7 @@ void _start(void)
         print(" [OK]\n");
     } else {
         print(" [FAIL]\n");
+        failures++;
     }
     
     print("\nTesting array on stack...\n");
@@ -93,9 +98,63 @@ void _start(void)
         print(" [OK]\n");
     } else {
         print(" [FAIL]\n");
+        failures++;
+    }
+    
+    print("\nTesting heap (malloc/free)...\n");
+    char *first = (char *)sbrk(0);
+    int *nodes[64];
+    int heap_ok = 1;
+    for (int i = 0; i < 64; i++) {
+        nodes[i] = (int *)malloc(24);
+        if (!nodes[i]) {
+            heap_ok = 0;
+            break;
+        }
+        nodes[i][0] = i;
+        nodes[i][5] = ~i;
+    }
+    for (int i = 0; heap_ok && i < 64; i++) {
+        if (nodes[i][0] != i || nodes[i][5] != ~i) heap_ok = 0;
+    }
+    print("  64 small blocks, break moved by 0x");
+    print_hex((unsigned int)((char *)sbrk(0) - first));
+    print(heap_ok ? " [OK]\n" : " [FAIL]\n");
+    if (!heap_ok) failures++;
+    
+    for (int i = 0; i < 64; i++) {
+        free(nodes[i]);
     }
+    int *again = (int *)malloc(24);
+    print("  Freed block reused");
+    print(again == nodes[63] ? " [OK]\n" : " [FAIL]\n");
+    if (again != nodes[63]) failures++;
+    free(again);
     
-    print("\nAll tests passed!\n");
-    syscall1(SYS_EXIT, 0);
+    char *big = (char *)calloc(64, 1024);
+    int big_ok = big != 0;
+    /* Tag each page with its index so realloc must carry all of them */
+    for (int i = 0; big_ok && i < 64 * 1024; i += 4096) {
+        if (big[i] != 0) big_ok = 0;
+        big[i] = (char)(i / 4096 + 1);
+    }
+    if (big_ok) {
+        big = (char *)realloc(big, 128 * 1024);
+        if (!big) big_ok = 0;
+    }
+    for (int i = 0; big_ok && i < 64 * 1024; i += 4096) {
+        if (big[i] != (char)(i / 4096 + 1)) big_ok = 0;
+    }
+    print("  64 KB calloc + realloc to 128 KB");
+    print(big_ok ? " [OK]\n" : " [FAIL]\n");
+    if (!big_ok) failures++;
+    free(big);
+    
+    if (failures) {
+        print("\nSome tests FAILED\n");
+    } else {
+        print("\nAll tests passed!\n");
+    }
+    syscall1(SYS_EXIT, failures);
     while(1);
 }
@@ -6,6 +6,8 @@
 
 #define SYS_EXIT    0
 #define SYS_WRITE   2
+#define SYS_OPEN    3
+#define SYS_CLOSE   4
 #define SYS_MMAP    24
 #define SYS_MUNMAP  25
 #define SYS_MPROTECT 26
@@ -21,6 +23,10 @@
 
 #define MAP_FAILED  ((void *)-1)
 
+#define O_RDWR      0x0003
+#define O_CREAT     0x0100
+#define O_TRUNC     0x0200
+
 static inline int syscall1(int num, int arg1)
 {
     int ret;
@@ -54,6 +60,22 @@ static inline int syscall5(int num, int arg1, int arg2, int arg3, int arg4, int
     return ret;
 }
 
+/* The sixth argument goes in ebp, which has to be preserved */
+static inline int syscall6(int num, int arg1, int arg2, int arg3, int arg4, int arg5, int arg6)
+{
+    int ret;
+    __asm__ volatile (
+        "pushl %7\n"
+        "xchgl %%ebp, (%%esp)\n"
+        "int $0x80\n"
+        "popl %%ebp"
+        : "=a"(ret)
+        : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3), "S"(arg4), "D"(arg5), "g"(arg6)
+        : "memory"
+    );
+    return ret;
+}
+
 static void print(const char *str)
 {
     int len = 0;
@@ -86,9 +108,9 @@ static void print_num(int n)
     print(buf);
 }
 
-static void *mmap(void *addr, unsigned int len, int prot, int flags, int fd)
+static void *mmap(void *addr, unsigned int len, int prot, int flags, int fd, unsigned int offset)
 {
-    return (void *)syscall5(SYS_MMAP, (int)addr, len, prot, flags, fd);
+    return (void *)syscall6(SYS_MMAP, (int)addr, len, prot, flags, fd, (int)offset);
 }
 
 static int munmap(void *addr, unsigned int len)
@@ -101,13 +123,23 @@ static int mprotect(void *addr, unsigned int len, int prot)
     return syscall3(SYS_MPROTECT, (int)addr, len, prot);
 }
 
+static int open(const char *path, int flags)
+{
+    return syscall3(SYS_OPEN, (int)path, flags, 0);
+}
+
+static int close(int fd)
+{
+    return syscall1(SYS_CLOSE, fd);
+}
+
 void _start(void)
 {
     print("=== Virtual Memory Test Program ===\n\n");
     
     /* Test 1: Anonymous mmap */
     print("Test 1: Anonymous mmap (4KB)\n");
-    void *ptr1 = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+    void *ptr1 = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     print("  mmap returned: ");
     print_hex((unsigned int)ptr1);
     print("\n");
@@ -130,7 +162,7 @@ void _start(void)
     
     /* Test 2: Larger anonymous mmap */
     print("Test 2: Anonymous mmap (64KB)\n");
-    void *ptr2 = mmap(NULL, 65536, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+    void *ptr2 = mmap(NULL, 65536, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     print("  mmap returned: ");
     print_hex((unsigned int)ptr2);
     print("\n");
@@ -181,7 +213,7 @@ void _start(void)
     /* Test 5: Fixed address mmap */
     print("Test 5: Fixed address mmap\n");
     void *fixed_addr = (void *)0x50000000;
-    void *ptr3 = mmap(fixed_addr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | 0x10, -1);
+    void *ptr3 = mmap(fixed_addr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | 0x10, -1, 0);
     print("  Requested: ");
     print_hex((unsigned int)fixed_addr);
     print("\n  Got: ");
@@ -192,6 +224,40 @@ void _start(void)
     }
     print("\n");
     
+    /* Test 6: File-backed mmap through the page cache */
+    print("Test 6: File-backed mmap\n");
+    int fd = open("/vmtest.dat", O_RDWR | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+        print("  open failed\n");
+    } else {
+        syscall3(SYS_WRITE, fd, (int)"page cache", 10);
+        
+        char *shared = (char *)mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        char *priv = (char *)mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (shared == MAP_FAILED || priv == MAP_FAILED) {
+            print("  mmap failed\n");
+        } else {
+            print("  Shared sees: ");
+            syscall3(SYS_WRITE, 1, (int)shared, 10);
+            print("\n");
+            
+            priv[0] = 'P';
+            print("  Private write isolated: ");
+            print(shared[0] == 'p' ? "OK" : "FAILED");
+            print("\n");
+            
+            shared[0] = 'S';
+            print("  Private copy kept: ");
+            print(priv[0] == 'P' ? "OK" : "FAILED");
+            print("\n");
+            
+            munmap(priv, 4096);
+            munmap(shared, 4096);
+        }
+        close(fd);
+    }
+    print("\n");
+    
     print("=== All VM tests completed! ===\n");
     
     syscall1(SYS_EXIT, 0);